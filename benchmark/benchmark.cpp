@@ -1,10 +1,27 @@
 #include <sajson.h>
+#include <sajson_binary.h>
+#include <sajson_compressed.h>
+#include <sajson_ingest.h>
 #include <sajson_dump.h>
+#include <sajson_minify.h>
+#include <sajson_mmap.h>
+#include <sajson_parallel.h>
 
+#include <algorithm>
+#include <array>
+#include <initializer_list>
 #include <memory>
 #include <vector>
 #include <chrono>
 #include <cstdio>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 using namespace std::chrono;
 
@@ -17,155 +34,722 @@ const std::vector<std::string> default_files {
     "testdata/whitespace.json",
 };
 
-template <typename AllocationStrategy>
-void run_benchmark(size_t N, size_t max_string_length, const std::string &filename) {
+// Total and fastest time of one measured body over all runs.
+struct timing {
+    microseconds total { 0 };
+    microseconds fastest { microseconds::max() };
+
+    template <typename Body>
+    void add(Body &&body) {
+        const auto before = high_resolution_clock::now();
+        body();
+        const auto elapsed = duration_cast<microseconds>(high_resolution_clock::now() - before);
+        total += elapsed;
+        fastest = std::min(fastest, elapsed);
+    }
+
+    double average_ms(size_t N) const {
+        return static_cast<double>(total.count()) / 1e3 / static_cast<double>(N);
+    }
+
+    double fastest_ms() const {
+        return static_cast<double>(fastest.count()) / 1e3;
+    }
+};
+
+// Runs each body N times, taking turns so that all of them see the same
+// conditions, and returns their timings in order.
+template <typename... Bodies>
+static std::array<timing, sizeof...(Bodies)> measure(size_t N, Bodies &&...bodies) {
+    std::array<timing, sizeof...(Bodies)> timings;
+    for (size_t i = 0; i < N; ++i) {
+        size_t k = 0;
+        (timings[k++].add(bodies), ...);
+    }
+    return timings;
+}
+
+static double megabytes_per_second(size_t bytes, double ms) {
+    return ms > 0 ? static_cast<double>(bytes) / 1e3 / ms : 0.0;
+}
+
+// One cell of "time throughput", 25 characters wide.
+static void print_throughput(double ms, size_t bytes) {
+    printf("   %8.3f ms %8.1f MB/s", ms, megabytes_per_second(bytes, ms));
+}
+
+// One cell of time, 17 characters wide.
+static void print_ms(double ms) {
+    printf("   %14.3f ms", ms);
+}
+
+struct column {
+    const char *title;
+    int width;
+};
+
+// Prints the titles of the file column and the given columns, each right
+// aligned to its width and underlined.  Returns the file column's width.
+static size_t print_header(const std::vector<std::string> &files, std::initializer_list<column> columns) {
+    const auto max_string_length = std::max_element(files.begin(), files.end(), [](const auto &A, const auto &B) {
+        return A.size() < B.size();
+    })->size();
+
+    printf("%*s", static_cast<int>(max_string_length), "file");
+    for (const auto &c: columns) {
+        printf("   %*s", c.width, c.title);
+    }
+    printf("\n%*s", static_cast<int>(max_string_length), "----");
+    for (const auto &c: columns) {
+        printf("   %*s", c.width, std::string(strlen(c.title), '-').c_str());
+    }
+    printf("\n");
+
+    return max_string_length;
+}
+
+// Prints the header, then runs the benchmark on each file, which prints
+// one row.
+static void run_files(
+        size_t N,
+        const std::vector<std::string> &files,
+        std::initializer_list<column> columns,
+        void (*run)(size_t N, size_t max_string_length, const std::string &filename)) {
+    const auto max_string_length = print_header(files, columns);
+
+    for (const auto &fname: files) {
+        run(N, max_string_length, fname);
+    }
+}
+
+static bool read_file(const std::string &filename, std::vector<char> &buffer) {
     std::FILE* file = std::fopen(filename.c_str(), "rb");
     if (!file) {
         perror("fopen failed");
-        return;
+        return false;
     }
 
     std::unique_ptr<FILE, int (*)(FILE*)> deleter(file, fclose);
 
     if (std::fseek(file, 0, SEEK_END)) {
         perror("fseek failed");
-        return;
+        return false;
     }
     size_t length = static_cast<size_t>(ftell(file));
     if (std::fseek(file, 0, SEEK_SET)) {
         perror("fseek failed");
-        return;
+        return false;
     }
 
-    std::vector<char> buffer(length);
-    if (std::fread(buffer.data(), length, 1, file) != 1) {
+    buffer.resize(length);
+    if (length && std::fread(buffer.data(), length, 1, file) != 1) {
         perror("fread failed");
-        return;
+        return false;
     }
+    return true;
+}
 
-    deleter.reset();
+// Reads the file and parses it in place, for benchmarks that work on a
+// parsed document.  Prints the file's row and returns false if either
+// fails.
+static bool load_document(size_t max_string_length, const std::string &filename, std::vector<char> &buffer, sajson::document &doc) {
+    if (!read_file(filename, buffer)) {
+        return false;
+    }
+    doc = sajson::parse(sajson::single_allocation(), sajson::mutable_string_view(buffer.size(), buffer.data()));
+    if (!doc.is_valid()) {
+        printf("%*s   (parse failed)\n", static_cast<int>(max_string_length), filename.c_str());
+        return false;
+    }
+    return true;
+}
 
-    microseconds minimum_each { std::numeric_limits<clock_t>::max() };
-    const auto start = high_resolution_clock::now();
+static std::FILE *open_dev_null() {
+    std::FILE *dev_null = std::fopen("/dev/null", "wb");
+    if (!dev_null) {
+        perror("fopen failed");
+    }
+    return dev_null;
+}
+
+template <typename AllocationStrategy>
+void run_benchmark(size_t N, size_t max_string_length, const std::string &filename) {
+    std::vector<char> buffer;
+    if (!read_file(filename, buffer)) {
+        return;
+    }
 
     printf("%*s   ",static_cast<int>(max_string_length), filename.c_str());
     std::fflush(stdout);
 
-    for (size_t i = 0; i < N; ++i) {
-        const auto before_each = high_resolution_clock::now();;
-
+    const auto [parse] = measure(N, [&] {
         sajson::parse(AllocationStrategy(), std::string_view(buffer.data(), buffer.size()));
+    });
+
+    printf("%0.3f ms   %0.3f ms\n", parse.average_ms(N), parse.fastest_ms());
+}
+
 
-        const auto elapsed_each = duration_cast<microseconds>(high_resolution_clock::now() - before_each);
-        minimum_each = std::min(minimum_each, elapsed_each);
+static void run_dump_benchmark(size_t N, size_t max_string_length, const std::string &filename) {
+    std::vector<char> buffer;
+    sajson::document doc;
+    if (!load_document(max_string_length, filename, buffer, doc)) {
+        return;
+    }
+
+    std::FILE *dev_null = open_dev_null();
+    if (!dev_null) {
+        return;
     }
 
-    const auto elapsed = duration_cast<microseconds>(high_resolution_clock::now() - start);
+    printf("%*s   ",static_cast<int>(max_string_length), filename.c_str());
+    std::fflush(stdout);
+
+    const auto [write] = measure(N, [&] {
+        sajson::write(dev_null, doc.get_root());
+    });
 
-    const double average_elapsed_ms = static_cast<double>(elapsed.count()) / 1e3 / static_cast<double>(N);
-    const double minimum_elapsed_ms = static_cast<double>(minimum_each.count()) / 1e3;
+    std::fclose(dev_null);
 
-    printf("%0.3f ms   %0.3f ms\n", average_elapsed_ms, minimum_elapsed_ms);
+    printf("%0.3f ms   %0.3f ms\n", write.average_ms(N), write.fastest_ms());
 }
 
+// Average number of AST and stack reallocations per parse.
+static double average_reallocations(size_t N, const std::vector<char> &buffer, size_t ast_capacity, size_t stack_capacity, sajson::allocation_statistics *shared) {
+    size_t reallocations = 0;
+    for (size_t i = 0; i < N; ++i) {
+        // Without shared statistics, every parse starts from scratch.
+        sajson::allocation_statistics fresh;
+        auto &statistics = shared ? *shared : fresh;
+        const auto before = statistics.get_reallocation_count();
+        sajson::parse(sajson::dynamic_allocation(ast_capacity, stack_capacity, &statistics), std::string_view(buffer.data(), buffer.size()));
+        reallocations += statistics.get_reallocation_count() - before;
+    }
+    return static_cast<double>(reallocations) / static_cast<double>(N);
+}
 
-static void run_dump_benchmark(size_t N, size_t max_string_length, const std::string &filename) {
+static void run_reallocation_benchmark(size_t N, size_t max_string_length, const std::string &filename) {
+    std::vector<char> buffer;
+    if (!read_file(filename, buffer)) {
+        return;
+    }
 
-    printf("%*s   reading...", static_cast<int>(max_string_length), filename.c_str());
+    printf("%*s   ", static_cast<int>(max_string_length), filename.c_str());
     std::fflush(stdout);
 
-    std::FILE* file = std::fopen(filename.c_str(), "rb");
-    if (!file) {
-        perror("fopen failed");
+    const double fixed = average_reallocations(N, buffer, 1024, 256, nullptr);
+    const double sized = average_reallocations(N, buffer, 0, 0, nullptr);
+
+    sajson::allocation_statistics shared;
+    // one parse to learn the ratio, then measure
+    average_reallocations(1, buffer, 0, 0, &shared);
+    const double feedback = average_reallocations(N, buffer, 0, 0, &shared);
+
+    printf("%8.2f   %8.2f   %8.2f\n", fixed, sized, feedback);
+}
+
+// Counts data TLB misses of the calling thread between start() and stop().
+// stop() returns -1 where perf counters are unavailable.
+class tlb_miss_counter {
+public:
+    explicit tlb_miss_counter([[maybe_unused]] bool stores) {
+#ifdef __linux__
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB
+            | ((stores ? PERF_COUNT_HW_CACHE_OP_WRITE : PERF_COUNT_HW_CACHE_OP_READ) << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+
+    ~tlb_miss_counter() {
+#ifdef __linux__
+        if (fd >= 0) {
+            close(fd);
+        }
+#endif
+    }
+
+    void start() {
+#ifdef __linux__
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    long long stop() {
+#ifdef __linux__
+        long long count = 0;
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &count, sizeof(count)) == sizeof(count)) {
+                return count;
+            }
+        }
+#endif
+        return -1;
+    }
+
+private:
+    int fd = -1;
+};
+
+static double traverse(const sajson::value &node) {
+    switch (node.get_type()) {
+    case sajson::TYPE_ARRAY: {
+        double sum = 0;
+        for (size_t i = 0; i < node.get_length(); ++i) {
+            sum += traverse(node.get_array_element(i));
+        }
+        return sum;
+    }
+    case sajson::TYPE_OBJECT: {
+        double sum = 0;
+        for (size_t i = 0; i < node.get_length(); ++i) {
+            sum += traverse(node.get_object_value(i));
+        }
+        return sum;
+    }
+    case sajson::TYPE_STRING:
+        return static_cast<double>(node.get_string_length());
+    case sajson::TYPE_INTEGER:
+    case sajson::TYPE_DOUBLE:
+        return node.get_number_value();
+    default:
+        return 1;
+    }
+}
+
+template <typename AllocationStrategy>
+void run_tlb_benchmark(size_t N, const char *label, const AllocationStrategy &strategy, const std::vector<char> &buffer) {
+    tlb_miss_counter loads(false);
+    tlb_miss_counter stores(true);
+
+    long long load_misses = 0;
+    long long store_misses = 0;
+    double checksum = 0;
+    const auto [parse] = measure(N, [&] {
+        loads.start();
+        stores.start();
+
+        const auto doc = sajson::parse(strategy, std::string_view(buffer.data(), buffer.size()));
+        checksum += traverse(doc.get_root());
+
+        load_misses += loads.stop();
+        store_misses += stores.stop();
+    });
+
+    printf("%-12s   %10.3f ms", label, parse.average_ms(N));
+    if (load_misses < 0 || store_misses < 0) {
+        printf("   %14s   %14s", "n/a", "n/a");
+    } else {
+        printf(
+            "   %14lld   %14lld",
+            load_misses / static_cast<long long>(N),
+            store_misses / static_cast<long long>(N));
+    }
+    printf("   (checksum %g)\n", checksum);
+}
+
+static void run_tlb_all(size_t N, const std::string &filename) {
+    std::vector<char> buffer;
+    if (!read_file(filename, buffer)) {
         return;
     }
 
-    std::unique_ptr<FILE, int (*)(FILE*)> deleter(file, fclose);
+    printf("%s: %zu bytes, parse + traverse\n", filename.c_str(), buffer.size());
+    printf("%-12s   %13s   %14s   %14s\n", "strategy", "avg", "dTLB load miss", "dTLB store miss");
+    printf("%-12s   %13s   %14s   %14s\n", "--------", "---", "--------------", "---------------");
+    run_tlb_benchmark(N, "single", sajson::single_allocation(), buffer);
+    run_tlb_benchmark(N, "mmap", sajson::mmap_allocation(), buffer);
+    run_tlb_benchmark(N, "mmap+thp", sajson::mmap_allocation(1), buffer);
+}
 
-    if (std::fseek(file, 0, SEEK_END)) {
-        perror("fseek failed");
+// Reading the whole file and parsing it, either through fread into a
+// buffer or through a private file mapping.
+static void run_file_benchmark(size_t N, size_t max_string_length, const std::string &filename) {
+    size_t length = 0;
+    bool valid = true;
+    const auto [fread_parse, mapped] = measure(N, [&] {
+        std::vector<char> buffer;
+        if (read_file(filename, buffer)) {
+            length = buffer.size();
+            const auto doc = sajson::parse(sajson::single_allocation(), sajson::mutable_string_view(buffer.size(), buffer.data()));
+            valid = valid && doc.is_valid();
+        }
+    }, [&] {
+        const auto doc = sajson::parse_file(sajson::single_allocation(), filename.c_str());
+        valid = valid && doc.is_valid();
+    });
+
+    printf("%*s   %10zu", static_cast<int>(max_string_length), filename.c_str(), length);
+    print_throughput(fread_parse.average_ms(N), length);
+    print_throughput(mapped.average_ms(N), length);
+    printf("%s\n", valid ? "" : "   (parse failed)");
+}
+
+// sajson::write through FileOut, which copies everything into a buffer for
+// fwrite, versus FdOut, which passes string contents to writev in place.
+static void run_writev_benchmark(size_t N, size_t max_string_length, const std::string &filename) {
+    std::vector<char> buffer;
+    sajson::document doc;
+    if (!load_document(max_string_length, filename, buffer, doc)) {
         return;
     }
-    size_t length = static_cast<size_t>(ftell(file));
-    if (std::fseek(file, 0, SEEK_SET)) {
-        perror("fseek failed");
+    std::FILE *dev_null = open_dev_null();
+    if (!dev_null) {
         return;
     }
+    const int fd = fileno(dev_null);
+
+    size_t length = 0;
+    const auto [fwrite, writev] = measure(N, [&] {
+        length = sajson::write(dev_null, doc.get_root());
+    }, [&] {
+        sajson::write(fd, doc.get_root());
+    });
+    std::fclose(dev_null);
 
-    std::vector<char> buffer(length);
-    if (std::fread(buffer.data(), length, 1, file) != 1) {
-        perror("fread failed");
+    printf("%*s   %10zu", static_cast<int>(max_string_length), filename.c_str(), length);
+    print_throughput(fwrite.average_ms(N), length);
+    print_throughput(writev.average_ms(N), length);
+    printf("\n");
+}
+
+// Serializing into a std::string that grows as needed (to_string), versus
+// measuring the exact size first and serializing into a buffer of that size,
+// versus serializing into a buffer that was already measured and allocated.
+static void run_serialize_benchmark(size_t N, size_t max_string_length, const std::string &filename) {
+    std::vector<char> buffer;
+    sajson::document doc;
+    if (!load_document(max_string_length, filename, buffer, doc)) {
         return;
     }
 
-    deleter.reset();
+    std::vector<char> output(sajson::serialized_size(doc.get_root()));
+    size_t length = 0;
+    const auto [to_string, exact, serialize] = measure(N, [&] {
+        length = sajson::to_string(doc.get_root()).size();
+    }, [&] {
+        std::unique_ptr<char[]> exact_output(new char[sajson::serialized_size(doc.get_root())]);
+        sajson::serialize(exact_output.get(), doc.get_root());
+    }, [&] {
+        sajson::serialize(output.data(), doc.get_root());
+    });
+
+    printf("%*s   %10zu", static_cast<int>(max_string_length), filename.c_str(), length);
+    print_ms(to_string.average_ms(N));
+    print_ms(exact.average_ms(N));
+    print_ms(serialize.average_ms(N));
+    printf("\n");
+}
 
-    const auto doc = sajson::parse(sajson::single_allocation(), std::string_view(buffer.data(), buffer.size()));
-    // erase the line
-    printf("\r%*s\r", static_cast<int>(max_string_length + 13), "");
+// Re-serializing a document with dump, versus dump_passthrough copying the
+// structures that parsing in place left unmodified, versus dump_passthrough
+// on read-only input, where every structure is unmodified.
+static void run_passthrough_benchmark(size_t N, size_t max_string_length, const std::string &filename) {
+    std::vector<char> buffer;
+    if (!read_file(filename, buffer)) {
+        return;
+    }
+    const std::string_view text(buffer.data(), buffer.size());
+    const auto doc = sajson::parse_with_source_ranges(sajson::single_allocation(), text);
+    const auto read_only = sajson::parse_read_only_with_source_ranges(sajson::single_allocation(), text);
+    if (!doc.is_valid() || !read_only.is_valid()) {
+        printf("%*s   (parse failed)\n", static_cast<int>(max_string_length), filename.c_str());
+        return;
+    }
 
-    microseconds minimum_each { std::numeric_limits<clock_t>::max() };
-    const auto start = high_resolution_clock::now();
+    std::string out;
+    out.reserve(2 * buffer.size());
+    const auto [dump, in_situ, passthrough_read_only] = measure(N, [&] {
+        out.clear();
+        sajson::dump(out, doc.get_root());
+    }, [&] {
+        out.clear();
+        sajson::dump_passthrough(out, doc, doc.get_root());
+    }, [&] {
+        out.clear();
+        sajson::dump_passthrough(out, read_only, read_only.get_root());
+    });
+
+    printf("%*s   %10zu", static_cast<int>(max_string_length), filename.c_str(), buffer.size());
+    print_ms(dump.average_ms(N));
+    print_ms(in_situ.average_ms(N));
+    print_ms(passthrough_read_only.average_ms(N));
+    printf("\n");
+}
 
-    std::FILE *dev_null = std::fopen("/dev/null", "wb");
+// Round trips through a pretty printer: parsing, then printing with the
+// fixed indentation of to_string(value, true), or with dump_pretty.
+// Throughput counts input bytes over parse plus print time.
+static void run_pretty_benchmark(size_t N, size_t max_string_length, const std::string &filename) {
+    std::vector<char> buffer;
+    if (!read_file(filename, buffer)) {
+        return;
+    }
+    // Parsed from a copy each time, so the buffer stays intact.
+    auto doc = sajson::parse(sajson::single_allocation(), std::string_view(buffer.data(), buffer.size()));
+    if (!doc.is_valid()) {
+        printf("%*s   (parse failed)\n", static_cast<int>(max_string_length), filename.c_str());
+        return;
+    }
 
-    printf("%*s   ",static_cast<int>(max_string_length), filename.c_str());
-    std::fflush(stdout);
+    const auto [parse, indent, pretty] = measure(N, [&] {
+        doc = sajson::parse(sajson::single_allocation(), std::string_view(buffer.data(), buffer.size()));
+    }, [&] {
+        sajson::to_string(doc.get_root(), true);
+    }, [&] {
+        sajson::to_pretty_string(doc.get_root());
+    });
+
+    const double parse_ms = parse.average_ms(N);
+    printf("%*s   %8.3f ms", static_cast<int>(max_string_length), filename.c_str(), parse_ms);
+    for (const double print_ms: { indent.average_ms(N), pretty.average_ms(N) }) {
+        printf("   %8.3f ms %8.1f MB/s", print_ms, megabytes_per_second(buffer.size(), parse_ms + print_ms));
+    }
+    printf("\n");
+}
 
-    for (size_t i = 0; i < N; ++i) {
-        const auto before_each = high_resolution_clock::now();;
-        sajson::write(dev_null, doc.get_root());
-        const auto elapsed_each = duration_cast<microseconds>(high_resolution_clock::now() - before_each);
-        minimum_each = std::min(minimum_each, elapsed_each);
+// Serializing on one thread versus splitting the document across
+// thread_count threads, into a std::string and to /dev/null with writev.
+static void run_parallel_benchmark(size_t N, size_t max_string_length, const std::string &filename) {
+    std::vector<char> buffer;
+    sajson::document doc;
+    if (!load_document(max_string_length, filename, buffer, doc)) {
+        return;
     }
+    std::FILE *dev_null = open_dev_null();
+    if (!dev_null) {
+        return;
+    }
+    const int fd = fileno(dev_null);
+
+    const sajson::parallel_dump_options options;
+    size_t length = 0;
+    const auto [to_string, parallel, write, write_parallel] = measure(N, [&] {
+        length = sajson::to_string(doc.get_root()).size();
+    }, [&] {
+        sajson::to_string_parallel(doc.get_root(), options);
+    }, [&] {
+        sajson::write(fd, doc.get_root());
+    }, [&] {
+        sajson::write_parallel(fd, doc.get_root(), options);
+    });
+    std::fclose(dev_null);
 
+    printf("%*s   %10zu", static_cast<int>(max_string_length), filename.c_str(), length);
+    print_ms(to_string.average_ms(N));
+    print_ms(parallel.average_ms(N));
+    print_ms(write.average_ms(N));
+    print_ms(write_parallel.average_ms(N));
+    printf("\n");
+}
+
+// Writing the elements of a top-level array (or the members of an object)
+// as NDJSON to /dev/null, one dump per line on the calling thread versus
+// write_ndjson.
+static void run_ndjson_benchmark(size_t N, size_t max_string_length, const std::string &filename) {
+    std::vector<char> buffer;
+    sajson::document doc;
+    if (!load_document(max_string_length, filename, buffer, doc)) {
+        return;
+    }
+    const sajson::value root = doc.get_root();
+    std::vector<sajson::value> values;
+    for (size_t i = 0; i < root.get_length(); ++i) {
+        values.push_back(root.get_type() == sajson::TYPE_ARRAY ? root.get_array_element(i) : root.get_object_value(i));
+    }
+
+    std::FILE *dev_null = open_dev_null();
+    if (!dev_null) {
+        return;
+    }
+    const int fd = fileno(dev_null);
+
+    size_t length = 0;
+    const auto [sequential, ndjson] = measure(N, [&] {
+        FdOut fo(fd);
+        for (const auto &value: values) {
+            sajson::dump(fo, value);
+            fo += '\n';
+        }
+        fo.flush();
+        length = fo.size();
+    }, [&] {
+        sajson::write_ndjson(fd, values);
+    });
     std::fclose(dev_null);
 
-    const auto elapsed = duration_cast<microseconds>(high_resolution_clock::now() - start);
+    printf("%*s   %10zu   %10zu", static_cast<int>(max_string_length), filename.c_str(), values.size(), length);
+    print_ms(sequential.average_ms(N));
+    print_ms(ndjson.average_ms(N));
+    printf("\n");
+}
 
-    const double average_elapsed_ms = static_cast<double>(elapsed.count()) / 1e3 / static_cast<double>(N);
-    const double minimum_elapsed_ms = static_cast<double>(minimum_each.count()) / 1e3;
+// Compacting a document by parsing and dumping it, versus minify() with
+// and without validation.  Each run works on a fresh copy of the input,
+// which is not timed, so the runs are not measured with measure().
+static void run_minify_benchmark(size_t N, size_t max_string_length, const std::string &filename) {
+    std::vector<char> buffer;
+    if (!read_file(filename, buffer)) {
+        return;
+    }
+
+    timing dump;
+    timing minify;
+    timing validate;
+    size_t length = 0;
+    bool parsed = true;
+    bool valid = true;
+    std::vector<char> copy;
+    for (size_t i = 0; i < N; ++i) {
+        copy = buffer;
+        dump.add([&] {
+            const auto doc = sajson::parse(sajson::single_allocation(), sajson::mutable_string_view(copy.size(), copy.data()));
+            parsed = parsed && doc.is_valid();
+            sajson::to_string(doc.get_root());
+        });
+
+        copy = buffer;
+        minify.add([&] {
+            length = sajson::minify(copy.data(), copy.size()).length;
+        });
+
+        copy = buffer;
+        validate.add([&] {
+            valid = valid && sajson::minify(copy.data(), copy.size(), true).valid;
+        });
+    }
+    if (!parsed || !valid) {
+        printf("%*s   (%s failed)\n", static_cast<int>(max_string_length), filename.c_str(), parsed ? "validation" : "parse");
+        return;
+    }
 
-    printf("%0.3f ms   %0.3f ms\n", average_elapsed_ms, minimum_elapsed_ms);
+    printf("%*s   %10zu   %10zu", static_cast<int>(max_string_length), filename.c_str(), buffer.size(), length);
+    print_ms(dump.average_ms(N));
+    print_ms(minify.average_ms(N));
+    print_ms(validate.average_ms(N));
+    printf("\n");
 }
 
+// JSON dump versus MessagePack and CBOR, each into a reused std::string.
+static void run_binary_benchmark(size_t N, size_t max_string_length, const std::string &filename) {
+    std::vector<char> buffer;
+    sajson::document doc;
+    if (!load_document(max_string_length, filename, buffer, doc)) {
+        return;
+    }
 
-static size_t print_header(const std::vector<std::string> &files)
-{
-    const auto max_string_length = std::max_element(files.begin(), files.end(), [](const auto &A, const auto &B) {
-        return A.size() < B.size();
-    })->size();
+    size_t json_length = 0;
+    size_t msgpack_length = 0;
+    size_t cbor_length = 0;
+    std::string out;
+    out.reserve(2 * buffer.size());
+    const auto [json, msgpack, cbor] = measure(N, [&] {
+        out.clear();
+        sajson::dump(out, doc.get_root());
+        json_length = out.size();
+    }, [&] {
+        out.clear();
+        sajson::dump_msgpack(out, doc.get_root());
+        msgpack_length = out.size();
+    }, [&] {
+        out.clear();
+        sajson::dump_cbor(out, doc.get_root());
+        cbor_length = out.size();
+    });
 
     printf(
-        "%*s   %8s   %8s\n",
+        "%*s   %10zu %9.3f ms   %10zu %9.3f ms   %10zu %9.3f ms\n",
         static_cast<int>(max_string_length),
-        "file",
-        "avg",
-        "min");
-    printf(
-        "%*s   %8s   %8s\n",
-        static_cast<int>(max_string_length),
-        "----",
-        "---",
-        "---");
-
-    return max_string_length;
+        filename.c_str(),
+        json_length,
+        json.average_ms(N),
+        msgpack_length,
+        msgpack.average_ms(N),
+        cbor_length,
+        cbor.average_ms(N));
 }
 
-template <typename AllocationStrategy>
-void run_all(size_t N, const std::vector<std::string> &files) {
-    const auto max_string_length = print_header(files);
-
-    for (const auto &fname: files) {
-        run_benchmark<AllocationStrategy>(N, max_string_length, fname);
+// Decompressing a gzip or xz file into a buffer and then parsing it,
+// versus parse_compressed_file, which overlaps the two.  Throughput is in
+// decompressed bytes.
+static void run_compressed_benchmark(size_t N, size_t max_string_length, const std::string &filename) {
+    size_t length = 0;
+    bool read = true;
+    bool valid = true;
+    const auto [sequential, pipelined] = measure(N, [&] {
+        sajson::mutable_string_view text;
+        read = read && sajson::read_compressed_file(filename.c_str(), &text) == sajson::ERROR_NO_ERROR;
+        length = text.length();
+        const auto doc = sajson::parse(sajson::single_allocation(), text);
+        valid = valid && doc.is_valid();
+    }, [&] {
+        const auto doc = sajson::parse_compressed_file(sajson::single_allocation(), filename.c_str());
+        valid = valid && doc.is_valid();
+    });
+    if (!read) {
+        fprintf(stderr, "failed to read %s\n", filename.c_str());
+        return;
     }
-}
 
-static void run_dump_all(size_t N, const std::vector<std::string> &files) {
-    const auto max_string_length = print_header(files);
+    printf("%*s   %10zu", static_cast<int>(max_string_length), filename.c_str(), length);
+    print_throughput(sequential.average_ms(N), length);
+    print_throughput(pipelined.average_ms(N), length);
+    printf("%s\n", valid ? "" : "   (parse failed)");
+}
 
+// Reading and parsing every file one after another, versus ingest_files
+// with io_uring and with its pread fallback.
+static void run_ingest_all(size_t N, const std::vector<std::string> &files) {
+    std::vector<const char *> paths;
+    size_t total_bytes = 0;
     for (const auto &fname: files) {
-        run_dump_benchmark(N, max_string_length, fname);
+        paths.push_back(fname.c_str());
+        std::vector<char> buffer;
+        if (read_file(fname, buffer)) {
+            total_bytes += buffer.size();
+        }
+    }
+
+    const auto report = [&](const char *label, const timing &t, size_t valid) {
+        printf("%22s", label);
+        print_throughput(t.average_ms(N), total_bytes);
+        printf("   %zu of %zu valid\n", valid / N, paths.size());
+    };
+
+    size_t valid = 0;
+    const auto [sequential] = measure(N, [&] {
+        for (const auto &fname: files) {
+            std::vector<char> buffer;
+            if (read_file(fname, buffer)) {
+                const auto doc = sajson::parse(sajson::single_allocation(), sajson::mutable_string_view(buffer.size(), buffer.data()));
+                valid += doc.is_valid();
+            }
+        }
+    });
+    report("sequential", sequential, valid);
+
+    for (bool use_io_uring: { true, false }) {
+        sajson::ingest_options options;
+        options.use_io_uring = use_io_uring;
+        std::atomic<size_t> ingested { 0 };
+        bool used_io_uring = false;
+        const auto [ingest] = measure(N, [&] {
+            used_io_uring = sajson::ingest_files(sajson::single_allocation(), paths.data(), paths.size(), [&](size_t, const sajson::document &doc) {
+                ingested += doc.is_valid();
+            }, options);
+        });
+        report(used_io_uring ? "ingest_files io_uring" : "ingest_files pread", ingest, ingested);
     }
 }
 
@@ -173,22 +757,92 @@ int main(int argc, const char** argv) {
 
     const auto parse_N = 1000;
     const auto write_N = 100;
+    const auto realloc_N = 10;
+    const auto tlb_N = 10;
+    const auto file_N = 10;
+    const auto compressed_N = 5;
+    const auto ingest_N = 10;
+    const auto writev_N = 100;
+    const auto serialize_N = 100;
+    const auto passthrough_N = 100;
+    const auto pretty_N = 100;
+    const auto parallel_N = 20;
+    const auto ndjson_N = 20;
+    const auto minify_N = 100;
+    const auto binary_N = 100;
 
 
     printf("benchmark: sajson::parse() [%d]...\n", parse_N);
 
-    if (argc > 1) {
+    const std::string mode = argc > 2 ? argv[1] : "";
+    const std::vector<std::string> files(argv + std::min(argc, 2), argv + argc);
+    if (mode == "--tlb") {
+        // e.g. xz -dk testdata/large.json.xz && benchmark --tlb testdata/large.json
+        printf("benchmark: TLB misses [%d]...\n", tlb_N);
+        run_tlb_all(tlb_N, argv[2]);
+    } else if (mode == "--file") {
+        // fread versus parse_file, e.g. on inputs from 1 MB to 2 GB
+        printf("benchmark: fread + parse vs. parse_file [%d]...\n", file_N);
+        run_files(file_N, files, { { "bytes", 10 }, { "fread + parse", 25 }, { "parse_file", 25 } }, run_file_benchmark);
+    } else if (mode == "--compressed") {
+        // e.g. benchmark --compressed testdata/large.json.xz
+        printf("benchmark: decompress + parse vs. parse_compressed_file [%d]...\n", compressed_N);
+        run_files(compressed_N, files, { { "bytes", 10 }, { "decompress + parse", 25 }, { "parse_compressed_file", 25 } }, run_compressed_benchmark);
+    } else if (mode == "--ingest") {
+        // e.g. benchmark --ingest corpus/*.json
+        printf("benchmark: sequential read + parse vs. ingest_files [%d]...\n", ingest_N);
+        run_ingest_all(ingest_N, files);
+    } else if (mode == "--writev") {
+        // e.g. benchmark --writev testdata/*.json
+        printf("benchmark: sajson::write() to FILE* vs. fd [%d]...\n", writev_N);
+        run_files(writev_N, files, { { "bytes", 10 }, { "FILE* (fwrite)", 25 }, { "fd (writev)", 25 } }, run_writev_benchmark);
+    } else if (mode == "--serialize") {
+        // e.g. benchmark --serialize testdata/*.json
+        printf("benchmark: growing std::string vs. exact-size serialization [%d]...\n", serialize_N);
+        run_files(serialize_N, files, { { "bytes", 10 }, { "to_string", 17 }, { "size + serialize", 17 }, { "serialize", 17 } }, run_serialize_benchmark);
+    } else if (mode == "--passthrough") {
+        // e.g. benchmark --passthrough testdata/*.json
+        printf("benchmark: dump vs. dump_passthrough [%d]...\n", passthrough_N);
+        run_files(passthrough_N, files, { { "bytes", 10 }, { "dump", 17 }, { "passthrough", 17 }, { "read-only", 17 } }, run_passthrough_benchmark);
+    } else if (mode == "--pretty") {
+        // e.g. benchmark --pretty testdata/mesh.pretty.json
+        printf("benchmark: parse + pretty print round trips [%d]...\n", pretty_N);
+        run_files(pretty_N, files, { { "parse", 11 }, { "to_string(indent)", 25 }, { "dump_pretty", 25 } }, run_pretty_benchmark);
+    } else if (mode == "--parallel") {
+        // e.g. benchmark --parallel testdata/large.json
+        printf("benchmark: sequential vs. parallel serialization [%d]...\n", parallel_N);
+        printf("threads: %zu\n", sajson::parallel_dump_options().thread_count);
+        run_files(parallel_N, files, { { "bytes", 10 }, { "to_string", 17 }, { "to_string_parallel", 17 }, { "write fd", 17 }, { "write_parallel", 17 } }, run_parallel_benchmark);
+    } else if (mode == "--ndjson") {
+        // e.g. benchmark --ndjson testdata/large.json
+        printf("benchmark: NDJSON on one thread vs. write_ndjson [%d]...\n", ndjson_N);
+        printf("threads: %zu\n", sajson::ndjson_options().thread_count);
+        run_files(ndjson_N, files, { { "lines", 10 }, { "bytes", 10 }, { "dump per line", 17 }, { "write_ndjson", 17 } }, run_ndjson_benchmark);
+    } else if (mode == "--minify") {
+        // e.g. benchmark --minify testdata/mesh.pretty.json
+        printf("benchmark: parse + dump vs. minify [%d]...\n", minify_N);
+        run_files(minify_N, files, { { "bytes", 10 }, { "minified", 10 }, { "parse + dump", 17 }, { "minify", 17 }, { "minify + validate", 17 } }, run_minify_benchmark);
+    } else if (mode == "--binary") {
+        // e.g. benchmark --binary testdata/*.json
+        printf("benchmark: JSON vs. MessagePack vs. CBOR output [%d]...\n", binary_N);
+        run_files(binary_N, files, { { "json (bytes, time)", 23 }, { "msgpack (bytes, time)", 23 }, { "cbor (bytes, time)", 23 } }, run_binary_benchmark);
+    } else if (argc > 1) {
         // printf("\n=== SINGLE ALLOCATION ===\n\n");
-//        run_all<sajson::single_allocation>(parse_N, { argv[1] });
+//        run_files(parse_N, { argv[1] }, { { "avg", 8 }, { "min", 8 } }, run_benchmark<sajson::single_allocation>);
         // printf("\n=== DYNAMIC ALLOCATION ===\n\n");
-        // run_all<sajson::dynamic_allocation>(argc - 1, argv + 1);
+        // run_files(parse_N, { argv[1] }, { { "avg", 8 }, { "min", 8 } }, run_benchmark<sajson::dynamic_allocation>);
         printf("benchmark: sajson::write() [%d]...\n", write_N);
-        run_dump_all(write_N, { argv[1] });
+        run_files(write_N, { argv[1] }, { { "avg", 8 }, { "min", 8 } }, run_dump_benchmark);
     } else {
         // printf("\n=== SINGLE ALLOCATION ===\n\n");
-        run_all<sajson::single_allocation>(parse_N, default_files);
+        run_files(parse_N, default_files, { { "avg", 8 }, { "min", 8 } }, run_benchmark<sajson::single_allocation>);
+        printf("\n=== MMAP ALLOCATION ===\n\n");
+        run_files(parse_N, default_files, { { "avg", 8 }, { "min", 8 } }, run_benchmark<sajson::mmap_allocation>);
         // printf("\n=== DYNAMIC ALLOCATION ===\n\n");
-        // run_all<sajson::dynamic_allocation>(default_files_count,
-        // default_files);
+        // run_files(parse_N, default_files, { { "avg", 8 }, { "min", 8 } },
+        // run_benchmark<sajson::dynamic_allocation>);
+
+        printf("\nbenchmark: dynamic_allocation reallocations per parse [%d]...\n", realloc_N);
+        run_files(realloc_N, default_files, { { "1024/256", 8 }, { "sized", 8 }, { "feedback", 8 } }, run_reallocation_benchmark);
     }
 }
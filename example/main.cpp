@@ -1,4 +1,5 @@
 #include "sajson.h"
+#include "sajson_mmap.h"
 #include <assert.h>
 
 using namespace sajson;
@@ -96,27 +97,8 @@ int main(int argc, char** argv) {
         fprintf(stderr, "Must specify JSON filname\n");
         return 1;
     }
-    FILE* file = fopen(argv[1], "rb");
-    if (!file) {
-        fprintf(stderr, "Failed to open file\n");
-        return 1;
-    }
-    fseek(file, 0, SEEK_END);
-    size_t length = static_cast<size_t>(ftell(file));
-    fseek(file, 0, SEEK_SET);
-
-    std::string buffer;
-    buffer.resize(length);
-    if (length != fread(buffer.data(), 1, length, file)) {
-        fclose(file);
-        fprintf(stderr, "Failed to read entire file\n");
-        return 1;
-    }
-    fclose(file);
-
-    const sajson::document& document = sajson::parse(sajson::dynamic_allocation(), mutable_string_view(buffer));
+    const sajson::document& document = sajson::parse_file(sajson::dynamic_allocation(), argv[1]);
     if (!success(document)) {
-        fclose(file);
         return 1;
     }
 
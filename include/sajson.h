@@ -26,38 +26,38 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <atomic>
 #include <cstdio>
 #include <numeric>
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <new>
 
 #include <string>
 #include <string_view>
 
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define SAJSON_HAS_MEMORY_RESOURCE
+#endif
+
 #if defined(__GNUC__) || defined(__clang__)
 #define SAJSON_LIKELY(x) __builtin_expect(!!(x), 1)
 #define SAJSON_UNLIKELY(x) __builtin_expect(!!(x), 0)
 #define SAJSON_ALWAYS_INLINE __attribute__((always_inline))
 #define SAJSON_UNREACHABLE() __builtin_unreachable()
-#define SAJSON_snprintf snprintf
 #elif defined(_MSC_VER)
 #define SAJSON_LIKELY(x) x
 #define SAJSON_UNLIKELY(x) x
 #define SAJSON_ALWAYS_INLINE __forceinline
 #define SAJSON_UNREACHABLE() __assume(0)
-#if (_MSC_VER <= 1800)
-#define SAJSON_snprintf _snprintf
-#else
-#define SAJSON_snprintf snprintf
-#endif
 #else
 #define SAJSON_LIKELY(x) x
 #define SAJSON_UNLIKELY(x) x
 #define SAJSON_ALWAYS_INLINE inline
 #define SAJSON_UNREACHABLE() assert(!"unreachable")
-#define SAJSON_snprintf snprintf
 #endif
 
 /**
@@ -175,14 +175,63 @@ constexpr inline bool is_whitespace(char c) {
 
 class allocated_buffer {
 public:
+    /// Releases memory that was not allocated by allocated_buffer.
+    typedef void (*deleter)(char* data, size_t length);
+
     allocated_buffer()
         : memory(0) {}
 
     explicit allocated_buffer(size_t length) {
         // throws std::bad_alloc upon allocation failure
-        void* buffer = operator new(sizeof(size_t) + length);
+        void* buffer = operator new(sizeof(layout) + length);
+        memory = static_cast<layout*>(buffer);
+        memory->refcount = 1;
+        memory->release = 0;
+        memory->external = 0;
+        memory->length = length;
+    }
+
+    /// Leaves the buffer empty if allocation fails.
+    allocated_buffer(size_t length, const std::nothrow_t&) {
+        void* buffer = operator new(sizeof(layout) + length, std::nothrow);
+        memory = static_cast<layout*>(buffer);
+        if (memory) {
+            memory->refcount = 1;
+            memory->release = 0;
+            memory->external = 0;
+            memory->length = length;
+        }
+    }
+
+    /// Shares ownership of external memory, which is released by calling
+    /// \p release once the last reference goes away.
+    allocated_buffer(char* external, size_t length, deleter release) {
+        // throws std::bad_alloc upon allocation failure
+        void* buffer = operator new(sizeof(layout));
+        memory = static_cast<layout*>(buffer);
+        memory->refcount = 1;
+        memory->release = release;
+        memory->external = external;
+        memory->length = length;
+    }
+
+    /// Like the above, but if allocation fails, calls \p release at once
+    /// and leaves the buffer empty.
+    allocated_buffer(
+        char* external,
+        size_t length,
+        deleter release,
+        const std::nothrow_t&) {
+        void* buffer = operator new(sizeof(layout), std::nothrow);
         memory = static_cast<layout*>(buffer);
+        if (!memory) {
+            release(external, length);
+            return;
+        }
         memory->refcount = 1;
+        memory->release = release;
+        memory->external = external;
+        memory->length = length;
     }
 
     allocated_buffer(const allocated_buffer& that)
@@ -215,7 +264,12 @@ public:
         return *this;
     }
 
-    char* get_data() const { return memory ? memory->data : 0; }
+    char* get_data() const {
+        if (!memory) {
+            return 0;
+        }
+        return memory->release ? memory->external : memory->data;
+    }
 
 private:
     void incref() const {
@@ -226,12 +280,18 @@ private:
 
     void decref() const {
         if (memory && --(memory->refcount) == 0) {
+            if (memory->release) {
+                memory->release(memory->external, memory->length);
+            }
             operator delete(memory);
         }
     }
 
     struct layout {
         size_t refcount;
+        deleter release; // null if the data follows inline
+        char* external;
+        size_t length;
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wpedantic"
         char data[];
@@ -240,6 +300,83 @@ private:
 
     layout* memory;
 };
+
+/// Set in both offsets of a string that was decoded into a document's
+/// side buffer rather than referenced in its input text.
+constexpr size_t SIDE_TEXT_OFFSET = ~(~size_t{} >> 1);
+
+/// Locates the strings of a document from the offsets in its AST.  An
+/// offset counts from the start of the input text or, if flagged with
+/// SIDE_TEXT_OFFSET, from the start of the side buffer.  Documents parsed
+/// from segments reference strings in many unrelated buffers, so for them
+/// text is null and unflagged offsets are the strings' addresses.
+struct string_bases {
+    const char* get(size_t offset) const {
+        if (offset & SIDE_TEXT_OFFSET) {
+            return side + (offset & ~SIDE_TEXT_OFFSET);
+        }
+        if (!text) {
+            return reinterpret_cast<const char*>(offset);
+        }
+        return text + offset;
+    }
+
+    const char* text;
+    const char* side;
+};
+
+/// What a \ref value keeps to find its strings: one base and some flags.
+/// Most documents have no side buffer, so their strings are found by
+/// adding the offset to a single base chosen when the value is built,
+/// without testing it for SIDE_TEXT_OFFSET.  Only values of documents with
+/// a side buffer point to the document's string_bases instead.
+struct string_base {
+    /// base points to a string_bases.
+    static constexpr uint8_t INDIRECT = 1;
+    /// Strings may be followed by input rather than a NUL, as after a
+    /// read-only parse.
+    static constexpr uint8_t UNTERMINATED = 2;
+
+    string_base()
+        : base(0)
+        , flags(0) {}
+
+    string_base(const void* base_, uint8_t flags_)
+        : base(base_)
+        , flags(flags_) {}
+
+    /// Refers to bases only if it has a side buffer, so a temporary
+    /// string_bases without one may be passed.
+    string_base(const string_bases& bases, uint8_t flags_ = 0)
+        : base(bases.side ? static_cast<const void*>(&bases) : bases.text)
+        , flags(bases.side ? flags_ | INDIRECT : flags_) {}
+
+    const char* get(size_t offset) const {
+        if (SAJSON_LIKELY(!(flags & INDIRECT))) {
+            // The base is null for strings located by address.
+            return reinterpret_cast<const char*>(
+                reinterpret_cast<uintptr_t>(base) + offset);
+        }
+        return static_cast<const string_bases*>(base)->get(offset);
+    }
+
+    const void* base;
+    uint8_t flags;
+};
+
+/// A sequence of buffers that together hold one JSON text, such as the
+/// iovecs a request body was received into.  \p get returns the i'th
+/// buffer, so the parser does not care how the caller describes them.
+/// The parser calls it in order as it reaches each buffer, so a source
+/// that produces buffers over time can be parsed while it does.
+struct segment_list {
+    const void* segments;
+    size_t count;
+    std::string_view (*get)(const void* segments, size_t i);
+    /// The combined length of the buffers, or an upper bound on it,
+    /// supplied by the caller so that no buffer is requested early.
+    size_t total_length;
+};
 } // namespace internal
 
 /// A pointer to a mutable buffer, its size in bytes, and strong ownership of
@@ -261,6 +398,43 @@ public:
         , data(data_)
         , buffer() {}
 
+    /// Takes ownership of an externally allocated buffer, such as a file
+    /// mapping, and calls \p release(data, length) once no view or
+    /// \ref document refers to it anymore.  Throws std::bad_alloc if
+    /// allocating the reference count fails, in which case the buffer is not
+    /// released.
+    mutable_string_view(
+        size_t length, char* data_, internal::allocated_buffer::deleter release)
+        : length_(length)
+        , data(data_)
+        , buffer(data_, length, release) {}
+
+    /// Like the above, but if allocating the reference count fails, calls
+    /// \p release at once and leaves the view empty, which get_data()
+    /// reports as null.
+    mutable_string_view(
+        size_t length,
+        char* data_,
+        internal::allocated_buffer::deleter release,
+        const std::nothrow_t&)
+        : length_(length)
+        , data(data_)
+        , buffer(data_, length, release, std::nothrow) {
+        if (!buffer.get_data()) {
+            length_ = 0;
+            data = 0;
+        }
+    }
+
+    /// Allocates an uninitialized buffer of the given length in bytes and
+    /// exposes a mutable view into it.  Throws std::bad_alloc if allocation
+    /// fails.
+    explicit mutable_string_view(size_t length)
+        : length_(length)
+        , buffer(length_) {
+        data = buffer.get_data();
+    }
+
     /// Allocates a copy of the given \ref string_view string and exposes a
     /// mutable view into it.  Throws std::bad_alloc if allocation fails.
     mutable_string_view(std::string_view s)
@@ -323,15 +497,15 @@ struct object_key_record {
     size_t key_end;
     size_t value;
 
-    bool match(const char* object_data, std::string_view str) const {
+    bool match(const string_base& strings, std::string_view str) const {
         size_t length = key_end - key_start;
-        return length == str.length() && 0 == memcmp(str.data(), object_data + key_start, length);
+        return length == str.length() && 0 == memcmp(str.data(), strings.get(key_start), length);
     }
 };
 
 struct object_key_comparator {
-    object_key_comparator(const char* object_data)
-        : data(object_data) {}
+    object_key_comparator(const string_base& strings_)
+        : strings(strings_) {}
 
     bool operator()(const object_key_record& lhs, std::string_view rhs) const {
         const size_t lhs_length = lhs.key_end - lhs.key_start;
@@ -341,7 +515,7 @@ struct object_key_comparator {
         } else if (lhs_length > rhs_length) {
             return false;
         }
-        return memcmp(data + lhs.key_start, rhs.data(), lhs_length) < 0;
+        return memcmp(strings.get(lhs.key_start), rhs.data(), lhs_length) < 0;
     }
 
     bool operator()(std::string_view lhs, const object_key_record& rhs) const {
@@ -357,11 +531,14 @@ struct object_key_comparator {
         } else if (lhs_length > rhs_length) {
             return false;
         }
-        return memcmp(data + lhs.key_start, data + rhs.key_start, lhs_length)
+        return memcmp(
+                   strings.get(lhs.key_start),
+                   strings.get(rhs.key_start),
+                   lhs_length)
             < 0;
     }
 
-    const char* data;
+    string_base strings;
 };
 } // namespace internal
 
@@ -415,8 +592,9 @@ class value {
 public:
     value()
         : value_tag{ tag::null }
+        , string_flags{ 0 }
         , payload{ nullptr }
-        , text{ nullptr } {}
+        , strings{ nullptr } {}
 
     /// Returns the JSON value's \ref type.
     type get_type() const {
@@ -506,7 +684,7 @@ public:
         return value(
             get_element_tag(element),
             payload + get_element_value(element),
-            text);
+            get_strings());
     }
 
     /// Returns the nth key of an object.  Calling with an out-of-bound
@@ -515,7 +693,7 @@ public:
     std::string_view get_object_key(size_t index) const {
         assert_tag(tag::object);
         const size_t* s = payload + 1 + index * 3;
-        return std::string_view (text + s[0], s[1] - s[0]);
+        return std::string_view(get_strings().get(s[0]), s[1] - s[0]);
     }
 
     /// Returns the nth value of an object.  Calling with an out-of-bound
@@ -527,7 +705,7 @@ public:
         return value(
             get_element_tag(element),
             payload + get_element_value(element),
-            text);
+            get_strings());
     }
 
     /// Given a string key, returns the value with that key or a null value
@@ -539,7 +717,7 @@ public:
         if (i < get_length()) {
             return get_object_value(i);
         } else {
-            return value(tag::null, 0, 0);
+            return value();
         }
     }
 
@@ -589,14 +767,15 @@ public:
         size_t length = get_length();
         const auto* start = reinterpret_cast<const object_key_record*>(payload + 1);
         const auto* end = start + length;
+        const internal::string_base keys = get_strings();
         if (SAJSON_UNLIKELY(should_binary_search(length))) {
-            const object_key_record* i = std::lower_bound( start, end, key, object_key_comparator(text));
-            if (i != end && i->match(text, key)) {
+            const object_key_record* i = std::lower_bound( start, end, key, object_key_comparator(keys));
+            if (i != end && i->match(keys, key)) {
                 return static_cast<size_t>(i - start);
             }
         } else {
             for (size_t i = 0; i < length; ++i) {
-                if (start[i].match(text, key)) {
+                if (start[i].match(keys, key)) {
                     return i;
                 }
             }
@@ -680,17 +859,21 @@ public:
     /// C-style string (that is, without also using get_string_length())
     /// will cause the string to appear truncated if the string has
     /// embedded NULs.
-    /// Only legal if get_type() is TYPE_STRING.
+    /// Only legal if get_type() is TYPE_STRING and the document's strings
+    /// are NUL-terminated, which they are not after parse_read_only() or
+    /// parse_segments().
     const char* as_cstring() const {
         assert_tag(tag::string);
-        return text + payload[0];
+        assert(!(string_flags & internal::string_base::UNTERMINATED));
+        return get_strings().get(payload[0]);
     }
 
     /// Returns a string's value as a std::string.
     /// Only legal if get_type() is TYPE_STRING.
     std::string_view as_string() const {
         assert_tag(tag::string);
-        return std::string_view(text + payload[0], payload[1] - payload[0]);
+        return std::string_view(
+            get_strings().get(payload[0]), payload[1] - payload[0]);
     }
 
     /// \cond INTERNAL
@@ -700,10 +883,18 @@ public:
 private:
     using tag = internal::tag;
 
-    explicit value(tag value_tag_, const size_t* payload_, const char* text_)
+    explicit value(
+        tag value_tag_,
+        const size_t* payload_,
+        const internal::string_base& strings_)
         : value_tag(value_tag_)
+        , string_flags(strings_.flags)
         , payload(payload_)
-        , text(text_) {}
+        , strings(strings_.base) {}
+
+    internal::string_base get_strings() const {
+        return internal::string_base(strings, string_flags);
+    }
 
     void assert_tag([[maybe_unused]] tag expected) const { assert(expected == value_tag); }
 
@@ -713,9 +904,11 @@ private:
 
     void assert_in_bounds([[maybe_unused]] size_t i) const { assert(i < get_length()); }
 
+    // A value is three words: the string base's flags share the tag's.
     const tag value_tag;
+    const uint8_t string_flags;
     const size_t* const payload;
-    const char* const text;
+    const void* const strings;
 
     friend class document;
     friend class object;
@@ -845,8 +1038,9 @@ private:
 
     friend class value;
 
-    explicit object(const size_t* payload_, const char* text_)
-        : value(tag::object, payload_, text_) {}
+    explicit object(
+        const size_t* payload_, const internal::string_base& strings_)
+        : value(tag::object, payload_, strings_) {}
 };
 
 class array : public value
@@ -896,18 +1090,19 @@ private:
 
     friend class value;
 
-    explicit array(const size_t* payload_, const char* text_)
-        : value(tag::array, payload_, text_) {}
+    explicit array(
+        const size_t* payload_, const internal::string_base& strings_)
+        : value(tag::array, payload_, strings_) {}
 };
 
 inline object value::as_object() const {
     assert_tag(tag::object);
-    return object(payload, text);
+    return object(payload, get_strings());
 }
 
 inline array value::as_array() const {
     assert_tag(tag::array);
-    return array(payload, text);
+    return array(payload, get_strings());
 }
 
 
@@ -937,29 +1132,73 @@ enum error {
     ERROR_UNKNOWN_ESCAPE,
     ERROR_INVALID_UTF8,
     ERROR_UNINITIALIZED,
+    ERROR_CANNOT_READ_FILE,
+    ERROR_INVALID_COMPRESSED_DATA,
 };
 
 namespace internal {
 class ownership {
 public:
+    /// Releases a buffer that was not allocated with new[].  Receives the
+    /// buffer's size in words and the context pointer given at construction.
+    typedef void (*deleter)(size_t* p, size_t size_in_words, void* context);
+
     ownership() = delete;
     ownership(const ownership&) = delete;
     void operator=(const ownership&) = delete;
 
     explicit ownership(size_t* p_)
-        : p(p_) {}
+        : p(p_)
+        , size_in_words(0)
+        , release(0)
+        , context(0) {}
+
+    explicit ownership(
+        size_t* p_, size_t size_in_words_, deleter release_, void* context_)
+        : p(p_)
+        , size_in_words(size_in_words_)
+        , release(release_)
+        , context(context_) {}
 
     ownership(ownership&& p_)
-        : p(p_.p) {
+        : p(p_.p)
+        , size_in_words(p_.size_in_words)
+        , release(p_.release)
+        , context(p_.context) {
         p_.p = 0;
     }
 
-    ~ownership() { delete[] p; }
+    ownership& operator=(ownership&& that) {
+        if (this != &that) {
+            free();
+            p = that.p;
+            size_in_words = that.size_in_words;
+            release = that.release;
+            context = that.context;
+            that.p = 0;
+        }
+        return *this;
+    }
+
+    ~ownership() { free(); }
 
     bool is_valid() const { return !!p; }
 
 private:
+    void free() {
+        if (release) {
+            if (p) {
+                release(p, size_in_words, context);
+            }
+        } else {
+            delete[] p;
+        }
+    }
+
     size_t* p;
+    size_t size_in_words;
+    deleter release;
+    void* context;
 };
 
 inline const char* get_error_text(error error_code) {
@@ -1012,11 +1251,139 @@ inline const char* get_error_text(error error_code) {
         return "invalid UTF-8";
     case ERROR_UNINITIALIZED:
         return "uninitialized document";
+    case ERROR_CANNOT_READ_FILE:
+        return "cannot read file";
+    case ERROR_INVALID_COMPRESSED_DATA:
+        return "invalid compressed data";
     }
 
     SAJSON_UNREACHABLE();
 }
+
+inline const char* get_error_message(error error_code, int error_arg) {
+    if (error_code == ERROR_ILLEGAL_CODEPOINT && error_arg >= 0
+        && error_arg < 0x20) {
+        // The only error with an argument: the offending control character.
+        static const char* const messages[0x20] = {
+#define SAJSON_CODEPOINT_MESSAGE(n)                                            \
+    "illegal unprintable codepoint in string: " #n
+            SAJSON_CODEPOINT_MESSAGE(0),  SAJSON_CODEPOINT_MESSAGE(1),
+            SAJSON_CODEPOINT_MESSAGE(2),  SAJSON_CODEPOINT_MESSAGE(3),
+            SAJSON_CODEPOINT_MESSAGE(4),  SAJSON_CODEPOINT_MESSAGE(5),
+            SAJSON_CODEPOINT_MESSAGE(6),  SAJSON_CODEPOINT_MESSAGE(7),
+            SAJSON_CODEPOINT_MESSAGE(8),  SAJSON_CODEPOINT_MESSAGE(9),
+            SAJSON_CODEPOINT_MESSAGE(10), SAJSON_CODEPOINT_MESSAGE(11),
+            SAJSON_CODEPOINT_MESSAGE(12), SAJSON_CODEPOINT_MESSAGE(13),
+            SAJSON_CODEPOINT_MESSAGE(14), SAJSON_CODEPOINT_MESSAGE(15),
+            SAJSON_CODEPOINT_MESSAGE(16), SAJSON_CODEPOINT_MESSAGE(17),
+            SAJSON_CODEPOINT_MESSAGE(18), SAJSON_CODEPOINT_MESSAGE(19),
+            SAJSON_CODEPOINT_MESSAGE(20), SAJSON_CODEPOINT_MESSAGE(21),
+            SAJSON_CODEPOINT_MESSAGE(22), SAJSON_CODEPOINT_MESSAGE(23),
+            SAJSON_CODEPOINT_MESSAGE(24), SAJSON_CODEPOINT_MESSAGE(25),
+            SAJSON_CODEPOINT_MESSAGE(26), SAJSON_CODEPOINT_MESSAGE(27),
+            SAJSON_CODEPOINT_MESSAGE(28), SAJSON_CODEPOINT_MESSAGE(29),
+            SAJSON_CODEPOINT_MESSAGE(30), SAJSON_CODEPOINT_MESSAGE(31),
+#undef SAJSON_CODEPOINT_MESSAGE
+        };
+        return messages[error_arg];
+    }
+    return get_error_text(error_code);
+}
+
+/// Calls f(range) for every string value and object key in the AST, where
+/// range[0] and range[1] are the string's start and end offsets, as
+/// located by string_bases.  Returns false if the traversal runs out of memory.
+template <typename F>
+bool for_each_string(tag root_tag, size_t* root, F f) {
+    struct frame {
+        size_t* payload;
+        size_t index;
+        bool is_object;
+    };
+    frame* frames = 0;
+    size_t depth = 0;
+    size_t capacity = 0;
+
+    auto push = [&](tag t, size_t* payload) {
+        if (depth == capacity) {
+            size_t new_capacity = std::max<size_t>(capacity * 2, 16);
+            frame* new_frames = new (std::nothrow) frame[new_capacity];
+            if (!new_frames) {
+                return false;
+            }
+            std::copy(frames, frames + depth, new_frames);
+            delete[] frames;
+            frames = new_frames;
+            capacity = new_capacity;
+        }
+        frames[depth++] = frame{ payload, 0, t == tag::object };
+        return true;
+    };
+
+    bool success = push(root_tag, root);
+    while (success && depth) {
+        frame& top = frames[depth - 1];
+        if (top.index == top.payload[0]) {
+            --depth;
+            continue;
+        }
+        size_t* payload = top.payload;
+        size_t element;
+        if (top.is_object) {
+            size_t* record = payload + 1 + 3 * top.index;
+            f(record);
+            element = record[2];
+        } else {
+            element = payload[1 + top.index];
+        }
+        ++top.index;
+
+        tag element_tag = get_element_tag(element);
+        size_t* child = payload + get_element_value(element);
+        if (element_tag == tag::string) {
+            f(child);
+        } else if (element_tag == tag::array || element_tag == tag::object) {
+            success = push(element_tag, child);
+        }
+    }
+    delete[] frames;
+    return success;
+}
+} // namespace internal
+
+/// \cond INTERNAL
+namespace internal {
+/// The parts of a \ref document that most parses leave empty, kept behind
+/// one pointer so the document itself stays small.
+struct document_extras {
+    static constexpr size_t NO_ERROR_OFFSET = ~size_t{};
+
+    // strings that had to be unescaped outside of read-only input
+    allocated_buffer side_text;
+    // see source_range_recorder::take()
+    allocated_buffer source_ranges;
+    // the input and side_text, for values to find their strings through
+    string_bases bases = string_bases();
+    size_t error_offset = NO_ERROR_OFFSET; // in bytes from the start of input
+    size_t required_size_in_words = 0;
+    int error_arg = 0;
+};
 } // namespace internal
+/// \endcond
+
+/// Where an array or object appears in the input, as reported by
+/// document::get_source_range().
+struct source_range {
+    /// Offset of the opening bracket.
+    size_t begin;
+    /// Offset just past the closing bracket.
+    size_t end;
+    /// True if a string inside was unescaped in place, so the input bytes
+    /// no longer spell the original text.  Never true for read-only input.
+    /// Parsing in place also replaces each string's closing quote with a
+    /// NUL; see dump_passthrough() in sajson_dump.h.
+    bool modified;
+};
 
 /**
  * Represents the result of a JSON parse: either is_valid() and the document
@@ -1030,23 +1397,42 @@ inline const char* get_error_text(error error_code) {
 class document {
 public:
     document()
-        : document{ mutable_string_view{}, 0, 0, ERROR_UNINITIALIZED, 0 } {}
-
-    document(document&& rhs)
-        : input(rhs.input)
-        , structure(std::move(rhs.structure))
-        , root_tag(rhs.root_tag)
-        , root(rhs.root)
-        , error_line(rhs.error_line)
-        , error_column(rhs.error_column)
-        , error_code(rhs.error_code)
-        , error_arg(rhs.error_arg) {
-        // Yikes... but strcpy is okay here because formatted_error is
-        // guaranteed to be null-terminated.
-        strcpy(formatted_error_message, rhs.formatted_error_message);
-        // should rhs's fields be zeroed too?
+        : document{
+            mutable_string_view{}, NO_ERROR_OFFSET, ERROR_UNINITIALIZED, 0
+        } {}
+
+    document(document&& that)
+        : input(std::move(that.input))
+        , extras(that.extras)
+        , structure(std::move(that.structure))
+        , root(that.root)
+        , ast_size_in_words(that.ast_size_in_words)
+        , root_tag(that.root_tag)
+        , strings_by_address(that.strings_by_address)
+        , read_only(that.read_only)
+        , error_code(that.error_code) {
+        that.extras = 0;
+    }
+
+    document& operator=(document&& that) {
+        if (this != &that) {
+            delete extras;
+            input = std::move(that.input);
+            extras = that.extras;
+            structure = std::move(that.structure);
+            root = that.root;
+            ast_size_in_words = that.ast_size_in_words;
+            root_tag = that.root_tag;
+            strings_by_address = that.strings_by_address;
+            read_only = that.read_only;
+            error_code = that.error_code;
+            that.extras = 0;
+        }
+        return *this;
     }
 
+    ~document() { delete extras; }
+
     /**
      * Returns true if the document was parsed successfully.
      * If true, call get_root() to access the document's root value.
@@ -1058,26 +1444,152 @@ public:
     }
 
     /// If is_valid(), returns the document's root \ref value.
-    value get_root() const { return value(root_tag, root, input.get_data()); }
+    value get_root() const { return value(root_tag, root, get_strings()); }
+
+    /// Moves the AST into an allocation of exactly its size, releasing the
+    /// rest of the parse buffer (for \ref single_allocation, one word per
+    /// input byte).  If \p drop_input is true, the input text is replaced
+    /// with a copy holding only the strings and object keys the AST still
+    /// references.  Useful for documents that are kept around long after
+    /// parsing.
+    ///
+    /// Invalidates any \ref value obtained from this document.  Returns
+    /// false, leaving the document unchanged, if the document is not valid
+    /// or memory for the AST could not be allocated.  Allocating the new
+    /// input text throws std::bad_alloc on failure.
+    bool compact(bool drop_input = false) {
+        if (!is_valid()) {
+            return false;
+        }
+
+        size_t text_length = 0;
+        if (drop_input) {
+            bool counted = internal::for_each_string(
+                root_tag, const_cast<size_t*>(root), [&](size_t* range) {
+                    text_length += range[1] - range[0] + 1;
+                });
+            if (!counted) {
+                return false;
+            }
+        }
+        mutable_string_view text = drop_input
+            ? mutable_string_view(text_length)
+            : mutable_string_view();
+
+        size_t* ast = new (std::nothrow) size_t[ast_size_in_words];
+        if (!ast) {
+            return false;
+        }
+        memcpy(ast, root, ast_size_in_words * sizeof(size_t));
+
+        if (drop_input) {
+            const internal::string_base old_strings = get_strings();
+            char* new_text = text.get_data();
+            size_t offset = 0;
+            bool copied = internal::for_each_string(
+                root_tag, ast, [&](size_t* range) {
+                    size_t length = range[1] - range[0];
+                    memcpy(new_text + offset, old_strings.get(range[0]), length);
+                    new_text[offset + length] = 0;
+                    range[0] = offset;
+                    range[1] = offset + length;
+                    offset += length + 1;
+                });
+            if (!copied) {
+                delete[] ast;
+                return false;
+            }
+            input = std::move(text);
+            // A valid document's extras hold nothing but the side text
+            // and source ranges.
+            delete extras;
+            extras = 0;
+            strings_by_address = false;
+            read_only = false;
+        }
+
+        structure = internal::ownership(ast);
+        root = ast;
+        return true;
+    }
+
+    /// If the document was parsed by parse_with_source_ranges() or
+    /// parse_read_only_with_source_ranges(), finds where array or object
+    /// \p v, which must come from this document, appears in the input.
+    /// Returns false for other values and documents, or after
+    /// compact(true).
+    bool get_source_range(const value& v, source_range* range) const {
+        const size_t* records = extras
+            ? reinterpret_cast<const size_t*>(extras->source_ranges.get_data())
+            : 0;
+        const type t = v.get_type();
+        if (!records || (t != TYPE_ARRAY && t != TYPE_OBJECT)) {
+            return false;
+        }
+        // Structures are identified by their distance from the end of the
+        // AST, which compact() preserves.
+        const size_t ast_offset = static_cast<size_t>(
+            (reinterpret_cast<uintptr_t>(root + ast_size_in_words)
+             - reinterpret_cast<uintptr_t>(v._internal_get_payload()))
+            / sizeof(size_t));
+        size_t lo = 0;
+        size_t hi = records[0];
+        while (lo < hi) {
+            const size_t mid = lo + (hi - lo) / 2;
+            const size_t* record = records + 1 + 3 * mid;
+            if (record[0] < ast_offset) {
+                lo = mid + 1;
+            } else if (record[0] > ast_offset) {
+                hi = mid;
+            } else {
+                range->begin = record[1];
+                range->end = record[2] >> 1;
+                range->modified = record[2] & 1;
+                return true;
+            }
+        }
+        return false;
+    }
 
     /// If not is_valid(), returns the one-based line number where the parse
     /// failed.
-    size_t get_error_line() const { return error_line; }
+    size_t get_error_line() const {
+        size_t line, column;
+        locate_error(&line, &column);
+        return line;
+    }
 
     /// If not is_valid(), returns the one-based column number where the parse
     /// failed.
-    size_t get_error_column() const { return error_column; }
+    size_t get_error_column() const {
+        size_t line, column;
+        locate_error(&line, &column);
+        return column;
+    }
+
+    /// If the parse failed with an out-of-memory error, returns the size of
+    /// the smallest \ref bounded_allocation buffer, in words, with which it
+    /// would have succeeded.  Returns zero if that is unknown, for example
+    /// because the rest of the input is not well-formed.  See also
+    /// \ref measure.
+    size_t get_required_size_in_words() const {
+        return extras ? extras->required_size_in_words : 0;
+    }
 
     /// If not is_valid(), returns a std::string indicating why the parse
     /// failed.
     std::string get_error_message_as_string() const {
-        return formatted_error_message;
+        return get_error_message_as_cstring();
     }
 
     /// If not is_valid(), returns a null-terminated C string indicating why the
     /// parse failed.
     const char* get_error_message_as_cstring() const {
-        return formatted_error_message;
+        if (error_code == ERROR_NO_ERROR) {
+            return "";
+        }
+        return internal::get_error_message(
+            error_code, _internal_get_error_argument());
     }
 
     /// \cond INTERNAL
@@ -1086,13 +1598,20 @@ public:
     error _internal_get_error_code() const { return error_code; }
 
     // WARNING: Internal function which is subject to change
-    int _internal_get_error_argument() const { return error_arg; }
+    int _internal_get_error_argument() const {
+        return extras ? extras->error_arg : 0;
+    }
 
     // WARNING: Internal function which is subject to change
     const char* _internal_get_error_text() const {
         return internal::get_error_text(error_code);
     }
 
+    // WARNING: Internal function which is subject to change
+    static document _internal_make_error(error error_code) {
+        return document(mutable_string_view(), NO_ERROR_OFFSET, error_code, 0);
+    }
+
     // WARNING: Internal function exposed only for high-performance language
     // bindings.
     internal::tag _internal_get_root_tag() const { return root_tag; }
@@ -1113,76 +1632,132 @@ private:
     document(const document&) = delete;
     void operator=(const document&) = delete;
 
+    static constexpr size_t NO_ERROR_OFFSET
+        = internal::document_extras::NO_ERROR_OFFSET;
+
+    // Takes ownership of extras, which may be null.
     explicit document(
         const mutable_string_view& input_,
         internal::ownership&& structure_,
         tag root_tag_,
-        const size_t* root_)
+        const size_t* root_,
+        size_t ast_size_in_words_,
+        internal::document_extras* extras_ = 0,
+        bool strings_by_address_ = false,
+        bool read_only_ = false)
         : input(input_)
+        , extras(extras_)
         , structure(std::move(structure_))
-        , root_tag(root_tag_)
         , root(root_)
-        , error_line(0)
-        , error_column(0)
-        , error_code(ERROR_NO_ERROR)
-        , error_arg(0) {
-        formatted_error_message[0] = 0;
-    }
+        , ast_size_in_words(ast_size_in_words_)
+        , root_tag(root_tag_)
+        , strings_by_address(strings_by_address_)
+        , read_only(read_only_)
+        , error_code(ERROR_NO_ERROR) {}
 
+    // Reports ERROR_OUT_OF_MEMORY instead if the error details cannot be
+    // stored.
     explicit document(
         const mutable_string_view& input_,
-        size_t error_line_,
-        size_t error_column_,
+        size_t error_offset_,
         const error error_code_,
-        int error_arg_)
+        int error_arg_,
+        size_t required_size_in_words_ = 0)
         : input(input_)
+        , extras(0)
         , structure(0)
-        , root_tag(tag::null)
         , root(0)
-        , error_line(error_line_)
-        , error_column(error_column_)
-        , error_code(error_code_)
-        , error_arg(error_arg_) {
-        formatted_error_message[ERROR_BUFFER_LENGTH - 1] = 0;
-        int written = has_significant_error_arg()
-            ? SAJSON_snprintf(
-                  formatted_error_message,
-                  ERROR_BUFFER_LENGTH - 1,
-                  "%s: %d",
-                  _internal_get_error_text(),
-                  error_arg)
-            : SAJSON_snprintf(
-                  formatted_error_message,
-                  ERROR_BUFFER_LENGTH - 1,
-                  "%s",
-                  _internal_get_error_text());
-        (void)written;
-        assert(written >= 0 && written < ERROR_BUFFER_LENGTH);
-    }
-
-    bool has_significant_error_arg() const {
-        return error_code == ERROR_ILLEGAL_CODEPOINT;
+        , ast_size_in_words(0)
+        , root_tag(tag::null)
+        , strings_by_address(false)
+        , read_only(false)
+        , error_code(error_code_) {
+        if (error_offset_ == NO_ERROR_OFFSET && error_arg_ == 0
+            && required_size_in_words_ == 0) {
+            return;
+        }
+        extras = new (std::nothrow) internal::document_extras;
+        if (!extras) {
+            error_code = ERROR_OUT_OF_MEMORY;
+            return;
+        }
+        extras->error_offset = error_offset_;
+        extras->required_size_in_words = required_size_in_words_;
+        extras->error_arg = error_arg_;
+    }
+
+    internal::string_base get_strings() const {
+        const uint8_t flags
+            = read_only ? internal::string_base::UNTERMINATED : 0;
+        if (extras && extras->bases.side) {
+            return internal::string_base(extras->bases, flags);
+        }
+        return internal::string_base(
+            strings_by_address ? 0 : input.get_data(), flags);
+    }
+
+    // Line and column are only needed when reporting an error, so they are
+    // computed on demand by rescanning the input up to the error.
+    void locate_error(size_t* line, size_t* column) const {
+        const size_t error_offset
+            = extras ? extras->error_offset : NO_ERROR_OFFSET;
+        if (error_offset == NO_ERROR_OFFSET) {
+            *line = 0;
+            *column = 0;
+            return;
+        }
+
+        *line = 1;
+        *column = 1;
+        const char* c = input.get_data();
+        const char* const p = c + error_offset;
+        while (c < p) {
+            if (*c == '\r') {
+                if (c + 1 < p && c[1] == '\n') {
+                    ++c;
+                }
+                ++*line;
+                *column = 1;
+            } else if (*c == '\n') {
+                ++*line;
+                *column = 1;
+            } else {
+                // TODO: count UTF-8 characters
+                ++*column;
+            }
+            ++c;
+        }
     }
 
     mutable_string_view input;
+    internal::document_extras* extras; // owned; null if all empty
     internal::ownership structure;
-    const tag root_tag;
-    const size_t* const root;
-    const size_t error_line;
-    const size_t error_column;
-    const error error_code;
-    const int error_arg;
-
-    enum { ERROR_BUFFER_LENGTH = 128 };
-    char formatted_error_message[ERROR_BUFFER_LENGTH];
+    const size_t* root;
+    size_t ast_size_in_words;
+    tag root_tag;
+    // see internal::string_bases
+    bool strings_by_address;
+    // see internal::string_base::UNTERMINATED
+    bool read_only;
+    error error_code;
 
     template <typename AllocationStrategy, typename StringType>
     friend document
     parse(const AllocationStrategy& strategy, const StringType& string);
+    template <typename AllocationStrategy>
+    friend document
+    parse_read_only(const AllocationStrategy& strategy, std::string_view text);
     template <typename Allocator>
     friend class parser;
 };
 
+// Documents are often kept by the thousand, so anything most parses leave
+// empty belongs in internal::document_extras: eleven words, plus the error
+// code on 32-bit targets.
+static_assert(
+    sizeof(document) <= 11 * sizeof(size_t) + sizeof(error),
+    "document grew; see internal::document_extras");
+
 /// Allocation policy that allocates one large buffer guaranteed to hold the
 /// resulting AST.  This allocation policy is the fastest since it requires
 /// no conditionals to see if more memory must be allocated.
@@ -1367,6 +1942,101 @@ private:
     size_t existing_buffer_size;
 };
 
+/// Thread-safe running statistics shared between parses that use
+/// \ref dynamic_allocation.  Every successful parse records how many AST
+/// words it produced per byte of input, and subsequent parses size their
+/// initial AST buffer from the learned ratio instead of growing into it.
+/// Reallocations of the AST and the parse stack are counted as well.
+///
+/// One instance may be shared by any number of threads parsing
+/// concurrently.  It must outlive every parse that refers to it.
+class allocation_statistics {
+public:
+    allocation_statistics()
+        : parse_count(0)
+        , reallocation_count(0)
+        , ast_words_per_byte(0) {}
+
+    allocation_statistics(const allocation_statistics&) = delete;
+    void operator=(const allocation_statistics&) = delete;
+
+    /// Returns the number of successful parses recorded so far.
+    size_t get_parse_count() const {
+        return parse_count.load(std::memory_order_relaxed);
+    }
+
+    /// Returns how many times an AST or stack buffer had to be
+    /// reallocated and copied because it was too small.
+    size_t get_reallocation_count() const {
+        return reallocation_count.load(std::memory_order_relaxed);
+    }
+
+    /// Returns the learned number of AST words per input byte, or zero if
+    /// no parse has been recorded.
+    double get_ast_words_per_byte() const {
+        return static_cast<double>(
+                   ast_words_per_byte.load(std::memory_order_relaxed))
+            / RATIO_ONE;
+    }
+
+    /// \cond INTERNAL
+
+    /// Returns an initial AST capacity for an input of the given size, or
+    /// zero if nothing has been learned yet.
+    size_t guess_ast_capacity(size_t input_document_size_in_bytes) const {
+        uint64_t ratio = ast_words_per_byte.load(std::memory_order_relaxed);
+        if (!ratio) {
+            return 0;
+        }
+        // Leave 25% headroom so a document slightly denser than average
+        // does not immediately double the buffer.
+        ratio += ratio / 4;
+        uint64_t words
+            = (static_cast<uint64_t>(input_document_size_in_bytes) * ratio)
+            / RATIO_ONE;
+        // The AST never needs more than one word per input byte.
+        return static_cast<size_t>(std::min<uint64_t>(
+            std::max<uint64_t>(words, 1), input_document_size_in_bytes + 1));
+    }
+
+    void record_parse(size_t input_document_size_in_bytes, size_t ast_words) {
+        if (!input_document_size_in_bytes) {
+            return;
+        }
+        uint64_t sample = static_cast<uint64_t>(ast_words) * RATIO_ONE
+            / input_document_size_in_bytes;
+        if (!sample) {
+            sample = 1;
+        }
+        // Exponential moving average with weight 1/8 so the estimate
+        // follows shifts in the workload without jumping on outliers.
+        uint64_t current = ast_words_per_byte.load(std::memory_order_relaxed);
+        uint64_t next;
+        do {
+            next = current ? current - current / 8 + sample / 8 : sample;
+            if (!next) {
+                next = 1;
+            }
+        } while (!ast_words_per_byte.compare_exchange_weak(
+            current, next, std::memory_order_relaxed));
+        parse_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void record_reallocation() {
+        reallocation_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /// \endcond
+
+private:
+    // ast_words_per_byte is fixed point with 16 fractional bits.
+    static constexpr uint64_t RATIO_ONE = uint64_t(1) << 16;
+
+    std::atomic<size_t> parse_count;
+    std::atomic<size_t> reallocation_count;
+    std::atomic<uint64_t> ast_words_per_byte;
+};
+
 /// Allocation policy that uses dynamically-growing buffers for both the
 /// parse stack and the AST.  This allocation policy minimizes peak memory
 /// usage at the cost of some allocation and copying churn.
@@ -1379,7 +2049,8 @@ public:
         stack_head(stack_head&& other)
             : stack_top(other.stack_top)
             , stack_bottom(other.stack_bottom)
-            , stack_limit(other.stack_limit) {
+            , stack_limit(other.stack_limit)
+            , statistics(other.statistics) {
             other.stack_top = 0;
             other.stack_bottom = 0;
             other.stack_limit = 0;
@@ -1422,7 +2093,11 @@ public:
         stack_head(const stack_head&) = delete;
         void operator=(const stack_head&) = delete;
 
-        explicit stack_head(size_t initial_capacity, bool* success) {
+        explicit stack_head(
+            size_t initial_capacity,
+            allocation_statistics* statistics_,
+            bool* success)
+            : statistics(statistics_) {
             assert(initial_capacity);
             stack_bottom = new (std::nothrow) size_t[initial_capacity];
             stack_top = stack_bottom;
@@ -1453,6 +2128,9 @@ public:
                 stack_limit = 0;
                 return false;
             }
+            if (statistics) {
+                statistics->record_reallocation();
+            }
 
             memcpy(new_stack, stack_bottom, current_size * sizeof(size_t));
             delete[] stack_bottom;
@@ -1465,6 +2143,7 @@ public:
         size_t* stack_top; // stack grows up: stack_top >= stack_bottom
         size_t* stack_bottom;
         size_t* stack_limit;
+        allocation_statistics* statistics;
 
         friend class dynamic_allocation;
     };
@@ -1478,23 +2157,31 @@ public:
         explicit allocator(
             size_t* buffer_,
             size_t current_capacity,
-            size_t initial_stack_capacity_)
+            size_t initial_stack_capacity_,
+            size_t input_document_size_in_bytes_,
+            allocation_statistics* statistics_)
             : ast_buffer_bottom(buffer_)
             , ast_buffer_top(buffer_ + current_capacity)
             , ast_write_head(ast_buffer_top)
-            , initial_stack_capacity(initial_stack_capacity_) {}
+            , initial_stack_capacity(initial_stack_capacity_)
+            , input_document_size_in_bytes(input_document_size_in_bytes_)
+            , statistics(statistics_) {}
 
         explicit allocator(std::nullptr_t)
             : ast_buffer_bottom(0)
             , ast_buffer_top(0)
             , ast_write_head(0)
-            , initial_stack_capacity(0) {}
+            , initial_stack_capacity(0)
+            , input_document_size_in_bytes(0)
+            , statistics(0) {}
 
         allocator(allocator&& other)
             : ast_buffer_bottom(other.ast_buffer_bottom)
             , ast_buffer_top(other.ast_buffer_top)
             , ast_write_head(other.ast_write_head)
-            , initial_stack_capacity(other.initial_stack_capacity) {
+            , initial_stack_capacity(other.initial_stack_capacity)
+            , input_document_size_in_bytes(other.input_document_size_in_bytes)
+            , statistics(other.statistics) {
             other.ast_buffer_bottom = 0;
             other.ast_buffer_top = 0;
             other.ast_write_head = 0;
@@ -1503,7 +2190,7 @@ public:
         ~allocator() { delete[] ast_buffer_bottom; }
 
         stack_head get_stack_head(bool* success) {
-            return stack_head(initial_stack_capacity, success);
+            return stack_head(initial_stack_capacity, statistics, success);
         }
 
         size_t get_write_offset() { return static_cast<size_t>(ast_buffer_top - ast_write_head); }
@@ -1524,6 +2211,10 @@ public:
         size_t* get_ast_root() { return ast_write_head; }
 
         internal::ownership transfer_ownership() {
+            if (statistics) {
+                statistics->record_parse(
+                    input_document_size_in_bytes, get_write_offset());
+            }
             auto p = ast_buffer_bottom;
             ast_buffer_bottom = 0;
             ast_buffer_top = 0;
@@ -1554,6 +2245,9 @@ public:
                 ast_write_head = 0;
                 return false;
             }
+            if (statistics) {
+                statistics->record_reallocation();
+            }
 
             size_t* old_write_head = ast_write_head;
             ast_buffer_bottom = new_buffer;
@@ -1571,25 +2265,44 @@ public:
         size_t* ast_buffer_top;
         size_t* ast_write_head;
         size_t initial_stack_capacity;
+        size_t input_document_size_in_bytes;
+        allocation_statistics* statistics;
     };
 
     /// \endcond
 
     /// Creates a dynamic_allocation policy with the given initial AST
-    /// and stack buffer sizes.
+    /// and stack buffer sizes.  A size of zero picks a default derived from
+    /// the input document's length.  If \p statistics_ is given, each
+    /// successful parse is recorded into it and, when no initial AST
+    /// capacity is specified, the AST buffer is sized from what it learned.
     dynamic_allocation(
-        size_t initial_ast_capacity_ = 0, size_t initial_stack_capacity_ = 0)
+        size_t initial_ast_capacity_ = 0,
+        size_t initial_stack_capacity_ = 0,
+        allocation_statistics* statistics_ = 0)
         : initial_ast_capacity(initial_ast_capacity_)
-        , initial_stack_capacity(initial_stack_capacity_) {}
+        , initial_stack_capacity(initial_stack_capacity_)
+        , statistics(statistics_) {}
+
+    /// Creates a dynamic_allocation policy that sizes its buffers from, and
+    /// records each parse into, the given shared statistics.
+    explicit dynamic_allocation(allocation_statistics& statistics_)
+        : dynamic_allocation(0, 0, &statistics_) {}
 
     /// \cond INTERNAL
 
     allocator
-    make_allocator([[maybe_unused]] size_t input_document_size_in_bytes, bool* succeeded) const {
+    make_allocator(size_t input_document_size_in_bytes, bool* succeeded) const {
         size_t capacity = initial_ast_capacity;
+        if (!capacity && statistics) {
+            capacity = statistics->guess_ast_capacity(
+                input_document_size_in_bytes);
+        }
         if (!capacity) {
-            // TODO: guess based on input document size
-            capacity = 1024;
+            // Typical documents need between a tenth and a quarter of a
+            // word per input byte.  Never more than one.
+            capacity = std::max<size_t>(
+                input_document_size_in_bytes / 4, MINIMUM_AST_CAPACITY);
         }
 
         size_t* buffer = new (std::nothrow) size_t[capacity];
@@ -1600,18 +2313,30 @@ public:
 
         size_t stack_capacity = initial_stack_capacity;
         if (!stack_capacity) {
-            stack_capacity = 256;
+            // The stack holds the members of every open array and
+            // object, which is rarely more than a small fraction of the
+            // document.
+            stack_capacity = std::max<size_t>(
+                input_document_size_in_bytes / 64, MINIMUM_STACK_CAPACITY);
         }
 
         *succeeded = true;
-        return allocator(buffer, capacity, stack_capacity);
+        return allocator(
+            buffer,
+            capacity,
+            stack_capacity,
+            input_document_size_in_bytes,
+            statistics);
     }
 
     /// \endcond
 
 private:
+    enum { MINIMUM_AST_CAPACITY = 64, MINIMUM_STACK_CAPACITY = 64 };
+
     size_t initial_ast_capacity;
     size_t initial_stack_capacity;
+    allocation_statistics* statistics;
 };
 
 /// Allocation policy that attempts to fit the parsed AST into an existing
@@ -1775,98 +2500,1405 @@ private:
     size_t existing_buffer_size;
 };
 
-// I thought about putting parser in the internal namespace but I don't
-// want to indent it further...
-/// \cond INTERNAL
-template <typename Allocator>
-class parser {
+/// Allocation policy that starts out like \ref bounded_allocation, sharing a
+/// caller-provided buffer between the parse stack and the AST, but spills to
+/// the heap instead of failing when the buffer is exhausted.  Documents that
+/// fit in the buffer are parsed without any allocation; larger documents
+/// continue transparently with \ref dynamic_allocation -style growth.
+///
+/// When the buffer first overflows, the partial AST moves to the heap and
+/// the parse stack gets the whole buffer.  If the stack outgrows it too, the
+/// stack moves to the heap as well.  The AST never moves the stack, so the
+/// parser's pointers into the stack stay valid.
+class hybrid_allocation {
 public:
-    parser(const mutable_string_view& msv, Allocator&& allocator_)
-        : input(msv)
-        , input_end(input.get_data() + input.length())
-        , allocator(std::move(allocator_))
-        , root_tag(internal::tag::null)
-        , error_line(0)
-        , error_column(0) {}
-
-    document get_document() {
-        if (parse()) {
-            size_t* ast_root = allocator.get_ast_root();
-            return document(
-                input, allocator.transfer_ownership(), root_tag, ast_root);
-        } else {
-            return document(
-                input, error_line, error_column, error_code, error_arg);
-        }
-    }
+    /// \cond INTERNAL
 
-private:
-    struct error_result {
-        operator bool() const { return false; }
-        operator char*() const { return 0; }
-    };
+    class allocator;
 
-    bool at_eof(const char* p) { return p == input_end; }
+    class stack_head {
+    public:
+        stack_head(stack_head&& other)
+            : source_allocator(other.source_allocator) {
+            other.source_allocator = 0;
+        }
 
-    char* skip_whitespace(char* p) {
-        // There is an opportunity to make better use of superscalar
-        // hardware here* but if someone cares about JSON parsing
-        // performance the first thing they do is minify, so prefer
-        // to optimize for code size here.
-        // *
-        // https://github.com/chadaustin/Web-Benchmarks/blob/master/json/third-party/pjson/pjson.h#L1873
-        for (;;) {
-            if (SAJSON_UNLIKELY(p == input_end)) {
-                return 0;
-            } else if (internal::is_whitespace(*p)) {
-                ++p;
+        bool push(size_t element) {
+            if (SAJSON_LIKELY(source_allocator->can_grow_stack(1))) {
+                *(source_allocator->stack_top)++ = element;
+                return true;
             } else {
-                return p;
+                return false;
             }
         }
-    }
-
-    error_result oom(char* p, const char* /*reason*/) {
-        return make_error(p, ERROR_OUT_OF_MEMORY);
-    }
-
-    error_result unexpected_end() {
-        return make_error(0, ERROR_UNEXPECTED_END);
-    }
 
-    error_result unexpected_end(char* p) {
-        return make_error(p, ERROR_UNEXPECTED_END);
+        size_t* reserve(size_t amount, bool* success) {
+            if (SAJSON_LIKELY(source_allocator->can_grow_stack(amount))) {
+                size_t* rv = source_allocator->stack_top;
+                source_allocator->stack_top += amount;
+                *success = true;
+                return rv;
+            } else {
+                *success = false;
+                return 0;
+            }
+        }
+
+        void reset(size_t new_top) {
+            source_allocator->stack_top
+                = source_allocator->stack_bottom + new_top;
+        }
+
+        size_t get_size() {
+            return static_cast<size_t>(
+                source_allocator->stack_top - source_allocator->stack_bottom);
+        }
+
+        size_t* get_top() { return source_allocator->stack_top; }
+
+        size_t* get_pointer_from_offset(size_t offset) {
+            return source_allocator->stack_bottom + offset;
+        }
+
+    private:
+        stack_head(const stack_head&) = delete;
+        void operator=(const stack_head&) = delete;
+
+        explicit stack_head(allocator* source_allocator_)
+            : source_allocator(source_allocator_) {}
+
+        allocator* source_allocator;
+
+        friend class hybrid_allocation;
+    };
+
+    class allocator {
+    public:
+        allocator() = delete;
+        allocator(const allocator&) = delete;
+        void operator=(const allocator&) = delete;
+
+        explicit allocator(size_t* existing_buffer, size_t existing_buffer_size)
+            : buffer_size(existing_buffer_size)
+            , stack_bottom(existing_buffer)
+            , stack_top(existing_buffer)
+            , stack_limit(existing_buffer + existing_buffer_size)
+            , ast_bottom(existing_buffer)
+            , ast_top(existing_buffer + existing_buffer_size)
+            , write_cursor(ast_top)
+            , shared(true)
+            , stack_on_heap(false) {}
+
+        allocator(allocator&& other)
+            : buffer_size(other.buffer_size)
+            , stack_bottom(other.stack_bottom)
+            , stack_top(other.stack_top)
+            , stack_limit(other.stack_limit)
+            , ast_bottom(other.ast_bottom)
+            , ast_top(other.ast_top)
+            , write_cursor(other.write_cursor)
+            , shared(other.shared)
+            , stack_on_heap(other.stack_on_heap) {
+            other.stack_bottom = 0;
+            other.stack_top = 0;
+            other.stack_limit = 0;
+            other.ast_bottom = 0;
+            other.ast_top = 0;
+            other.write_cursor = 0;
+            other.shared = true;
+            other.stack_on_heap = false;
+        }
+
+        ~allocator() {
+            if (stack_on_heap) {
+                delete[] stack_bottom;
+            }
+            if (!shared) {
+                delete[] ast_bottom;
+            }
+        }
+
+        stack_head get_stack_head(bool* success) {
+            *success = true;
+            return stack_head(this);
+        }
+
+        size_t get_write_offset() { return static_cast<size_t>(ast_top - write_cursor); }
+
+        size_t* get_write_pointer_of(size_t v) { return ast_top - v; }
+
+        size_t* reserve(size_t size, bool* success) {
+            if (can_grow_ast(size)) {
+                write_cursor -= size;
+                *success = true;
+                return write_cursor;
+            } else {
+                *success = false;
+                return 0;
+            }
+        }
+
+        size_t* get_ast_root() { return write_cursor; }
+
+        /// Returns true if the AST no longer fits in the caller's buffer.
+        bool has_spilled() const { return !shared; }
+
+        internal::ownership transfer_ownership() {
+            if (stack_on_heap) {
+                delete[] stack_bottom;
+                stack_on_heap = false;
+            }
+            stack_bottom = 0;
+            stack_top = 0;
+            stack_limit = 0;
+
+            auto p = shared ? 0 : ast_bottom;
+            ast_bottom = 0;
+            ast_top = 0;
+            write_cursor = 0;
+            shared = true;
+            return internal::ownership(p);
+        }
+
+    private:
+        bool can_grow_stack(size_t amount) {
+            size_t* limit = shared ? write_cursor : stack_limit;
+            if (SAJSON_LIKELY(
+                    amount <= static_cast<size_t>(limit - stack_top))) {
+                return true;
+            }
+            if (shared) {
+                // Make room by moving the AST out; the stack then has the
+                // whole buffer to itself.
+                if (!spill_ast(0)) {
+                    return false;
+                }
+                if (amount <= static_cast<size_t>(stack_limit - stack_top)) {
+                    return true;
+                }
+            }
+            return grow_stack(amount);
+        }
+
+        bool can_grow_ast(size_t amount) {
+            size_t* floor = shared ? stack_top : ast_bottom;
+            if (SAJSON_LIKELY(
+                    amount <= static_cast<size_t>(write_cursor - floor))) {
+                return true;
+            }
+            return spill_ast(amount);
+        }
+
+        // Moves the AST into a new heap buffer with room for at least
+        // `amount` more words.  Never touches the stack.
+        bool spill_ast(size_t amount) {
+            size_t current_capacity = shared
+                ? std::max<size_t>(buffer_size, MINIMUM_HEAP_CAPACITY)
+                : static_cast<size_t>(ast_top - ast_bottom);
+            size_t current_size = static_cast<size_t>(ast_top - write_cursor);
+            size_t new_capacity = current_capacity * 2;
+            while (new_capacity < amount + current_size) {
+                new_capacity *= 2;
+            }
+
+            size_t* new_buffer = new (std::nothrow) size_t[new_capacity];
+            if (!new_buffer) {
+                return false;
+            }
+
+            size_t* old_write_head = write_cursor;
+            size_t* old_buffer = shared ? 0 : ast_bottom;
+            ast_bottom = new_buffer;
+            ast_top = new_buffer + new_capacity;
+            write_cursor = ast_top - current_size;
+            memcpy(write_cursor, old_write_head, current_size * sizeof(size_t));
+            delete[] old_buffer;
+
+            shared = false;
+            return true;
+        }
+
+        bool grow_stack(size_t amount) {
+            size_t current_size = static_cast<size_t>(stack_top - stack_bottom);
+            size_t new_capacity = std::max<size_t>(
+                static_cast<size_t>(stack_limit - stack_bottom) * 2,
+                MINIMUM_HEAP_CAPACITY);
+            while (new_capacity < amount + current_size) {
+                new_capacity *= 2;
+            }
+
+            size_t* new_stack = new (std::nothrow) size_t[new_capacity];
+            if (!new_stack) {
+                return false;
+            }
+
+            memcpy(new_stack, stack_bottom, current_size * sizeof(size_t));
+            if (stack_on_heap) {
+                delete[] stack_bottom;
+            }
+            stack_bottom = new_stack;
+            stack_top = new_stack + current_size;
+            stack_limit = new_stack + new_capacity;
+            stack_on_heap = true;
+            return true;
+        }
+
+        enum { MINIMUM_HEAP_CAPACITY = 64 };
+
+        size_t buffer_size;
+
+        // Until the AST spills, the stack grows up and the AST grows down
+        // in the caller's buffer, and stack_limit is unused.
+        size_t* stack_bottom;
+        size_t* stack_top;
+        size_t* stack_limit;
+        size_t* ast_bottom;
+        size_t* ast_top;
+        size_t* write_cursor;
+        bool shared;
+        bool stack_on_heap;
+
+        friend class hybrid_allocation;
+    };
+
+    /// \endcond
+
+    /// Parses into the given buffer while the document fits and spills to
+    /// the heap once it does not.  The buffer must not be deallocated until
+    /// the resulting \ref document is destroyed.
+    hybrid_allocation(size_t* existing_buffer_, size_t size_in_words)
+        : existing_buffer(existing_buffer_)
+        , existing_buffer_size(size_in_words) {}
+
+    /// Convenience wrapper for hybrid_allocation(size_t*, size) that
+    /// automatically infers the size of the given array.
+    template <size_t N>
+    explicit hybrid_allocation(size_t (&existing_buffer_)[N])
+        : hybrid_allocation(existing_buffer_, N) {}
+
+    /// \cond INTERNAL
+
+    allocator
+    make_allocator([[maybe_unused]] size_t input_document_size_in_bytes, bool* succeeded) const {
+        *succeeded = true;
+        return allocator(existing_buffer, existing_buffer_size);
+    }
+
+    /// \endcond
+
+private:
+    size_t* existing_buffer;
+    size_t existing_buffer_size;
+};
+
+#ifdef SAJSON_HAS_MEMORY_RESOURCE
+/// Allocation policy that grows the parse stack and the AST like
+/// \ref dynamic_allocation, but obtains every buffer from a
+/// std::pmr::memory_resource instead of the global heap.  The resource must
+/// outlive the resulting \ref document.  A resource that throws from
+/// allocate() causes the parse to fail with ERROR_OUT_OF_MEMORY.
+class pmr_allocation {
+public:
+    /// \cond INTERNAL
+
+    class stack_head {
+    public:
+        stack_head(stack_head&& other)
+            : stack_top(other.stack_top)
+            , stack_bottom(other.stack_bottom)
+            , stack_limit(other.stack_limit)
+            , resource(other.resource) {
+            other.stack_top = 0;
+            other.stack_bottom = 0;
+            other.stack_limit = 0;
+        }
+
+        ~stack_head() { release(); }
+
+        bool push(size_t element) {
+            if (can_grow(1)) {
+                *stack_top++ = element;
+                return true;
+            } else {
+                return false;
+            }
+        }
+
+        size_t* reserve(size_t amount, bool* success) {
+            if (can_grow(amount)) {
+                size_t* rv = stack_top;
+                stack_top += amount;
+                *success = true;
+                return rv;
+            } else {
+                *success = false;
+                return 0;
+            }
+        }
+
+        void reset(size_t new_top) { stack_top = stack_bottom + new_top; }
+
+        size_t get_size() { return static_cast<size_t>(stack_top - stack_bottom); }
+
+        size_t* get_top() { return stack_top; }
+
+        size_t* get_pointer_from_offset(size_t offset) {
+            return stack_bottom + offset;
+        }
+
+    private:
+        stack_head(const stack_head&) = delete;
+        void operator=(const stack_head&) = delete;
+
+        explicit stack_head(
+            std::pmr::memory_resource* resource_,
+            size_t initial_capacity,
+            bool* success)
+            : resource(resource_) {
+            assert(initial_capacity);
+            stack_bottom = allocate_words(resource, initial_capacity);
+            stack_top = stack_bottom;
+            if (stack_bottom) {
+                stack_limit = stack_bottom + initial_capacity;
+            } else {
+                stack_limit = 0;
+            }
+            *success = !!stack_bottom;
+        }
+
+        bool can_grow(size_t amount) {
+            if (SAJSON_LIKELY(
+                    amount <= static_cast<size_t>(stack_limit - stack_top))) {
+                return true;
+            }
+
+            size_t current_size = static_cast<size_t>(stack_top - stack_bottom);
+            size_t old_capacity = static_cast<size_t>(stack_limit - stack_bottom);
+            size_t new_capacity = old_capacity * 2;
+            while (new_capacity < amount + current_size) {
+                new_capacity *= 2;
+            }
+            size_t* new_stack = allocate_words(resource, new_capacity);
+            if (!new_stack) {
+                release();
+                stack_top = 0;
+                stack_bottom = 0;
+                stack_limit = 0;
+                return false;
+            }
+
+            memcpy(new_stack, stack_bottom, current_size * sizeof(size_t));
+            release();
+            stack_top = new_stack + current_size;
+            stack_bottom = new_stack;
+            stack_limit = stack_bottom + new_capacity;
+            return true;
+        }
+
+        void release() {
+            if (stack_bottom) {
+                deallocate_words(
+                    stack_bottom,
+                    static_cast<size_t>(stack_limit - stack_bottom),
+                    resource);
+            }
+        }
+
+        size_t* stack_top; // stack grows up: stack_top >= stack_bottom
+        size_t* stack_bottom;
+        size_t* stack_limit;
+        std::pmr::memory_resource* resource;
+
+        friend class pmr_allocation;
+    };
+
+    class allocator {
+    public:
+        allocator() = delete;
+        allocator(const allocator&) = delete;
+        void operator=(const allocator&) = delete;
+
+        explicit allocator(
+            std::pmr::memory_resource* resource_,
+            size_t* buffer_,
+            size_t current_capacity,
+            size_t initial_stack_capacity_)
+            : ast_buffer_bottom(buffer_)
+            , ast_buffer_top(buffer_ + current_capacity)
+            , ast_write_head(ast_buffer_top)
+            , initial_stack_capacity(initial_stack_capacity_)
+            , resource(resource_) {}
+
+        explicit allocator(std::nullptr_t)
+            : ast_buffer_bottom(0)
+            , ast_buffer_top(0)
+            , ast_write_head(0)
+            , initial_stack_capacity(0)
+            , resource(0) {}
+
+        allocator(allocator&& other)
+            : ast_buffer_bottom(other.ast_buffer_bottom)
+            , ast_buffer_top(other.ast_buffer_top)
+            , ast_write_head(other.ast_write_head)
+            , initial_stack_capacity(other.initial_stack_capacity)
+            , resource(other.resource) {
+            other.ast_buffer_bottom = 0;
+            other.ast_buffer_top = 0;
+            other.ast_write_head = 0;
+        }
+
+        ~allocator() {
+            if (ast_buffer_bottom) {
+                deallocate_words(
+                    ast_buffer_bottom,
+                    static_cast<size_t>(ast_buffer_top - ast_buffer_bottom),
+                    resource);
+            }
+        }
+
+        stack_head get_stack_head(bool* success) {
+            return stack_head(resource, initial_stack_capacity, success);
+        }
+
+        size_t get_write_offset() { return static_cast<size_t>(ast_buffer_top - ast_write_head); }
+
+        size_t* get_write_pointer_of(size_t v) { return ast_buffer_top - v; }
+
+        size_t* reserve(size_t size, bool* success) {
+            if (can_grow(size)) {
+                ast_write_head -= size;
+                *success = true;
+                return ast_write_head;
+            } else {
+                *success = false;
+                return 0;
+            }
+        }
+
+        size_t* get_ast_root() { return ast_write_head; }
+
+        internal::ownership transfer_ownership() {
+            auto p = ast_buffer_bottom;
+            auto capacity = static_cast<size_t>(ast_buffer_top - ast_buffer_bottom);
+            ast_buffer_bottom = 0;
+            ast_buffer_top = 0;
+            ast_write_head = 0;
+            return internal::ownership(p, capacity, &deallocate_words, resource);
+        }
+
+    private:
+        bool can_grow(size_t amount) {
+            if (SAJSON_LIKELY(
+                    amount <= static_cast<size_t>(
+                                  ast_write_head - ast_buffer_bottom))) {
+                return true;
+            }
+            size_t current_capacity = static_cast<size_t>(ast_buffer_top - ast_buffer_bottom);
+
+            size_t current_size = static_cast<size_t>(ast_buffer_top - ast_write_head);
+            size_t new_capacity = current_capacity * 2;
+            while (new_capacity < amount + current_size) {
+                new_capacity *= 2;
+            }
+
+            size_t* old_buffer = ast_buffer_bottom;
+            size_t* new_buffer = allocate_words(resource, new_capacity);
+            if (!new_buffer) {
+                deallocate_words(old_buffer, current_capacity, resource);
+                ast_buffer_bottom = 0;
+                ast_buffer_top = 0;
+                ast_write_head = 0;
+                return false;
+            }
+
+            size_t* old_write_head = ast_write_head;
+            ast_buffer_bottom = new_buffer;
+            ast_buffer_top = new_buffer + new_capacity;
+            ast_write_head = ast_buffer_top - current_size;
+            memcpy(
+                ast_write_head, old_write_head, current_size * sizeof(size_t));
+            deallocate_words(old_buffer, current_capacity, resource);
+
+            return true;
+        }
+
+        size_t*
+            ast_buffer_bottom; // base address of the ast buffer - it grows down
+        size_t* ast_buffer_top;
+        size_t* ast_write_head;
+        size_t initial_stack_capacity;
+        std::pmr::memory_resource* resource;
+    };
+
+    /// \endcond
+
+    /// Creates a pmr_allocation policy drawing from the given resource, with
+    /// the given initial AST and stack buffer sizes.
+    explicit pmr_allocation(
+        std::pmr::memory_resource* resource_ = std::pmr::get_default_resource(),
+        size_t initial_ast_capacity_ = 0,
+        size_t initial_stack_capacity_ = 0)
+        : resource(resource_)
+        , initial_ast_capacity(initial_ast_capacity_)
+        , initial_stack_capacity(initial_stack_capacity_) {}
+
+    /// \cond INTERNAL
+
+    allocator
+    make_allocator([[maybe_unused]] size_t input_document_size_in_bytes, bool* succeeded) const {
+        size_t capacity = initial_ast_capacity;
+        if (!capacity) {
+            capacity = 1024;
+        }
+
+        size_t* buffer = allocate_words(resource, capacity);
+        if (!buffer) {
+            *succeeded = false;
+            return allocator(nullptr);
+        }
+
+        size_t stack_capacity = initial_stack_capacity;
+        if (!stack_capacity) {
+            stack_capacity = 256;
+        }
+
+        *succeeded = true;
+        return allocator(resource, buffer, capacity, stack_capacity);
+    }
+
+    /// \endcond
+
+private:
+    static size_t*
+    allocate_words(std::pmr::memory_resource* resource, size_t size_in_words) {
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+        try {
+            return static_cast<size_t*>(resource->allocate(
+                size_in_words * sizeof(size_t), alignof(size_t)));
+        } catch (const std::bad_alloc&) {
+            return 0;
+        }
+#else
+        return static_cast<size_t*>(resource->allocate(
+            size_in_words * sizeof(size_t), alignof(size_t)));
+#endif
+    }
+
+    static void
+    deallocate_words(size_t* p, size_t size_in_words, void* resource) {
+        static_cast<std::pmr::memory_resource*>(resource)->deallocate(
+            p, size_in_words * sizeof(size_t), alignof(size_t));
+    }
+
+    std::pmr::memory_resource* resource;
+    size_t initial_ast_capacity;
+    size_t initial_stack_capacity;
+};
+#endif
+
+// I thought about putting parser in the internal namespace but I don't
+// want to indent it further...
+/// \cond INTERNAL
+namespace internal {
+
+/// Replays the parser's stack and AST bookkeeping over the input without
+/// writing anything, recording the peak number of words in use.  Scanning
+/// can start at the root or resume where a parse ran out of memory.
+class measurer {
+public:
+    /// Where run() picks up: at a value, at an object key, just past a
+    /// closing bracket of the innermost open structure, or just past a
+    /// value whose stack entry has not been pushed yet.
+    enum resume_mode { at_value, at_key, at_close, at_push_value };
+
+    measurer(const char* input_end_, size_t stack_words, size_t ast_words)
+        : input_end(input_end_)
+        , stack_size(stack_words)
+        , ast_size(ast_words)
+        , max_stack_size(stack_words)
+        , peak_size(stack_words + ast_words)
+        , levels(0)
+        , level_count(0)
+        , level_capacity(0) {}
+
+    ~measurer() { delete[] levels; }
+
+    measurer(const measurer&) = delete;
+    void operator=(const measurer&) = delete;
+
+    /// Records an open structure whose marker sits at stack offset \p base.
+    /// Structures must be opened outermost first, or innermost first
+    /// followed by reverse_levels().
+    bool open(size_t base, bool is_object) {
+        if (level_count == level_capacity) {
+            size_t new_capacity = std::max<size_t>(level_capacity * 2, 16);
+            size_t* new_levels = new (std::nothrow) size_t[new_capacity];
+            if (!new_levels) {
+                return false;
+            }
+            if (levels) {
+                memcpy(new_levels, levels, level_count * sizeof(size_t));
+            }
+            delete[] levels;
+            levels = new_levels;
+            level_capacity = new_capacity;
+        }
+        levels[level_count++] = (base << 1) | (is_object ? 1 : 0);
+        return true;
+    }
+
+    void reverse_levels() { std::reverse(levels, levels + level_count); }
+
+    /// Scans to the end of the document.  Returns false if the input is not
+    /// a well-formed document, in which case the sizes are meaningless.
+    bool run(const char* p, resume_mode mode) {
+        switch (mode) {
+        case at_value:
+            goto value;
+        case at_key:
+            goto key;
+        case at_close:
+            goto close;
+        case at_push_value:
+            goto push_value;
+        }
+        SAJSON_UNREACHABLE();
+
+    value:
+        p = skip_whitespace(p);
+        if (!p) {
+            return false;
+        }
+        switch (*p) {
+        case '[':
+        case '{': {
+            const bool is_object = *p == '{';
+            push(1);
+            if (!open(stack_size - 1, is_object)) {
+                return false;
+            }
+            p = skip_whitespace(p + 1);
+            if (!p) {
+                return false;
+            }
+            if (*p == (is_object ? '}' : ']')) {
+                ++p;
+                goto close;
+            }
+            if (is_object) {
+                goto key;
+            }
+            goto value;
+        }
+        case '"':
+            reserve(2);
+            p = skip_string(p);
+            break;
+        case 'n':
+            p = skip_literal(p, "null", 4);
+            break;
+        case 'f':
+            p = skip_literal(p, "false", 5);
+            break;
+        case 't':
+            p = skip_literal(p, "true", 4);
+            break;
+        default:
+            p = skip_number(p);
+            break;
+        }
+        if (!p) {
+            return false;
+        }
+
+    push_value:
+        push(1);
+        p = skip_whitespace(p);
+        if (!p || level_count == 0) {
+            return false;
+        }
+        if (*p == ',') {
+            ++p;
+            if (levels[level_count - 1] & 1) {
+                goto key;
+            }
+            goto value;
+        }
+        if (*p != ((levels[level_count - 1] & 1) ? '}' : ']')) {
+            return false;
+        }
+        ++p;
+
+    close : {
+        if (level_count == 0) {
+            return false;
+        }
+        const size_t base = levels[--level_count] >> 1;
+        const size_t length = stack_size - base - 1;
+        reserve(length + 1);
+        stack_size = base;
+        if (level_count == 0) {
+            return skip_whitespace(p) == 0;
+        }
+        goto push_value;
+    }
+
+    key:
+        p = skip_whitespace(p);
+        if (!p || *p != '"') {
+            return false;
+        }
+        push(2);
+        p = skip_string(p);
+        if (!p) {
+            return false;
+        }
+        p = skip_whitespace(p);
+        if (!p || *p != ':') {
+            return false;
+        }
+        ++p;
+        goto value;
+    }
+
+    size_t get_ast_size() const { return ast_size; }
+    size_t get_max_stack_size() const { return max_stack_size; }
+    size_t get_peak_size() const { return peak_size; }
+
+private:
+    void push(size_t words) {
+        stack_size += words;
+        max_stack_size = std::max(max_stack_size, stack_size);
+        peak_size = std::max(peak_size, stack_size + ast_size);
+    }
+
+    void reserve(size_t words) {
+        ast_size += words;
+        peak_size = std::max(peak_size, stack_size + ast_size);
+    }
+
+    const char* skip_whitespace(const char* p) const {
+        while (p != input_end) {
+            if (!is_whitespace(*p)) {
+                return p;
+            }
+            ++p;
+        }
+        return 0;
+    }
+
+    const char* skip_string(const char* p) const {
+        ++p; // "
+        for (;;) {
+            while (p != input_end && is_plain_string_character(*p)) {
+                ++p;
+            }
+            if (p == input_end) {
+                return 0;
+            }
+            if (*p == '"') {
+                return p + 1;
+            }
+            if (*p == '\\') {
+                if (++p == input_end) {
+                    return 0;
+                }
+            }
+            ++p;
+        }
+    }
+
+    const char* skip_literal(const char* p, const char* text, size_t length) const {
+        if (static_cast<size_t>(input_end - p) < length
+            || memcmp(p, text, length) != 0) {
+            return 0;
+        }
+        return p + length;
+    }
+
+    // Mirrors parser::parse_number's choice between integer and double
+    // storage, which decides how many AST words the number takes.
+    const char* skip_number(const char* p) {
+        static constexpr unsigned RISKY = std::numeric_limits<int>::max() / 10u;
+        unsigned max_digit_after_risky = std::numeric_limits<int>::max() % 10u;
+
+        if (*p == '-') {
+            ++p;
+            ++max_digit_after_risky;
+        }
+        if (p == input_end || *p < '0' || *p > '9') {
+            return 0;
+        }
+
+        bool is_double = false;
+        if (*p == '0') {
+            ++p;
+        } else {
+            unsigned u = 0;
+            do {
+                unsigned digit = static_cast<unsigned>(*p - '0');
+                if (!is_double
+                    && (u > RISKY
+                        || (u == RISKY && digit > max_digit_after_risky))) {
+                    is_double = true;
+                }
+                u = 10 * u + digit;
+                ++p;
+            } while (p != input_end && *p >= '0' && *p <= '9');
+        }
+
+        if (p != input_end && *p == '.') {
+            is_double = true;
+            ++p;
+            if (p == input_end || *p < '0' || *p > '9') {
+                return 0;
+            }
+            while (p != input_end && *p >= '0' && *p <= '9') {
+                ++p;
+            }
+        }
+
+        if (p != input_end && (*p == 'e' || *p == 'E')) {
+            is_double = true;
+            ++p;
+            if (p != input_end && (*p == '-' || *p == '+')) {
+                ++p;
+            }
+            if (p == input_end || *p < '0' || *p > '9') {
+                return 0;
+            }
+            while (p != input_end && *p >= '0' && *p <= '9') {
+                ++p;
+            }
+        }
+
+        if (p == input_end) {
+            return 0;
+        }
+        reserve(
+            is_double ? size_t(double_storage::word_length)
+                      : size_t(integer_storage::word_length));
+        return p;
+    }
+
+    const char* const input_end;
+    size_t stack_size;
+    size_t ast_size;
+    size_t max_stack_size;
+    size_t peak_size;
+    // (base << 1) | is_object for each open structure
+    size_t* levels;
+    size_t level_count;
+    size_t level_capacity;
+};
+
+/// Records the input bytes each array and object spans, for
+/// parse_with_source_ranges().  A structure is recorded when it closes,
+/// which is also when it is installed in the AST, so the records come out
+/// sorted by the structure's distance from the end of the AST.
+class source_range_recorder {
+public:
+    explicit source_range_recorder(bool enabled_)
+        : enabled(enabled_)
+        , levels(0)
+        , level_count(0)
+        , level_capacity(0)
+        , record_words(0)
+        , record_capacity(0) {}
+
+    ~source_range_recorder() { delete[] levels; }
+
+    source_range_recorder(const source_range_recorder&) = delete;
+    void operator=(const source_range_recorder&) = delete;
+
+    const bool enabled;
+
+    /// A structure starts at input offset \p begin.
+    bool open(size_t begin) {
+        if (level_count == level_capacity) {
+            size_t new_capacity = std::max<size_t>(level_capacity * 2, 16);
+            size_t* new_levels = new (std::nothrow) size_t[new_capacity];
+            if (!new_levels) {
+                return false;
+            }
+            if (levels) {
+                memcpy(new_levels, levels, level_count * sizeof(size_t));
+            }
+            delete[] levels;
+            levels = new_levels;
+            level_capacity = new_capacity;
+        }
+        levels[level_count++] = begin << 1;
+        return true;
+    }
+
+    /// A string in the innermost open structure was unescaped in place, so
+    /// its bytes no longer match the input.
+    void mark_modified() {
+        if (level_count) {
+            levels[level_count - 1] |= 1;
+        }
+    }
+
+    /// The innermost structure ends before input offset \p end and was
+    /// installed \p ast_offset words from the end of the AST.
+    bool close(size_t ast_offset, size_t end) {
+        const size_t level = levels[--level_count];
+        if (level_count) {
+            levels[level_count - 1] |= level & 1;
+        }
+        if (record_words + 3 > record_capacity) {
+            size_t new_capacity = std::max<size_t>(record_capacity * 2, 48);
+            allocated_buffer grown(
+                (new_capacity + 1) * sizeof(size_t), std::nothrow);
+            if (!grown.get_data()) {
+                return false;
+            }
+            if (record_words) {
+                memcpy(
+                    get_words(grown) + 1,
+                    get_words(records) + 1,
+                    record_words * sizeof(size_t));
+            }
+            records = std::move(grown);
+            record_capacity = new_capacity;
+        }
+        size_t* record = get_words(records) + 1 + record_words;
+        record[0] = ast_offset;
+        record[1] = level >> 1;
+        record[2] = (end << 1) | (level & 1);
+        record_words += 3;
+        return true;
+    }
+
+    /// Returns the records for \ref document: the record count, followed by
+    /// three words per record as written by close().
+    allocated_buffer take() {
+        if (record_words) {
+            get_words(records)[0] = record_words / 3;
+        }
+        return std::move(records);
+    }
+
+    static size_t* get_words(const allocated_buffer& buffer) {
+        return reinterpret_cast<size_t*>(buffer.get_data());
+    }
+
+private:
+    size_t* levels; // input offset << 1 | modified, per open structure
+    size_t level_count;
+    size_t level_capacity;
+    allocated_buffer records;
+    size_t record_words;
+    size_t record_capacity;
+};
+
+} // namespace internal
+/// \endcond
+
+/// \cond INTERNAL
+template <typename Allocator>
+class parser {
+public:
+    parser(
+        const mutable_string_view& msv,
+        Allocator&& allocator_,
+        bool read_only_ = false,
+        const internal::segment_list* segment_list = 0,
+        bool record_source_ranges = false)
+        : input(msv)
+        , input_end(input.get_data() + input.length())
+        , allocator(std::move(allocator_))
+        , read_only(read_only_)
+        , side_length(0)
+        , side_capacity(0)
+        , source_ranges(record_source_ranges)
+        , root_tag(internal::tag::null)
+        , error_offset(0)
+        , required_words(0) {
+        segments.list = segment_list;
+        segments.index = 0;
+        segments.start = 0;
+        segments.begin = input.get_data();
+        segments.stitch = 0;
+        segments.stitch_start = 0;
+        if (segment_list) {
+            // The input may be a view of the whole text; parse the first
+            // segment first.
+            input_end = segments.begin;
+            if (segment_list->count) {
+                load_segment(0);
+            }
+        }
     }
 
-    error_result make_error(char* p, error code, int arg = 0) {
-        if (!p) {
-            p = input_end;
+    document get_document() {
+        if (parse()) {
+            internal::allocated_buffer ranges = source_ranges.take();
+            internal::document_extras* extras = 0;
+            if (side_text.get_data() || ranges.get_data()) {
+                extras = new (std::nothrow) internal::document_extras;
+                if (!extras) {
+                    return document::_internal_make_error(
+                        ERROR_OUT_OF_MEMORY);
+                }
+                extras->bases = get_string_bases();
+                extras->side_text = std::move(side_text);
+                extras->source_ranges = std::move(ranges);
+            }
+            size_t* ast_root = allocator.get_ast_root();
+            size_t ast_size = allocator.get_write_offset();
+            return document(
+                input,
+                allocator.transfer_ownership(),
+                root_tag,
+                ast_root,
+                ast_size,
+                extras,
+                segments.list && read_only,
+                read_only);
+        } else {
+            return document(
+                segments.list ? error_context() : input,
+                error_offset,
+                error_code,
+                error_arg,
+                required_words);
+        }
+    }
+
+private:
+    struct error_result {
+        operator bool() const { return false; }
+        operator char*() const { return 0; }
+    };
+
+    bool at_eof(const char* p) { return p == input_end; }
+
+    // Moves to the next non-empty segment once p reaches the end of the
+    // current one.  Tokens are parsed within one segment, or within
+    // segments that lie back to back in memory; only whitespace and
+    // structural characters are consumed across other boundaries.
+    bool next_segment(char*& p) {
+        while (segments.index + 1 < segments.list->count) {
+            char* const next = load_segment(segments.index + 1);
+            if (next != input_end) {
+                p = next;
+                return true;
+            }
         }
+        return false;
+    }
 
-        error_line = 1;
-        error_column = 1;
+    // Moves on to the given segment and returns its first byte.  A segment
+    // that directly follows the current one in memory extends it instead,
+    // so tokens can be parsed across the boundary where they lie.
+    char* load_segment(size_t index) {
+        std::string_view s
+            = segments.list->get(segments.list->segments, index);
+        char* const data = const_cast<char*>(s.data());
+        segments.index = index;
+        if (data != input_end) {
+            segments.start += static_cast<size_t>(input_end - segments.begin);
+            segments.begin = data;
+        }
+        input_end = data + s.length();
+        return data;
+    }
 
-        char* c = input.get_data();
-        while (c < p) {
-            if (*c == '\r') {
-                if (c + 1 < p && c[1] == '\n') {
-                    ++error_line;
-                    error_column = 1;
-                    ++c;
+    bool next_segment_is_adjacent() const {
+        return segments.index + 1 < segments.list->count
+            && segments.list->get(segments.list->segments, segments.index + 1)
+                   .data()
+            == input_end;
+    }
+
+    // Unescaping in place cannot be restarted once it has shifted bytes,
+    // so before a string is decoded, the adjacent segments holding the
+    // rest of it are loaded.
+    void load_string_end(const char* p) {
+        while (next_segment_is_adjacent()) {
+            while (p < input_end) {
+                if (*p == '"') {
+                    return;
+                } else if (*p != '\\') {
+                    ++p;
+                } else if (input_end - p > 1) {
+                    p += 2;
                 } else {
-                    ++error_line;
-                    error_column = 1;
+                    break;
                 }
-            } else if (*c == '\n') {
-                ++error_line;
-                error_column = 1;
+            }
+            load_segment(segments.index + 1);
+        }
+    }
+
+    size_t segment_offset(const char* p) {
+        if (segments.stitch) {
+            return segments.stitch_start
+                + static_cast<size_t>(p - segments.stitch);
+        }
+        return segments.start + static_cast<size_t>(p - segments.begin);
+    }
+
+    // Parses the token at p with parse_token, which returns the position
+    // after it or 0.  A token that runs into the end of a segment is parsed
+    // again once the next segment is loaded, if that directly follows in
+    // memory.  Otherwise it is copied together with its continuation to the
+    // end of the side buffer and parsed again from there; nothing else is
+    // ever copied.
+    template <typename ParseToken>
+    char* parse_token(char* p, ParseToken&& parse_token_at) {
+        char* after = parse_token_at(p);
+        if (SAJSON_LIKELY(after) || !segments.list) {
+            return after;
+        }
+        for (;;) {
+            if (error_code != ERROR_UNEXPECTED_END
+                && error_code != ERROR_UNEXPECTED_END_OF_UTF16) {
+                return 0;
+            }
+            if (segments.index + 1 == segments.list->count) {
+                return 0;
+            }
+            if (!next_segment_is_adjacent()) {
+                return parse_straddling_token(p, parse_token_at);
+            }
+            load_segment(segments.index + 1);
+            after = parse_token_at(p);
+            if (after) {
+                return after;
+            }
+        }
+    }
+
+    template <typename ParseToken>
+    char* parse_straddling_token(char* token, ParseToken& parse_token_at) {
+        const size_t stitch_offset = side_length;
+        size_t stitch_length = 0;
+        const char first = *token;
+        bool escaped = false;
+        bool done = false;
+        bool out_of_memory = false;
+        // Returns whether c still belongs to the token.  Numbers keep the
+        // character after them so the parser sees where they end.
+        auto append = [&](char c) {
+            char* const out = reserve_side_text(1);
+            if (!out) {
+                out_of_memory = done = true;
+                return;
+            }
+            *out = c;
+            ++side_length;
+            ++stitch_length;
+            if (first == '"') {
+                if (stitch_length == 1) {
+                    return;
+                }
+                if (escaped) {
+                    escaped = false;
+                } else if (c == '\\') {
+                    escaped = true;
+                } else if (c == '"') {
+                    done = true;
+                }
+            } else if (first == '-' || (first >= '0' && first <= '9')) {
+                done = !((c >= '0' && c <= '9') || c == '-' || c == '+'
+                         || c == '.' || c == 'e' || c == 'E');
             } else {
-                // TODO: count UTF-8 characters
-                ++error_column;
+                done = stitch_length == 5;
             }
-            ++c;
+        };
+        for (char* c = token; c != input_end; ++c) {
+            append(*c);
+        }
+        const size_t token_start = segment_offset(token);
+        char* const segment_end = input_end;
+        for (size_t i = segments.index + 1;
+             !done && i < segments.list->count;
+             ++i) {
+            std::string_view s = segments.list->get(segments.list->segments, i);
+            for (size_t j = 0; !done && j < s.length(); ++j) {
+                append(s[j]);
+            }
+        }
+
+        // The side buffer must not move while the copy is parsed, so make
+        // room for a string decoded from it up front.
+        if (out_of_memory || !reserve_side_text(stitch_length + 1)) {
+            return oom(token, "stitch buffer");
+        }
+        char* const stitch = side_text.get_data() + stitch_offset;
+        segments.stitch = stitch;
+        segments.stitch_start = token_start;
+        input_end = stitch + stitch_length;
+        char* after = parse_token_at(stitch);
+        if (!after) {
+            return 0;
+        }
+        segments.stitch = 0;
+        if (first != '"') {
+            // Only a string may reference the copy.
+            side_length = stitch_offset;
+        }
+
+        // Resume in whichever segment holds the byte after the token.
+        input_end = segment_end;
+        const size_t resume = token_start + static_cast<size_t>(after - stitch);
+        while (resume - segments.start
+               > static_cast<size_t>(input_end - segments.begin)) {
+            load_segment(segments.index + 1);
+        }
+        return segments.begin + (resume - segments.start);
+    }
+
+    // Copies the segments up to the error so the document can report its
+    // line and column without referencing the caller's buffers.
+    mutable_string_view error_context() {
+        mutable_string_view context(error_offset);
+        size_t copied = 0;
+        for (size_t i = 0; copied < error_offset; ++i) {
+            std::string_view s = segments.list->get(segments.list->segments, i);
+            size_t n = std::min(s.length(), error_offset - copied);
+            memcpy(context.get_data() + copied, s.data(), n);
+            copied += n;
+        }
+        return context;
+    }
+
+    // Strings decoded from read-only input, and tokens straddling
+    // segments, are appended here.  Returns room for n more bytes past
+    // side_length, or 0 if memory runs out.  The buffer grows
+    // geometrically, so it stays proportional to what is written to it;
+    // strings in it are located by offset, so moving it is harmless.
+    char* reserve_side_text(size_t n) {
+        if (n > side_capacity - side_length) {
+            const size_t capacity
+                = std::max(side_length + n, 2 * side_capacity);
+            internal::allocated_buffer grown(capacity, std::nothrow);
+            if (!grown.get_data()) {
+                return 0;
+            }
+            if (side_length) {
+                memcpy(grown.get_data(), side_text.get_data(), side_length);
+            }
+            side_text = std::move(grown);
+            side_capacity = capacity;
+        }
+        return side_text.get_data() + side_length;
+    }
+
+    // Strings are located by offsets into the input text or the side
+    // buffer; see internal::string_bases.  Strings parsed from read-only
+    // segments are located by address, except stitched ones, which are in
+    // the side buffer.
+    size_t get_string_offset(const char* p) const {
+        if (SAJSON_UNLIKELY(segments.list)) {
+            if (segments.stitch) {
+                return get_side_offset(p);
+            }
+            if (read_only) {
+                return reinterpret_cast<uintptr_t>(p);
+            }
+        }
+        return static_cast<size_t>(p - input.get_data());
+    }
+
+    size_t get_side_offset(const char* p) const {
+        return internal::SIDE_TEXT_OFFSET
+            | static_cast<size_t>(p - side_text.get_data());
+    }
+
+    internal::string_bases get_string_bases() const {
+        return internal::string_bases{
+            segments.list && read_only ? 0 : input.get_data(),
+            side_text.get_data()
+        };
+    }
+
+    char* skip_whitespace(char* p) {
+        // There is an opportunity to make better use of superscalar
+        // hardware here* but if someone cares about JSON parsing
+        // performance the first thing they do is minify, so prefer
+        // to optimize for code size here.
+        // *
+        // https://github.com/chadaustin/Web-Benchmarks/blob/master/json/third-party/pjson/pjson.h#L1873
+        for (;;) {
+            if (SAJSON_UNLIKELY(p == input_end)) {
+                if (!segments.list || !next_segment(p)) {
+                    return 0;
+                }
+            } else if (internal::is_whitespace(*p)) {
+                ++p;
+            } else {
+                return p;
+            }
+        }
+    }
+
+    error_result oom(char* p, const char* /*reason*/) {
+        return make_error(p, ERROR_OUT_OF_MEMORY);
+    }
+
+    // After running out of memory, finishes the parse as a measurement so
+    // the document can report how large a buffer would have sufficed.  The
+    // parse stack is still intact and describes the open structures.
+    template <typename StackHead>
+    void measure_required(
+        StackHead& stack,
+        size_t current_base,
+        internal::tag current_structure_tag,
+        const char* resume,
+        internal::measurer::resume_mode mode) {
+        using namespace internal;
+
+        // The measurer scans contiguous text.
+        if (segments.list) {
+            return;
+        }
+
+        measurer m(input_end, stack.get_size(), allocator.get_write_offset());
+
+        // Each structure's marker names its parent's base and tag.
+        if (stack.get_size()) {
+            size_t base = current_base;
+            tag structure_tag = current_structure_tag;
+            for (;;) {
+                if (!m.open(base, structure_tag == tag::object)) {
+                    return;
+                }
+                size_t marker = *stack.get_pointer_from_offset(base);
+                base = get_element_value(marker);
+                if (base == ROOT_MARKER) {
+                    break;
+                }
+                structure_tag = get_element_tag(marker);
+            }
+            m.reverse_levels();
+        }
+
+        if (m.run(resume, mode)) {
+            required_words = m.get_peak_size();
+        }
+    }
+
+    error_result unexpected_end() {
+        return make_error(0, ERROR_UNEXPECTED_END);
+    }
+
+    error_result unexpected_end(char* p) {
+        return make_error(p, ERROR_UNEXPECTED_END);
+    }
+
+    error_result make_error(char* p, error code, int arg = 0) {
+        if (!p) {
+            p = input_end;
         }
 
+        // The document derives line and column from this if asked.
+        error_offset = segments.list
+            ? segment_offset(p)
+            : static_cast<size_t>(p - input.get_data());
         error_code = code;
         error_arg = arg;
         return error_result();
@@ -1893,11 +3925,21 @@ private:
         // structure (object or array)
         size_t current_base = stack.get_size();
         tag current_structure_tag;
+        if (SAJSON_UNLIKELY(source_ranges.enabled)
+            && !source_ranges.open(segment_offset(p))) {
+            return oom(p, "source ranges");
+        }
         if (*p == '[') {
             current_structure_tag = tag::array;
             bool s
                 = stack.push(make_element(current_structure_tag, ROOT_MARKER));
             if (SAJSON_UNLIKELY(!s)) {
+                measure_required(
+                    stack,
+                    current_base,
+                    current_structure_tag,
+                    p,
+                    measurer::at_value);
                 return oom(p, "stack.push array");
             }
             goto array_close_or_element;
@@ -1906,7 +3948,12 @@ private:
             bool s
                 = stack.push(make_element(current_structure_tag, ROOT_MARKER));
             if (SAJSON_UNLIKELY(!s)) {
-                printf("oom 3\n");
+                measure_required(
+                    stack,
+                    current_base,
+                    current_structure_tag,
+                    p,
+                    measurer::at_value);
                 return oom(p, "stack.push object");
             }
             goto object_close_or_element;
@@ -1984,8 +4031,19 @@ private:
             pop_element = *base_ptr;
             if (SAJSON_UNLIKELY(
                     !install_object(base_ptr + 1, stack.get_top()))) {
+                measure_required(
+                    stack,
+                    current_base,
+                    current_structure_tag,
+                    p,
+                    measurer::at_close);
                 return oom(p, "install_object");
             }
+            if (SAJSON_UNLIKELY(source_ranges.enabled)
+                && !source_ranges.close(
+                    allocator.get_write_offset(), segment_offset(p))) {
+                return oom(p, "source ranges");
+            }
             goto pop;
         }
 
@@ -1996,8 +4054,19 @@ private:
             pop_element = *base_ptr;
             if (SAJSON_UNLIKELY(
                     !install_array(base_ptr + 1, stack.get_top()))) {
+                measure_required(
+                    stack,
+                    current_base,
+                    current_structure_tag,
+                    p,
+                    measurer::at_close);
                 return oom(p, "install_array");
             }
+            if (SAJSON_UNLIKELY(source_ranges.enabled)
+                && !source_ranges.close(
+                    allocator.get_write_offset(), segment_offset(p))) {
+                return oom(p, "source ranges");
+            }
             goto pop;
         }
 
@@ -2013,9 +4082,15 @@ private:
             bool success_;
             size_t* out = stack.reserve(2, &success_);
             if (SAJSON_UNLIKELY(!success_)) {
+                measure_required(
+                    stack,
+                    current_base,
+                    current_structure_tag,
+                    p,
+                    measurer::at_key);
                 return oom(p, "reserve for object key");
             }
-            p = parse_string(p, out);
+            p = parse_token(p, [&](char* q) { return parse_string(q, out); });
             if (SAJSON_UNLIKELY(!p)) {
                 return false;
             }
@@ -2039,21 +4114,21 @@ private:
             case 0:
                 return unexpected_end(p);
             case 'n':
-                p = parse_null(p);
+                p = parse_token(p, [&](char* q) { return parse_null(q); });
                 if (!p) {
                     return false;
                 }
                 value_tag_result = tag::null;
                 break;
             case 'f':
-                p = parse_false(p);
+                p = parse_token(p, [&](char* q) { return parse_false(q); });
                 if (!p) {
                     return false;
                 }
                 value_tag_result = tag::false_;
                 break;
             case 't':
-                p = parse_true(p);
+                p = parse_token(p, [&](char* q) { return parse_true(q); });
                 if (!p) {
                     return false;
                 }
@@ -2070,11 +4145,23 @@ private:
             case '8':
             case '9':
             case '-': {
-                auto result = parse_number(p);
-                p = result.first;
-                if (!p) {
+                std::pair<char*, tag> result;
+                result.first = parse_token(p, [&](char* q) {
+                    result = parse_number(q);
+                    return result.first;
+                });
+                if (!result.first) {
+                    if (error_code == ERROR_OUT_OF_MEMORY) {
+                        measure_required(
+                            stack,
+                            current_base,
+                            current_structure_tag,
+                            p,
+                            measurer::at_value);
+                    }
                     return false;
                 }
+                p = result.first;
                 value_tag_result = result.second;
                 break;
             }
@@ -2082,9 +4169,16 @@ private:
                 bool success_;
                 size_t* string_tag = allocator.reserve(2, &success_);
                 if (SAJSON_UNLIKELY(!success_)) {
+                    measure_required(
+                        stack,
+                        current_base,
+                        current_structure_tag,
+                        p,
+                        measurer::at_value);
                     return oom(p, "reserve for string tag");
                 }
-                p = parse_string(p, string_tag);
+                p = parse_token(
+                    p, [&](char* q) { return parse_string(q, string_tag); });
                 if (!p) {
                     return false;
                 }
@@ -2098,8 +4192,18 @@ private:
                 bool s = stack.push(
                     make_element(current_structure_tag, previous_base));
                 if (SAJSON_UNLIKELY(!s)) {
+                    measure_required(
+                        stack,
+                        previous_base,
+                        current_structure_tag,
+                        p,
+                        measurer::at_value);
                     return oom(p, "stack.push array");
                 }
+                if (SAJSON_UNLIKELY(source_ranges.enabled)
+                    && !source_ranges.open(segment_offset(p))) {
+                    return oom(p, "source ranges");
+                }
                 current_structure_tag = tag::array;
                 goto array_close_or_element;
             }
@@ -2109,8 +4213,18 @@ private:
                 bool s = stack.push(
                     make_element(current_structure_tag, previous_base));
                 if (SAJSON_UNLIKELY(!s)) {
+                    measure_required(
+                        stack,
+                        previous_base,
+                        current_structure_tag,
+                        p,
+                        measurer::at_value);
                     return oom(p, "stack.push object");
                 }
+                if (SAJSON_UNLIKELY(source_ranges.enabled)
+                    && !source_ranges.open(segment_offset(p))) {
+                    return oom(p, "source ranges");
+                }
                 current_structure_tag = tag::object;
                 goto object_close_or_element;
             }
@@ -2140,6 +4254,12 @@ private:
             bool s = stack.push(
                 make_element(value_tag_result, allocator.get_write_offset()));
             if (SAJSON_UNLIKELY(!s)) {
+                measure_required(
+                    stack,
+                    current_base,
+                    current_structure_tag,
+                    p,
+                    measurer::at_push_value);
                 return oom(p, "stack.push value");
             }
 
@@ -2495,10 +4615,11 @@ private:
         const size_t length_times_3 = static_cast<size_t>(object_end - object_base);
         const size_t length = length_times_3 / 3;
         if (SAJSON_UNLIKELY(should_binary_search(length))) {
+            const internal::string_bases bases = get_string_bases();
             std::sort(
                 reinterpret_cast<object_key_record*>(object_base),
                 reinterpret_cast<object_key_record*>(object_end),
-                object_key_comparator(input.get_data()));
+                object_key_comparator(bases));
         }
 
         bool success;
@@ -2528,7 +4649,7 @@ private:
         using namespace internal;
 
         ++p; // "
-        size_t start = p - input.get_data();
+        char* const begin = p;
         char* input_end_local = input_end;
         while (input_end_local - p >= 4) {
             if (!is_plain_string_character(p[0])) {
@@ -2561,9 +4682,11 @@ private:
         }
     found:
         if (SAJSON_LIKELY(*p == '"')) {
-            tag[0] = start;
-            tag[1] = p - input.get_data();
-            *p = '\0';
+            tag[0] = get_string_offset(begin);
+            tag[1] = get_string_offset(p);
+            if (SAJSON_LIKELY(!read_only)) {
+                *p = '\0';
+            }
             return p + 1;
         }
 
@@ -2571,7 +4694,7 @@ private:
             return make_error(p, ERROR_ILLEGAL_CODEPOINT, static_cast<int>(*p));
         } else {
             // backslash or >0x7f
-            return parse_string_slow(p, tag, start);
+            return parse_string_slow(p, tag, begin);
         }
     }
 
@@ -2615,8 +4738,77 @@ private:
         }
     }
 
-    char* parse_string_slow(char* p, size_t* tag, size_t start) {
-        char* end = p;
+    char* parse_string_slow(char* p, size_t* tag, char* begin) {
+        const size_t start = get_string_offset(begin);
+        if (SAJSON_LIKELY(!read_only)) {
+            // Unescape in place, shifting the rest of the string down.
+            if (SAJSON_UNLIKELY(segments.list)) {
+                load_string_end(p);
+            }
+            char* end = p;
+            p = decode_string<true>(p, end);
+            if (!p) {
+                return 0;
+            }
+            if (SAJSON_UNLIKELY(source_ranges.enabled) && end != p - 1) {
+                // Escapes were decoded, so the string got shorter.
+                source_ranges.mark_modified();
+            }
+            tag[0] = start;
+            tag[1] = get_string_offset(end);
+            *end = '\0';
+            return p;
+        }
+
+        // Read-only input: a string without escapes is only validated and
+        // referenced in place.
+        char* q = p;
+        while (q < input_end && *q != '"' && *q != '\\') {
+            ++q;
+        }
+        if (q == input_end || *q == '"') {
+            char* unused = 0;
+            p = decode_string<false>(p, unused);
+            if (!p) {
+                return 0;
+            }
+            tag[0] = start;
+            tag[1] = get_string_offset(p - 1);
+            return p;
+        }
+
+        // Otherwise decode it into the side buffer.  Decoding never
+        // lengthens a string, so it needs at most the source's length.
+        while (q < input_end && *q != '"') {
+            if (*q == '\\' && input_end - q > 1) {
+                ++q;
+            }
+            ++q;
+        }
+        char* const out
+            = reserve_side_text(static_cast<size_t>(q - begin) + 1);
+        if (!out) {
+            return oom(p, "side buffer");
+        }
+        const size_t prefix = static_cast<size_t>(p - begin);
+        memcpy(out, begin, prefix);
+        char* end = out + prefix;
+        p = decode_string<true>(p, end);
+        if (!p) {
+            return 0;
+        }
+        *end = '\0';
+        side_length = static_cast<size_t>(end + 1 - side_text.get_data());
+        tag[0] = get_side_offset(out);
+        tag[1] = get_side_offset(end);
+        return p;
+    }
+
+    // Validates the rest of a string starting at p, which must not be
+    // plain, and returns the position after its closing quote.  If Copy,
+    // also writes the unescaped characters to end.
+    template <bool Copy>
+    char* decode_string(char* p, char*& end) {
         char* input_end_local = input_end;
 
         for (;;) {
@@ -2631,9 +4823,6 @@ private:
 
             switch (*p) {
             case '"':
-                tag[0] = start;
-                tag[1] = end - input.get_data();
-                *end = '\0';
                 return p + 1;
 
             case '\\':
@@ -2669,7 +4858,9 @@ private:
                     replacement = '\t';
                     goto replace;
                 replace:
-                    *end++ = replacement;
+                    if constexpr (Copy) {
+                        *end++ = replacement;
+                    }
                     ++p;
                     break;
                 case 'u': {
@@ -2706,7 +4897,9 @@ private:
                         }
                         u = 0x10000 + (((u - 0xD800) << 10) | (v - 0xDC00));
                     }
-                    write_utf8(u, end);
+                    if constexpr (Copy) {
+                        write_utf8(u, end);
+                    }
                     break;
                 }
                 default:
@@ -2718,7 +4911,10 @@ private:
                 // validate UTF-8
                 unsigned char c0 = static_cast<unsigned char>(p[0]);
                 if (c0 < 128) {
-                    *end++ = *p++;
+                    if constexpr (Copy) {
+                        *end++ = *p;
+                    }
+                    ++p;
                 } else if (c0 < 224) {
                     if (SAJSON_UNLIKELY(!has_remaining_characters(p, 2))) {
                         return unexpected_end(p);
@@ -2727,9 +4923,11 @@ private:
                     if (c1 < 128 || c1 >= 192) {
                         return make_error(p + 1, ERROR_INVALID_UTF8);
                     }
-                    end[0] = static_cast<char>(c0);
-                    end[1] = static_cast<char>(c1);
-                    end += 2;
+                    if constexpr (Copy) {
+                        end[0] = static_cast<char>(c0);
+                        end[1] = static_cast<char>(c1);
+                        end += 2;
+                    }
                     p += 2;
                 } else if (c0 < 240) {
                     if (SAJSON_UNLIKELY(!has_remaining_characters(p, 3))) {
@@ -2743,10 +4941,12 @@ private:
                     if (c2 < 128 || c2 >= 192) {
                         return make_error(p + 2, ERROR_INVALID_UTF8);
                     }
-                    end[0] = static_cast<char>(c0);
-                    end[1] = static_cast<char>(c1);
-                    end[2] = static_cast<char>(c2);
-                    end += 3;
+                    if constexpr (Copy) {
+                        end[0] = static_cast<char>(c0);
+                        end[1] = static_cast<char>(c1);
+                        end[2] = static_cast<char>(c2);
+                        end += 3;
+                    }
                     p += 3;
                 } else if (c0 < 248) {
                     if (SAJSON_UNLIKELY(!has_remaining_characters(p, 4))) {
@@ -2764,11 +4964,13 @@ private:
                     if (c3 < 128 || c3 >= 192) {
                         return make_error(p + 3, ERROR_INVALID_UTF8);
                     }
-                    end[0] = static_cast<char>(c0);
-                    end[1] = static_cast<char>(c1);
-                    end[2] = static_cast<char>(c2);
-                    end[3] = static_cast<char>(c3);
-                    end += 4;
+                    if constexpr (Copy) {
+                        end[0] = static_cast<char>(c0);
+                        end[1] = static_cast<char>(c1);
+                        end[2] = static_cast<char>(c2);
+                        end[3] = static_cast<char>(c3);
+                        end += 4;
+                    }
                     p += 4;
                 } else {
                     return make_error(p, ERROR_INVALID_UTF8);
@@ -2779,24 +4981,91 @@ private:
     }
 
     mutable_string_view input;
-    char* const input_end;
+    char* input_end; // of the current segment
     Allocator allocator;
+    const bool read_only;
+    internal::allocated_buffer side_text; // unescaped strings if read_only
+    size_t side_length;
+    size_t side_capacity;
+    internal::source_range_recorder source_ranges;
+
+    // Only used when parsing a segment_list.  Error offsets count bytes
+    // from the start of the first segment.
+    struct {
+        const internal::segment_list* list;
+        size_t index;
+        size_t start; // bytes in the segments before this one
+        char* begin;
+        char* stitch; // copy of the token being parsed, if straddling
+        size_t stitch_start;
+    } segments;
 
     internal::tag root_tag;
-    size_t error_line;
-    size_t error_column;
+    size_t error_offset;
     error error_code;
     int error_arg; // optional argument for the error
+    size_t required_words; // measured after running out of memory
 };
 /// \endcond
 
+/// The memory a document needs, as computed by \ref measure.  All sizes are
+/// in words.
+struct measurement {
+    /// False if the input is not a well-formed document; the sizes are then
+    /// meaningless.
+    bool valid;
+
+    /// The size of the finished AST.
+    size_t ast_words;
+
+    /// The deepest the parse stack gets.
+    size_t max_stack_words;
+
+    /// The most words the parse stack and the AST occupy at once: the
+    /// smallest buffer \ref bounded_allocation can parse the document into.
+    size_t bounded_words;
+};
+
+/**
+ * Computes exactly how much memory parsing the given JSON text will take,
+ * without parsing it or modifying it.  This is a fast scan that counts the
+ * parser's stack and AST operations, so a buffer for \ref bounded_allocation
+ * can be sized exactly instead of for the one-word-per-byte worst case.
+ *
+ * The scan only checks the document's structure.  It does not validate
+ * strings or escapes, so a valid measurement does not imply that the parse
+ * will succeed.
+ */
+inline measurement measure(std::string_view text) {
+    const char* p = text.data();
+    const char* const end = p + text.size();
+    while (p != end && internal::is_whitespace(*p)) {
+        ++p;
+    }
+
+    measurement result = { false, 0, 0, 0 };
+    if (p == end || (*p != '[' && *p != '{')) {
+        return result;
+    }
+
+    internal::measurer m(end, 0, 0);
+    if (m.run(p, internal::measurer::at_value)) {
+        result.valid = true;
+        result.ast_words = m.get_ast_size();
+        result.max_stack_words = m.get_max_stack_size();
+        result.bounded_words = m.get_peak_size();
+    }
+    return result;
+}
+
 /**
  * Parses a string of JSON bytes into a \ref document, given an allocation
  * strategy instance.  Any kind of string type is valid as long as a
  * mutable_string_view can be constructed from it.
  *
  * Valid allocation strategies are \ref single_allocation,
- * \ref dynamic_allocation, and \ref bounded_allocation.
+ * \ref dynamic_allocation, \ref bounded_allocation,
+ * \ref hybrid_allocation, and \ref pmr_allocation.
  *
  * A \ref document is returned whether or not the parse succeeds: success
  * state is available by calling document::is_valid().
@@ -2808,11 +5077,146 @@ document parse(const AllocationStrategy& strategy, const StringType& string) {
     bool success;
     auto allocator = strategy.make_allocator(input.length(), &success);
     if (!success) {
-        return document(input, 1, 1, ERROR_OUT_OF_MEMORY, 0);
+        return document(input, 0, ERROR_OUT_OF_MEMORY, 0);
     }
 
     return parser<typename AllocationStrategy::allocator>(
                input, std::move(allocator))
         .get_document();
 }
+
+/**
+ * Parses JSON text without writing to it, for input in read-only memory
+ * such as a PROT_READ file mapping or a shared network buffer.  Unlike
+ * parse() given a std::string_view, this does not copy the input: strings
+ * without escapes reference it directly, and only strings with escapes are
+ * decoded into a side buffer owned by the \ref document.  The input must
+ * stay valid for as long as the document is in use.
+ *
+ * Strings that reference the input are not NUL-terminated, so
+ * value::as_cstring() must not be used on the resulting document.
+ */
+template <typename AllocationStrategy>
+document
+parse_read_only(const AllocationStrategy& strategy, std::string_view text) {
+    // The parser never writes through this view in read-only mode.
+    mutable_string_view input(text.length(), const_cast<char*>(text.data()));
+
+    bool success;
+    auto allocator = strategy.make_allocator(input.length(), &success);
+    if (!success) {
+        return document(input, 0, ERROR_OUT_OF_MEMORY, 0);
+    }
+
+    return parser<typename AllocationStrategy::allocator>(
+               input, std::move(allocator), true)
+        .get_document();
+}
+
+/**
+ * Like parse(), but also records where each array and object appears in
+ * the input, for document::get_source_range().  A document that is
+ * forwarded mostly unchanged can then be written by copying its input
+ * bytes rather than reformatting it; see dump_passthrough() in
+ * sajson_dump.h.  Costs three words per array or object.
+ */
+template <typename AllocationStrategy, typename StringType>
+document parse_with_source_ranges(
+    const AllocationStrategy& strategy, const StringType& string) {
+    mutable_string_view input(string);
+
+    bool success;
+    auto allocator = strategy.make_allocator(input.length(), &success);
+    if (!success) {
+        return document::_internal_make_error(ERROR_OUT_OF_MEMORY);
+    }
+
+    return parser<typename AllocationStrategy::allocator>(
+               input, std::move(allocator), false, 0, true)
+        .get_document();
+}
+
+/**
+ * Like parse_read_only(), but also records where each array and object
+ * appears in the input, as parse_with_source_ranges() does.  Read-only
+ * input is never modified, so every range still holds the original text.
+ */
+template <typename AllocationStrategy>
+document parse_read_only_with_source_ranges(
+    const AllocationStrategy& strategy, std::string_view text) {
+    // The parser never writes through this view in read-only mode.
+    mutable_string_view input(text.length(), const_cast<char*>(text.data()));
+
+    bool success;
+    auto allocator = strategy.make_allocator(input.length(), &success);
+    if (!success) {
+        return document::_internal_make_error(ERROR_OUT_OF_MEMORY);
+    }
+
+    return parser<typename AllocationStrategy::allocator>(
+               input, std::move(allocator), true, 0, true)
+        .get_document();
+}
+
+/// \cond INTERNAL
+namespace internal {
+// If given, text is the whole input, which the document keeps and the
+// parser may write to: the segments must be consecutive pieces of it,
+// starting at its data, so strings are unescaped in place as by parse().
+// Otherwise the segments are parsed read-only.  list.total_length must
+// already be set.
+template <typename AllocationStrategy>
+document parse_segment_list(
+    const AllocationStrategy& strategy,
+    const segment_list& list,
+    const mutable_string_view* text = 0) {
+    bool success;
+    auto allocator = strategy.make_allocator(list.total_length, &success);
+    if (!success) {
+        return document::_internal_make_error(ERROR_OUT_OF_MEMORY);
+    }
+
+    // Strings are addressed relative to the first segment.
+    std::string_view first
+        = list.count ? list.get(list.segments, 0) : std::string_view();
+    mutable_string_view input = text
+        ? *text
+        : mutable_string_view(first.length(), const_cast<char*>(first.data()));
+    return parser<typename AllocationStrategy::allocator>(
+               input, std::move(allocator), !text, &list)
+        .get_document();
+}
+
+inline std::string_view get_string_view_segment(const void* segments, size_t i) {
+    return static_cast<const std::string_view*>(segments)[i];
+}
+} // namespace internal
+/// \endcond
+
+/**
+ * Parses one JSON text that arrived in several buffers, such as the chunks
+ * of a request body, without concatenating them first.  Like
+ * parse_read_only(), the buffers are never written: strings reference them
+ * in place, and only a token that straddles two buffers is copied, along
+ * with strings that need unescaping, into a side buffer owned by the
+ * \ref document.  The buffers must stay valid for as long as the document
+ * is in use, and value::as_cstring() must not be used on it.
+ *
+ * Error offsets, lines, and columns count from the start of the first
+ * buffer as if the buffers were concatenated.
+ */
+template <typename AllocationStrategy>
+document parse_segments(
+    const AllocationStrategy& strategy,
+    const std::string_view* segments,
+    size_t count) {
+    size_t total_length = 0;
+    for (size_t i = 0; i < count; ++i) {
+        total_length += segments[i].length();
+    }
+    internal::segment_list list = {
+        segments, count, &internal::get_string_view_segment, total_length
+    };
+    return internal::parse_segment_list(strategy, list);
+}
 } // namespace sajson
@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2012-2017 Chad Austin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "sajson_dump.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace sajson {
+
+namespace internal {
+
+/// Appends a one-byte tag followed by the low 'bytes' bytes of n,
+/// big-endian, as both formats want.
+template <typename O>
+void dump_tagged(O& o, unsigned char tag, uint64_t n, size_t bytes) {
+    char buffer[9];
+    buffer[0] = static_cast<char>(tag);
+    for (size_t i = 0; i < bytes; ++i) {
+        buffer[bytes - i] = static_cast<char>(n & 0xff);
+        n >>= 8;
+    }
+    o += std::string_view(buffer, bytes + 1);
+}
+
+/// Returns true if d survives a round trip through float.  NaN does not,
+/// so it is written at full width like any other double that does not fit.
+inline bool fits_float(double d, float* f) {
+    *f = static_cast<float>(d);
+    return static_cast<double>(*f) == d;
+}
+
+inline uint32_t float_bits(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+inline uint64_t double_bits(double d) {
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return bits;
+}
+
+/// Converts a float to IEEE 754 half precision if that loses nothing.
+inline bool fits_half(float f, uint16_t* half) {
+    const uint32_t bits = float_bits(f);
+    const uint32_t sign = (bits >> 16) & 0x8000;
+    const int exponent = static_cast<int>((bits >> 23) & 0xff) - 127;
+    const uint32_t mantissa = bits & 0x7fffff;
+
+    if (exponent == 128) {
+        // Infinity; NaN never gets here.
+        *half = static_cast<uint16_t>(sign | 0x7c00);
+        return true;
+    }
+    if (exponent == -127) {
+        // Zero.  Float subnormals are far below the smallest half.
+        *half = static_cast<uint16_t>(sign);
+        return mantissa == 0;
+    }
+    if (exponent >= -14 && exponent <= 15) {
+        *half = static_cast<uint16_t>(
+            sign | static_cast<uint32_t>(exponent + 15) << 10
+            | mantissa >> 13);
+        return (mantissa & 0x1fff) == 0;
+    }
+    if (exponent >= -24 && exponent < -14) {
+        // A half subnormal: the full significand, shifted down.
+        const uint32_t significand = mantissa | 0x800000;
+        const int shift = -1 - exponent;
+        *half = static_cast<uint16_t>(sign | significand >> shift);
+        return (significand & ((1u << shift) - 1)) == 0;
+    }
+    return false;
+}
+
+template <typename O>
+void dump_msgpack_length(
+    O& o,
+    size_t length,
+    unsigned char fix_tag,
+    size_t fix_limit,
+    unsigned char tag8,
+    unsigned char tag16) {
+    if (length <= fix_limit) {
+        o += static_cast<char>(fix_tag | length);
+    } else if (tag8 && length <= 0xff) {
+        dump_tagged(o, tag8, length, 1);
+    } else if (length <= 0xffff) {
+        dump_tagged(o, tag16, length, 2);
+    } else {
+        // The 32-bit tag always follows the 16-bit one.
+        dump_tagged(o, static_cast<unsigned char>(tag16 + 1), length, 4);
+    }
+}
+
+template <typename O>
+void dump_msgpack_integer(O& o, int i) {
+    if (i >= -32 && i <= 127) {
+        // positive and negative fixint
+        o += static_cast<char>(i);
+    } else if (i > 0) {
+        const uint64_t n = static_cast<uint64_t>(i);
+        if (n <= 0xff) {
+            dump_tagged(o, 0xcc, n, 1);
+        } else if (n <= 0xffff) {
+            dump_tagged(o, 0xcd, n, 2);
+        } else {
+            dump_tagged(o, 0xce, n, 4);
+        }
+    } else {
+        const uint64_t n = static_cast<uint64_t>(static_cast<int64_t>(i));
+        if (i >= -128) {
+            dump_tagged(o, 0xd0, n, 1);
+        } else if (i >= -32768) {
+            dump_tagged(o, 0xd1, n, 2);
+        } else {
+            dump_tagged(o, 0xd2, n, 4);
+        }
+    }
+}
+
+template <typename O>
+void dump_msgpack_string(O& o, std::string_view s) {
+    dump_msgpack_length(o, s.size(), 0xa0, 31, 0xd9, 0xda);
+    dump_reference(o, s);
+}
+
+template <typename O>
+void dump_cbor_head(O& o, unsigned char major, uint64_t n) {
+    const unsigned char type = static_cast<unsigned char>(major << 5);
+    if (n < 24) {
+        o += static_cast<char>(type | n);
+    } else if (n <= 0xff) {
+        dump_tagged(o, type | 24, n, 1);
+    } else if (n <= 0xffff) {
+        dump_tagged(o, type | 25, n, 2);
+    } else if (n <= 0xffffffff) {
+        dump_tagged(o, type | 26, n, 4);
+    } else {
+        dump_tagged(o, type | 27, n, 8);
+    }
+}
+
+template <typename O>
+void dump_cbor_string(O& o, std::string_view s) {
+    dump_cbor_head(o, 3, s.size());
+    dump_reference(o, s);
+}
+
+} // namespace internal
+
+/**
+ * Writes a sajson::value to 'o' as MessagePack.  Integers take the
+ * smallest fixint, int, or uint encoding that holds them, and doubles
+ * are written as float 32 when that loses nothing, otherwise as float 64.
+ * Strings and keys are copied from the document as they are (with
+ * reference semantics on outputs such as FdOut), so the document must
+ * outlive the output, as for dump().
+ */
+template <typename O>
+void dump_msgpack(O& o, const value& v) {
+    switch (v.get_type()) {
+    case TYPE_INTEGER:
+        internal::dump_msgpack_integer(o, v.get_integer_value());
+        break;
+    case TYPE_DOUBLE: {
+        const double d = v.get_double_value();
+        float f;
+        if (internal::fits_float(d, &f)) {
+            internal::dump_tagged(o, 0xca, internal::float_bits(f), 4);
+        } else {
+            internal::dump_tagged(o, 0xcb, internal::double_bits(d), 8);
+        }
+        break;
+    }
+    case TYPE_NULL:
+        o += static_cast<char>(0xc0);
+        break;
+    case TYPE_FALSE:
+        o += static_cast<char>(0xc2);
+        break;
+    case TYPE_TRUE:
+        o += static_cast<char>(0xc3);
+        break;
+    case TYPE_STRING:
+        internal::dump_msgpack_string(o, v.as_string());
+        break;
+    case TYPE_ARRAY: {
+        const size_t length = v.get_length();
+        internal::dump_msgpack_length(o, length, 0x90, 15, 0, 0xdc);
+        for (size_t i = 0; i < length; ++i) {
+            dump_msgpack(o, v.get_array_element(i));
+        }
+        break;
+    }
+    case TYPE_OBJECT: {
+        const size_t length = v.get_length();
+        internal::dump_msgpack_length(o, length, 0x80, 15, 0, 0xde);
+        for (size_t i = 0; i < length; ++i) {
+            internal::dump_msgpack_string(o, v.get_object_key(i));
+            dump_msgpack(o, v.get_object_value(i));
+        }
+        break;
+    }
+    }
+}
+
+/**
+ * Writes a sajson::value to 'o' as CBOR (RFC 8949) in its preferred
+ * serialization: integers and lengths use the shortest head, and doubles
+ * the shortest of half, single, and double precision that holds them
+ * exactly.  Arrays and objects have definite lengths.  Strings and keys
+ * are copied from the document as they are, as in dump_msgpack().
+ */
+template <typename O>
+void dump_cbor(O& o, const value& v) {
+    switch (v.get_type()) {
+    case TYPE_INTEGER: {
+        const int64_t i = v.get_integer_value();
+        if (i >= 0) {
+            internal::dump_cbor_head(o, 0, static_cast<uint64_t>(i));
+        } else {
+            internal::dump_cbor_head(o, 1, static_cast<uint64_t>(-1 - i));
+        }
+        break;
+    }
+    case TYPE_DOUBLE: {
+        const double d = v.get_double_value();
+        float f;
+        uint16_t half;
+        if (std::isnan(d)) {
+            internal::dump_tagged(o, 0xf9, 0x7e00, 2);
+        } else if (!internal::fits_float(d, &f)) {
+            internal::dump_tagged(o, 0xfb, internal::double_bits(d), 8);
+        } else if (internal::fits_half(f, &half)) {
+            internal::dump_tagged(o, 0xf9, half, 2);
+        } else {
+            internal::dump_tagged(o, 0xfa, internal::float_bits(f), 4);
+        }
+        break;
+    }
+    case TYPE_NULL:
+        o += static_cast<char>(0xf6);
+        break;
+    case TYPE_FALSE:
+        o += static_cast<char>(0xf4);
+        break;
+    case TYPE_TRUE:
+        o += static_cast<char>(0xf5);
+        break;
+    case TYPE_STRING:
+        internal::dump_cbor_string(o, v.as_string());
+        break;
+    case TYPE_ARRAY: {
+        const size_t length = v.get_length();
+        internal::dump_cbor_head(o, 4, length);
+        for (size_t i = 0; i < length; ++i) {
+            dump_cbor(o, v.get_array_element(i));
+        }
+        break;
+    }
+    case TYPE_OBJECT: {
+        const size_t length = v.get_length();
+        internal::dump_cbor_head(o, 5, length);
+        for (size_t i = 0; i < length; ++i) {
+            internal::dump_cbor_string(o, v.get_object_key(i));
+            dump_cbor(o, v.get_object_value(i));
+        }
+        break;
+    }
+    }
+}
+
+/// Serializes a sajson::value to a string of MessagePack bytes.
+inline std::string to_msgpack(const value& v) {
+    std::string out;
+    out.reserve(65536);
+    dump_msgpack(out, v);
+    return out;
+}
+
+/// Serializes a sajson::value to a string of CBOR bytes.
+inline std::string to_cbor(const value& v) {
+    std::string out;
+    out.reserve(65536);
+    dump_cbor(out, v);
+    return out;
+}
+
+} // namespace sajson
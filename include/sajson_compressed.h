@@ -0,0 +1,538 @@
+/*
+ * Copyright (c) 2012-2017 Chad Austin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "sajson_mmap.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdlib.h>
+#include <thread>
+
+// gzip and xz support is enabled when zlib and liblzma are available.
+// Define SAJSON_HAVE_ZLIB or SAJSON_HAVE_LZMA to 0 to disable either, for
+// example when not linking the library.
+#ifndef SAJSON_HAVE_ZLIB
+#if __has_include(<zlib.h>)
+#define SAJSON_HAVE_ZLIB 1
+#else
+#define SAJSON_HAVE_ZLIB 0
+#endif
+#endif
+
+#ifndef SAJSON_HAVE_LZMA
+#if __has_include(<lzma.h>)
+#define SAJSON_HAVE_LZMA 1
+#else
+#define SAJSON_HAVE_LZMA 0
+#endif
+#endif
+
+#if SAJSON_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#if SAJSON_HAVE_LZMA
+#include <lzma.h>
+#endif
+
+namespace sajson {
+
+namespace internal {
+
+enum compression { compression_none, compression_gzip, compression_xz };
+
+inline compression detect_compression(const char* data, size_t length) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    if (length >= 2 && p[0] == 0x1f && p[1] == 0x8b) {
+        return compression_gzip;
+    }
+    if (length >= 6 && memcmp(p, "\xfd" "7zXZ\0", 6) == 0) {
+        return compression_xz;
+    }
+    return compression_none;
+}
+
+/// Returns the decompressed size the container claims, or 0 if it does
+/// not say.
+inline size_t get_claimed_length(
+    compression kind, const char* data, size_t length) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    if (kind == compression_gzip && length >= 18) {
+        // ISIZE is the trailer's last four bytes, little-endian.
+        p += length - 4;
+        return size_t(p[0]) | size_t(p[1]) << 8 | size_t(p[2]) << 16
+            | size_t(p[3]) << 24;
+    }
+#if SAJSON_HAVE_LZMA
+    if (kind == compression_xz) {
+        // The stream footer locates the index, which sums the block sizes.
+        while (length >= 4 && memcmp(p + length - 4, "\0\0\0\0", 4) == 0) {
+            length -= 4; // stream padding
+        }
+        if (length < 2 * LZMA_STREAM_HEADER_SIZE) {
+            return 0;
+        }
+        const uint8_t* footer = p + length - LZMA_STREAM_HEADER_SIZE;
+        lzma_stream_flags flags;
+        if (lzma_stream_footer_decode(&flags, footer) != LZMA_OK
+            || flags.backward_size > length - 2 * LZMA_STREAM_HEADER_SIZE) {
+            return 0;
+        }
+        lzma_index* index = 0;
+        uint64_t memory_limit = UINT64_MAX;
+        size_t position = 0;
+        if (lzma_index_buffer_decode(
+                &index,
+                &memory_limit,
+                0,
+                footer - flags.backward_size,
+                &position,
+                static_cast<size_t>(flags.backward_size))
+            != LZMA_OK) {
+            return 0;
+        }
+        const uint64_t size = lzma_index_uncompressed_size(index);
+        lzma_index_end(index, 0);
+        return size <= SIZE_MAX ? static_cast<size_t>(size) : 0;
+    }
+#endif
+    return 0;
+}
+
+/// Returns the decompressed size recorded in the container, or 0 if it is
+/// unknown.  gzip records it modulo 2^32 and xz per stream, so it is only
+/// a prediction for concatenated streams and very large files.  The file
+/// may also simply lie, so sizes beyond what the format can reach from
+/// 'length' compressed bytes are reported as unknown.
+inline size_t get_recorded_length(
+    compression kind, const char* data, size_t length) {
+    // deflate expands at most 1032:1.  xz has no such limit, but no real
+    // text compresses much beyond this.
+    const size_t max_ratio = kind == compression_gzip ? 1032 : 8192;
+    const size_t size = get_claimed_length(kind, data, length);
+    return size / max_ratio <= length ? size : 0;
+}
+
+/// Incremental gzip or xz decoder over an input held entirely in memory.
+class decoder {
+public:
+    decoder(compression kind_, const char* input, size_t length)
+        : kind(kind_)
+        , next_in(reinterpret_cast<const unsigned char*>(input))
+        , remaining_in(length)
+        , valid(false) {
+#if SAJSON_HAVE_ZLIB
+        if (kind == compression_gzip) {
+            memset(&z, 0, sizeof(z));
+            // 32 enables gzip header detection.
+            valid = inflateInit2(&z, 15 + 32) == Z_OK;
+        }
+#endif
+#if SAJSON_HAVE_LZMA
+        if (kind == compression_xz) {
+            lzma_stream init = LZMA_STREAM_INIT;
+            x = init;
+            valid = lzma_stream_decoder(&x, UINT64_MAX, LZMA_CONCATENATED)
+                == LZMA_OK;
+        }
+#endif
+    }
+
+    ~decoder() {
+#if SAJSON_HAVE_ZLIB
+        if (valid && kind == compression_gzip) {
+            inflateEnd(&z);
+        }
+#endif
+#if SAJSON_HAVE_LZMA
+        if (valid && kind == compression_xz) {
+            lzma_end(&x);
+        }
+#endif
+    }
+
+    /// Writes up to capacity decompressed bytes to out and adds their count
+    /// to *written.  Sets *finished at the end of the input.  Returns false
+    /// if the input is corrupt or the format is not supported.
+    bool decode(char* out, size_t capacity, size_t* written, bool* finished) {
+        *finished = false;
+        if (!valid) {
+            return false;
+        }
+#if SAJSON_HAVE_ZLIB
+        if (kind == compression_gzip) {
+            // zlib counts in 32-bit units.
+            const size_t limit = 1u << 30;
+            while (capacity) {
+                const size_t in = std::min(remaining_in, limit);
+                const size_t avail = std::min(capacity, limit);
+                z.next_in = const_cast<unsigned char*>(next_in);
+                z.avail_in = static_cast<uInt>(in);
+                z.next_out = reinterpret_cast<unsigned char*>(out);
+                z.avail_out = static_cast<uInt>(avail);
+                const int rv = inflate(&z, Z_NO_FLUSH);
+                const size_t consumed = in - z.avail_in;
+                const size_t produced = avail - z.avail_out;
+                next_in += consumed;
+                remaining_in -= consumed;
+                out += produced;
+                capacity -= produced;
+                *written += produced;
+                if (rv == Z_STREAM_END) {
+                    if (remaining_in == 0) {
+                        *finished = true;
+                        return true;
+                    }
+                    // Another gzip member follows.
+                    if (inflateReset(&z) != Z_OK) {
+                        return false;
+                    }
+                } else if (rv != Z_OK) {
+                    // Including Z_BUF_ERROR: the input is truncated.
+                    return false;
+                }
+            }
+            return true;
+        }
+#endif
+#if SAJSON_HAVE_LZMA
+        if (kind == compression_xz) {
+            x.next_in = next_in;
+            x.avail_in = remaining_in;
+            x.next_out = reinterpret_cast<uint8_t*>(out);
+            x.avail_out = capacity;
+            const lzma_ret rv = lzma_code(&x, LZMA_FINISH);
+            next_in = x.next_in;
+            remaining_in = x.avail_in;
+            *written += capacity - x.avail_out;
+            if (rv == LZMA_STREAM_END) {
+                *finished = true;
+                return true;
+            }
+            return rv == LZMA_OK;
+        }
+#endif
+        (void)out;
+        (void)capacity;
+        (void)written;
+        return false;
+    }
+
+private:
+    decoder(const decoder&) = delete;
+    void operator=(const decoder&) = delete;
+
+    const compression kind;
+    const unsigned char* next_in;
+    size_t remaining_in;
+    bool valid;
+#if SAJSON_HAVE_ZLIB
+    z_stream z;
+#endif
+#if SAJSON_HAVE_LZMA
+    lzma_stream x;
+#endif
+};
+
+/// Decompresses into a buffer of the recorded length on a background
+/// thread and hands out fixed-size blocks of it as they complete, so the
+/// parser can work on one block while the next is being decompressed.
+/// Both decoders keep their own history window rather than reading back
+/// earlier output, so blocks already handed out may be written to.
+class decompression_pipeline {
+public:
+    static constexpr size_t BLOCK_SIZE = 1 << 20;
+
+    enum outcome { complete, corrupt, length_mismatch, cancelled };
+
+    decompression_pipeline(
+        compression kind,
+        const char* input,
+        size_t input_length,
+        char* output_,
+        size_t output_length_)
+        : output(output_)
+        , output_length(output_length_)
+        , produced(0)
+        , done(false)
+        , stop(false)
+        , result(complete)
+        , source(kind, input, input_length)
+        , thread(&decompression_pipeline::run, this) {}
+
+    ~decompression_pipeline() { finish(); }
+
+    size_t get_block_count() const {
+        return (output_length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+
+    /// Waits until block i is decompressed.  Returns a short or empty block
+    /// if the decompressed text ended early.
+    std::string_view get_block(size_t i) const {
+        const size_t begin = i * BLOCK_SIZE;
+        const size_t end = std::min(begin + BLOCK_SIZE, output_length);
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [&] { return produced >= end || done; });
+        const size_t available = std::min(produced, end);
+        return std::string_view(
+            output + begin, available > begin ? available - begin : 0);
+    }
+
+    /// Asks the decompression thread to stop after the block it is working
+    /// on, for when the parser no longer needs the rest.  finish() then
+    /// reports cancelled unless the outcome was already known.
+    void cancel() { stop.store(true, std::memory_order_relaxed); }
+
+    /// Waits for the decompression thread to exit.
+    outcome finish() {
+        if (thread.joinable()) {
+            thread.join();
+        }
+        return result;
+    }
+
+private:
+    decompression_pipeline(const decompression_pipeline&) = delete;
+    void operator=(const decompression_pipeline&) = delete;
+
+    void run() {
+        size_t written = 0;
+        bool finished = false;
+        while (!finished && written < output_length) {
+            if (stop.load(std::memory_order_relaxed)) {
+                result = cancelled;
+                break;
+            }
+            const size_t block = std::min(BLOCK_SIZE, output_length - written);
+            if (!source.decode(output + written, block, &written, &finished)) {
+                result = corrupt;
+                break;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            produced = written;
+            ready.notify_one();
+        }
+        if (result == complete && !finished) {
+            // The buffer is full; the stream must end without more output.
+            char extra;
+            size_t more = 0;
+            if (!source.decode(&extra, 1, &more, &finished)) {
+                result = corrupt;
+            } else if (more) {
+                result = length_mismatch;
+            }
+        }
+        if (result == complete && written != output_length) {
+            result = length_mismatch;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        ready.notify_one();
+    }
+
+    char* const output;
+    const size_t output_length;
+
+    mutable std::mutex mutex;
+    mutable std::condition_variable ready;
+    size_t produced;
+    bool done;
+    std::atomic<bool> stop;
+    outcome result;
+
+    decoder source;
+    std::thread thread;
+};
+
+inline std::string_view get_pipeline_block(const void* segments, size_t i) {
+    return static_cast<const decompression_pipeline*>(segments)->get_block(i);
+}
+
+inline void free_text(char* data, size_t /*length*/) { free(data); }
+
+inline error decompress(
+    compression kind,
+    const char* input,
+    size_t length,
+    size_t expected_length,
+    mutable_string_view* text) {
+    decoder source(kind, input, length);
+    size_t capacity = std::max<size_t>(
+        expected_length ? expected_length : 4 * length, 4096);
+    char* data = static_cast<char*>(malloc(capacity));
+    size_t written = 0;
+    bool finished = false;
+    while (data) {
+        if (!source.decode(
+                data + written, capacity - written, &written, &finished)) {
+            free(data);
+            return ERROR_INVALID_COMPRESSED_DATA;
+        }
+        if (finished) {
+            break;
+        }
+        if (written == capacity) {
+            capacity *= 2;
+            char* grown = static_cast<char*>(realloc(data, capacity));
+            if (!grown) {
+                free(data);
+            }
+            data = grown;
+        }
+    }
+    if (!data) {
+        return ERROR_OUT_OF_MEMORY;
+    }
+    *text = mutable_string_view(written, data, &free_text);
+    return ERROR_NO_ERROR;
+}
+
+} // namespace internal
+
+/**
+ * Reads the gzip or xz compressed file at \p path into \p text.  Files that
+ * are not compressed are read as they are.  Returns ERROR_NO_ERROR on
+ * success, ERROR_CANNOT_READ_FILE (with errno set) if the file cannot be
+ * read, or ERROR_INVALID_COMPRESSED_DATA if it cannot be decompressed.
+ */
+inline error read_compressed_file(const char* path, mutable_string_view* text) {
+    char* data;
+    size_t length;
+    if (!internal::map_file(path, PROT_READ, &data, &length)) {
+        return ERROR_CANNOT_READ_FILE;
+    }
+    if (length == 0) {
+        *text = mutable_string_view();
+        return ERROR_NO_ERROR;
+    }
+    const internal::compression kind
+        = internal::detect_compression(data, length);
+    error rv;
+    if (kind == internal::compression_none) {
+        *text = mutable_string_view(std::string_view(data, length));
+        rv = ERROR_NO_ERROR;
+    } else {
+        rv = internal::decompress(
+            kind,
+            data,
+            length,
+            internal::get_recorded_length(kind, data, length),
+            text);
+    }
+    internal::unmap_text(data, length);
+    return rv;
+}
+
+/**
+ * Parses a gzip or xz compressed JSON file, overlapping decompression with
+ * parsing: one thread decompresses into the document's text buffer while
+ * the calling thread parses the blocks already finished, as if by
+ * parse_segments().  As with parse(), the buffer is the document's own, so
+ * strings are unescaped in place rather than copied to a side buffer.
+ * Files that are not compressed are handed to parse_file().
+ *
+ * The pipeline needs the decompressed length that gzip and xz record in
+ * the file.  If the output does not match it, as with concatenated gzip
+ * members or inputs of 4 GiB or more, the file is decompressed a second
+ * time, in full, and then parsed.  The recorded length is not trusted:
+ * one larger than the compressed size could produce is ignored, and the
+ * buffer for it is allocated without throwing, reporting
+ * ERROR_OUT_OF_MEMORY on failure.  Corrupt input is reported as
+ * ERROR_INVALID_COMPRESSED_DATA.  A parse error stops decompression at
+ * the next block and is reported as it is, even if the rest of the file
+ * would not have decompressed.
+ *
+ * gzip requires zlib and xz requires liblzma, as well as linking with the
+ * thread library.
+ */
+template <typename AllocationStrategy>
+document
+parse_compressed_file(const AllocationStrategy& strategy, const char* path) {
+    char* data;
+    size_t length;
+    if (!internal::map_file(path, PROT_READ, &data, &length)) {
+        return document::_internal_make_error(ERROR_CANNOT_READ_FILE);
+    }
+    const internal::compression kind
+        = internal::detect_compression(data, length);
+    if (kind == internal::compression_none) {
+        if (length) {
+            internal::unmap_text(data, length);
+        }
+        return parse_file(strategy, path);
+    }
+
+    const size_t recorded = internal::get_recorded_length(kind, data, length);
+    if (recorded) {
+        // The recorded length is still only a claim, so running out of
+        // memory must not throw.
+        char* buffer = static_cast<char*>(malloc(recorded));
+        if (!buffer) {
+            internal::unmap_text(data, length);
+            return document::_internal_make_error(ERROR_OUT_OF_MEMORY);
+        }
+        // Frees the buffer itself if it cannot take ownership.
+        mutable_string_view text(
+            recorded, buffer, &internal::free_text, std::nothrow);
+        if (!text.get_data()) {
+            internal::unmap_text(data, length);
+            return document::_internal_make_error(ERROR_OUT_OF_MEMORY);
+        }
+        internal::decompression_pipeline pipeline(
+            kind, data, length, text.get_data(), recorded);
+        internal::segment_list list = { &pipeline,
+                                        pipeline.get_block_count(),
+                                        &internal::get_pipeline_block,
+                                        recorded };
+        document doc = internal::parse_segment_list(strategy, list, &text);
+        if (!doc.is_valid()) {
+            // The parser only sees blocks that are fully decompressed, so
+            // unless the text was already complete, the error is in the
+            // file itself and the rest of it is not needed.
+            pipeline.cancel();
+        }
+        const auto outcome = pipeline.finish();
+        if (outcome != internal::decompression_pipeline::length_mismatch) {
+            internal::unmap_text(data, length);
+            if (outcome == internal::decompression_pipeline::corrupt) {
+                return document::_internal_make_error(
+                    ERROR_INVALID_COMPRESSED_DATA);
+            }
+            return doc;
+        }
+    }
+
+    mutable_string_view text;
+    const error rv = internal::decompress(kind, data, length, recorded, &text);
+    internal::unmap_text(data, length);
+    if (rv != ERROR_NO_ERROR) {
+        return document::_internal_make_error(rv);
+    }
+    return parse(strategy, text);
+}
+
+} // namespace sajson
@@ -26,8 +26,35 @@
 
 #include "sajson.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
 #include <cstdio>
+#include <cstring>
+#include <memory>
 #include <string_view>
+#include <type_traits>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Output to file descriptors with writev() is available on POSIX systems.
+// Define SAJSON_HAVE_WRITEV to 0 to disable it.
+#ifndef SAJSON_HAVE_WRITEV
+#if __has_include(<sys/uio.h>)
+#define SAJSON_HAVE_WRITEV 1
+#else
+#define SAJSON_HAVE_WRITEV 0
+#endif
+#endif
+
+#if SAJSON_HAVE_WRITEV
+#include <sys/uio.h>
+#endif
+
 using namespace std::literals;
 
 /**
@@ -60,6 +87,10 @@ struct FileOut
         return *this;
     }
 
+    inline void flush() {
+        _flush();
+    }
+
     inline size_t size() const {
         return _size;
     }
@@ -76,46 +107,646 @@ private:
     std::string _buf;
 };
 
+#if SAJSON_HAVE_WRITEV
+/**
+ * Output to a file descriptor with writev().
+ * String contents that need no escaping are not copied: each run gets its
+ * own iovec pointing into the document, which must therefore outlive the
+ * FdOut.  Punctuation, numbers, escapes and runs too short to be worth an
+ * iovec are copied into a scratch buffer.  Output is flushed when the
+ * iovecs or the scratch buffer run out, and on destruction.
+ */
+struct FdOut
+{
+    inline FdOut(int fd)
+        : _fd(fd), _iov(new iovec[max_iovecs]), _scratch(new char[scratch_size]) {
+    }
+
+    inline ~FdOut() {
+        _flush();
+    }
+
+    FdOut(const FdOut &) = delete;
+    FdOut &operator = (const FdOut &) = delete;
+
+    inline FdOut &operator += (std::string_view s) {
+        if(s.size() > scratch_size)
+        {
+            // too large to copy, so write it before the caller's bytes go away
+            _reference(s.data(), s.size());
+            _flush();
+            return *this;
+        }
+        if(_scratch_used + s.size() > scratch_size)
+            _flush();
+        _copy(s.data(), s.size());
+        return *this;
+    }
+
+    inline FdOut &operator += (char c) {
+        if(_scratch_used == scratch_size)
+            _flush();
+        _copy(&c, 1);
+        return *this;
+    }
+
+    /**
+     * Append bytes that stay valid until the output is flushed, such as
+     * strings in a parsed document, without copying them.
+     */
+    inline void append_reference(std::string_view s) {
+        if(s.size() < min_reference_length)
+            *this += s;
+        else
+            _reference(s.data(), s.size());
+    }
+
+    inline void flush() {
+        _flush();
+    }
+
+    inline size_t size() const {
+        return _size;
+    }
+
+private:
+    static constexpr size_t max_iovecs = 1024; // IOV_MAX on Linux
+    static constexpr size_t scratch_size = 1ul << 16;
+    static constexpr size_t min_reference_length = 128;
+
+    inline void _copy(const char *p, size_t n) {
+        char *dest = _scratch.get() + _scratch_used;
+        iovec *last = _count ? &_iov[_count - 1] : nullptr;
+        if(last && static_cast<char *>(last->iov_base) + last->iov_len == dest)
+            last->iov_len += n;
+        else
+        {
+            if(_count == max_iovecs)
+            {
+                _flush();
+                dest = _scratch.get();
+            }
+            _iov[_count++] = { dest, n };
+        }
+        std::memcpy(dest, p, n);
+        _scratch_used += n;
+    }
+
+    inline void _reference(const char *p, size_t n) {
+        if(n == 0)
+            return;
+        if(_count == max_iovecs)
+            _flush();
+        _iov[_count++] = { const_cast<char *>(p), n };
+    }
+
+    inline void _flush() {
+        iovec *iov = _iov.get();
+        size_t count = _count;
+        while(count && _fd != -1)
+        {
+            const ssize_t n = ::writev(_fd, iov, static_cast<int>(count));
+            if(n < 0)
+            {
+                if(errno != EINTR)
+                    _fd = -1; // stop writing; size() reports what got out
+                continue;
+            }
+            // skip what was written, resuming partial writes mid-iovec
+            size_t written = static_cast<size_t>(n);
+            _size += written;
+            while(count && written >= iov->iov_len)
+            {
+                written -= iov->iov_len;
+                ++iov;
+                --count;
+            }
+            if(count)
+            {
+                iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+                iov->iov_len -= written;
+            }
+        }
+        _count = 0;
+        _scratch_used = 0;
+    }
+
+private:
+    int _fd;
+    std::unique_ptr<iovec[]> _iov;
+    std::unique_ptr<char[]> _scratch;
+    size_t _count { 0 };
+    size_t _scratch_used { 0 };
+    size_t _size { 0 };
+};
+#endif
+
 namespace sajson
 {
 
 template<typename O>
 inline void dump(O &o, const sajson::value &value, int indent=-1);
 
+/**
+ * How dump_pretty() lays out its output.
+ */
+struct pretty_format
+{
+    /// Indent characters per nesting level.
+    size_t indent_width { 2 };
+    /// Usually ' ' or '\t'.
+    char indent_char { ' ' };
+    /// Line ending, such as "\n" or "\r\n".
+    std::string_view newline { "\n" };
+    /// Whether a space follows the colon after each key.
+    bool space_after_colon { true };
+};
+
 
 namespace internal
 {
 
 template<typename O>
 inline void ind(O &o, int n) {
-    static constexpr char i_str[] = "  ";
+    static constexpr char i_str[] = "                                ";
+    static constexpr int levels_per_append = (sizeof(i_str) - 1) / 2;
 
-    while(n-- > 0) {
-        o += i_str;
+    while(n > 0) {
+        const int levels = std::min(n, levels_per_append);
+        o += std::string_view(i_str, static_cast<size_t>(levels) * 2);
+        n -= levels;
     }
 }
 
 
+/**
+ * For each byte, the character that follows the backslash when it is
+ * escaped in a string: 'u' for a \u00XX escape, or 0 if the byte is
+ * written as is.
+ */
+struct escape_table_t
+{
+    constexpr escape_table_t() : escape() {
+        for(int c = 0; c < 0x20; ++c)
+            escape[c] = 'u';
+        escape[int('\b')] = 'b';
+        escape[int('\f')] = 'f';
+        escape[int('\n')] = 'n';
+        escape[int('\r')] = 'r';
+        escape[int('\t')] = 't';
+        escape[int('"')] = '"';
+        escape[int('\\')] = '\\';
+    }
+
+    char escape[256];
+};
+
+inline constexpr escape_table_t escape_table {};
+
+template<typename O, typename = void>
+struct has_append_reference : std::false_type
+{
+};
+
 template<typename O>
-inline void dump_string(O &o, std::string_view s) {
+struct has_append_reference<O, std::void_t<decltype(std::declval<O &>().append_reference(std::string_view()))>>
+    : std::true_type
+{
+};
+
+/**
+ * Append bytes from the document, which outlive the output.  Outputs that
+ * can refer to them instead of copying provide append_reference().
+ */
+template<typename O>
+inline void dump_reference(O &o, std::string_view s) {
+    if constexpr(has_append_reference<O>::value)
+        o.append_reference(s);
+    else
+        o += s;
+}
+
+/**
+ * Returns the first character in [p, end) that must be escaped, or end.
+ * With SSE2, 16 bytes are checked at a time.
+ */
+inline const char *find_escape(const char *p, const char *end) {
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i last_control = _mm_set1_epi8(0x1f);
+    while(end - p >= 16) {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        // Unsigned chunk <= 0x1f, so that bytes >= 0x80 do not match.
+        const __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(chunk, last_control), chunk);
+        const __m128i special = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash));
+        const int mask = _mm_movemask_epi8(_mm_or_si128(control, special));
+        if(mask)
+            return p + __builtin_ctz(static_cast<unsigned>(mask));
+        p += 16;
+    }
+#endif
+    while(p != end && !escape_table.escape[static_cast<unsigned char>(*p)])
+        ++p;
+    return p;
+}
+
+template<typename O>
+inline void dump_escape(O &o, char c) {
+    static constexpr char hex[] = "0123456789abcdef";
+    const unsigned char u = static_cast<unsigned char>(c);
+    const char e = escape_table.escape[u];
+    if(e == 'u') {
+        const char sequence[] = { '\\', 'u', '0', '0', hex[u >> 4], hex[u & 15] };
+        o += std::string_view(sequence, sizeof(sequence));
+    } else {
+        const char sequence[] = { '\\', e };
+        o += std::string_view(sequence, sizeof(sequence));
+    }
+}
+
+/**
+ * Unless 'reference' is false, unescaped runs are passed as references,
+ * which is only safe for bytes that outlive the output, such as strings
+ * in a document.
+ */
+template<typename O>
+inline void dump_string(O &o, std::string_view s, bool reference=true) {
     o += '"';
-    size_t pos { 0 };
+    const char *p = s.data();
+    const char *const end = p + s.size();
     while(true) {
-        auto n = s.find_first_of("\"\n\t\\", pos);
-        if(n == std::string_view::npos)
+        const char *e = find_escape(p, end);
+        if(e != p) {
+            const std::string_view run(p, static_cast<size_t>(e - p));
+            if(reference)
+                dump_reference(o, run);
+            else
+                o += run;
+        }
+        if(e == end)
+            break;
+        dump_escape(o, *e);
+        p = e + 1;
+    }
+    o += '"';
+}
+
+/**
+ * Writes input bytes of a structure that was not modified while parsing.
+ * Parsing in place replaced each string's closing quote with a NUL, which
+ * cannot otherwise occur in JSON text, so NULs are written as quotes.
+ */
+template<typename O>
+inline void dump_source(O &o, const char *p, const char *end) {
+    while(p != end) {
+        const char *nul = static_cast<const char *>(std::memchr(p, 0, static_cast<size_t>(end - p)));
+        if(nul == nullptr) {
+            dump_reference(o, std::string_view(p, static_cast<size_t>(end - p)));
+            break;
+        }
+        if(nul != p)
+            dump_reference(o, std::string_view(p, static_cast<size_t>(nul - p)));
+        o += '"';
+        p = nul + 1;
+    }
+}
+
+template<typename O>
+inline void dump_passthrough(O &o, const sajson::document &document, const sajson::value &value) {
+    source_range range;
+    if(document.get_source_range(value, &range) && !range.modified)
+    {
+        const char *text = document._internal_get_input().get_data();
+        dump_source(o, text + range.begin, text + range.end);
+        return;
+    }
+
+    switch(value.get_type())
+    {
+    case TYPE_ARRAY:
+    {
+        const sajson::array arr = value.as_array();
+        o += '[';
+        for(const auto [idx, elem]: arr)
         {
-            o += s.substr(pos);
+            if(idx)
+                o += ',';
+            internal::dump_passthrough(o, document, elem);
+        }
+        o += ']';
+        break;
+    }
+    case TYPE_OBJECT:
+    {
+        size_t idx = 0;
+        o += '{';
+        for(const auto [key, elem]: value.as_object())
+        {
+            if(idx++)
+                o += ',';
+            dump_string(o, key);
+            o += ':';
+            internal::dump_passthrough(o, document, elem);
+        }
+        o += '}';
+        break;
+    }
+    default:
+        dump(o, value, -1);
+        break;
+    }
+}
+
+/**
+ * Writes a line break and the indentation for a nesting level with a
+ * single append, from a buffer holding the newline followed by the
+ * indentation of the deepest level seen so far.
+ */
+class line_breaker
+{
+public:
+    inline line_breaker(const pretty_format &format)
+        : _width(format.indent_width), _newline_size(format.newline.size()), _indent_char(format.indent_char) {
+        _buf.reserve(_newline_size + _width * 16);
+        _buf += format.newline;
+        _buf.append(_width * 16, _indent_char);
+    }
+
+    template<typename O>
+    inline void operator () (O &o, size_t level) {
+        const size_t size = _newline_size + _width * level;
+        if(size > _buf.size())
+            _buf.append(std::max(size, 2 * _buf.size()) - _buf.size(), _indent_char);
+        o += std::string_view(_buf.data(), size);
+    }
+
+private:
+    size_t _width;
+    size_t _newline_size;
+    char _indent_char;
+    std::string _buf;
+};
+
+template<typename O>
+inline void dump_pretty(O &o, const sajson::value &value, line_breaker &br, std::string_view colon, size_t level) {
+    switch(value.get_type())
+    {
+    case TYPE_ARRAY:
+    {
+        const sajson::array arr = value.as_array();
+        if(arr.get_length() == 0)
+        {
+            o += "[]"sv;
             break;
         }
-        o += s.substr(pos, n - pos);
-        o += "\\"sv;
-        if(s[n] == '\n' || s[n] == '\t')
-            o += 'n';
+        o += '[';
+        for(const auto [idx, elem]: arr)
+        {
+            if(idx)
+                o += ',';
+            br(o, level + 1);
+            dump_pretty(o, elem, br, colon, level + 1);
+        }
+        br(o, level);
+        o += ']';
+        break;
+    }
+    case TYPE_OBJECT:
+    {
+        const sajson::object obj = value.as_object();
+        if(obj.get_length() == 0)
+        {
+            o += "{}"sv;
+            break;
+        }
+        size_t idx = 0;
+        o += '{';
+        for(const auto [key, elem]: obj)
+        {
+            if(idx++)
+                o += ',';
+            br(o, level + 1);
+            dump_string(o, key);
+            o += colon;
+            dump_pretty(o, elem, br, colon, level + 1);
+        }
+        br(o, level);
+        o += '}';
+        break;
+    }
+    default:
+        dump(o, value, -1);
+        break;
+    }
+}
+
+/**
+ * Orders UTF-8 strings by their UTF-16 code units, as RFC 8785 sorts keys.
+ * That is byte order, except that characters outside the BMP (surrogate
+ * pairs in UTF-16) come before U+E000 to U+FFFF.  The first differing byte
+ * is a lead byte in both strings or a continuation byte in both.
+ */
+inline bool utf16_less(std::string_view a, std::string_view b) {
+    const size_t n = std::min(a.size(), b.size());
+    size_t i = 0;
+    while(i < n && a[i] == b[i])
+        ++i;
+    if(i == n)
+        return a.size() < b.size();
+    const unsigned char x = static_cast<unsigned char>(a[i]);
+    const unsigned char y = static_cast<unsigned char>(b[i]);
+    if(x >= 0xf0 && (y == 0xee || y == 0xef))
+        return true;
+    if(y >= 0xf0 && (x == 0xee || x == 0xef))
+        return false;
+    return x < y;
+}
+
+/**
+ * Writes a double as ECMAScript's Number.prototype.toString() does, which
+ * RFC 8785 requires: the shortest round-trip digits, spelled out in full
+ * below 1e21 and above 1e-7, otherwise with an exponent like 1e+21.
+ * Infinities and NaN cannot be canonicalized and are written as null.
+ */
+template<typename O>
+inline void dump_canonical_double(O &o, double d) {
+    if(!std::isfinite(d)) {
+        o += "null"sv;
+        return;
+    }
+    if(d == 0) {
+        o += '0'; // also for -0
+        return;
+    }
+
+    // [-]d[.ddd]e(+|-)dd
+    char sci[32];
+    const char *const sci_end = std::to_chars(sci, sci + sizeof(sci), d, std::chars_format::scientific).ptr;
+    const char *p = sci;
+    char out[40];
+    char *q = out;
+    if(*p == '-') {
+        *q++ = '-';
+        ++p;
+    }
+    char digits[20];
+    int k = 0;
+    for(; *p != 'e'; ++p)
+        if(*p != '.')
+            digits[k++] = *p;
+    const bool negative_exponent = p[1] == '-';
+    int exponent = 0;
+    std::from_chars(p + 2, sci_end, exponent);
+    const int n = (negative_exponent ? -exponent : exponent) + 1; // value is 0.digits * 10^n
+
+    if(k <= n && n <= 21) {
+        q = std::copy(digits, digits + k, q);
+        q = std::fill_n(q, n - k, '0');
+    } else if(0 < n && n <= 21) {
+        q = std::copy(digits, digits + n, q);
+        *q++ = '.';
+        q = std::copy(digits + n, digits + k, q);
+    } else if(-6 < n && n <= 0) {
+        *q++ = '0';
+        *q++ = '.';
+        q = std::fill_n(q, -n, '0');
+        q = std::copy(digits, digits + k, q);
+    } else {
+        *q++ = digits[0];
+        if(k > 1) {
+            *q++ = '.';
+            q = std::copy(digits + 1, digits + k, q);
+        }
+        *q++ = 'e';
+        *q++ = n - 1 < 0 ? '-' : '+';
+        q = std::to_chars(q, out + sizeof(out), n - 1 < 0 ? 1 - n : n - 1).ptr;
+    }
+    o += std::string_view(out, static_cast<size_t>(q - out));
+}
+
+/**
+ * 'order' is scratch space shared by all levels: each object sorts the
+ * indices of its members in a slice at the end, which nested objects
+ * extend and then shrink again.
+ */
+template<typename O>
+inline void dump_canonical(O &o, const sajson::value &value, std::vector<size_t> &order) {
+    switch(value.get_type())
+    {
+    case TYPE_DOUBLE:
+        dump_canonical_double(o, value.get_double_value());
+        break;
+    case TYPE_ARRAY:
+    {
+        const size_t length = value.get_length();
+        o += '[';
+        for(size_t i = 0; i < length; ++i)
+        {
+            if(i)
+                o += ',';
+            dump_canonical(o, value.get_array_element(i), order);
+        }
+        o += ']';
+        break;
+    }
+    case TYPE_OBJECT:
+    {
+        const size_t length = value.get_length();
+        const size_t base = order.size();
+        for(size_t i = 0; i < length; ++i)
+            order.push_back(i);
+        const auto less = [&value](size_t a, size_t b) {
+            return utf16_less(value.get_object_key(a), value.get_object_key(b));
+        };
+        if(length <= 16)
+        {
+            // insertion sort: fewer key comparisons for small objects
+            for(size_t i = base + 1; i < base + length; ++i)
+            {
+                const size_t index = order[i];
+                size_t j = i;
+                for(; j > base && less(index, order[j - 1]); --j)
+                    order[j] = order[j - 1];
+                order[j] = index;
+            }
+        }
         else
-            o += s[n];
-        pos = n + 1; // continue after what was copied (plus the found char)
+            std::sort(order.begin() + static_cast<std::ptrdiff_t>(base), order.end(), less);
+
+        o += '{';
+        for(size_t i = 0; i < length; ++i)
+        {
+            if(i)
+                o += ',';
+            const size_t index = order[base + i];
+            dump_string(o, value.get_object_key(index));
+            o += ':';
+            dump_canonical(o, value.get_object_value(index), order);
+        }
+        o += '}';
+        order.resize(base);
+        break;
+    }
+    default:
+        dump(o, value, -1);
+        break;
     }
-    o += '"';
+}
+
+/**
+ * Output that only counts bytes, for the first pass of serialize().
+ */
+struct size_out
+{
+    inline size_out &operator += (std::string_view s) {
+        size += s.size();
+        return *this;
+    }
+
+    inline size_out &operator += (char) {
+        ++size;
+        return *this;
+    }
+
+    size_t size { 0 };
+};
+
+template<typename O, typename T>
+inline void dump_integer(O &o, T i) {
+    char buffer[24];
+    const auto result = std::to_chars(buffer, buffer + sizeof(buffer), i);
+    o += std::string_view(buffer, static_cast<size_t>(result.ptr - buffer));
+}
+
+inline void dump_integer(size_out &o, int i) {
+    unsigned u = i < 0 ? 0u - static_cast<unsigned>(i) : static_cast<unsigned>(i);
+    size_t digits = 1;
+    while(u >= 10) {
+        u /= 10;
+        ++digits;
+    }
+    o.size += digits + (i < 0);
+}
+
+/**
+ * Writes the shortest representation that parses back to the same double.
+ * A ".0" is added where needed so that it also parses back as a double.
+ * JSON has no infinities or NaN, so those are written as null.
+ */
+template<typename O>
+inline void dump_double(O &o, double d) {
+    if(!std::isfinite(d)) {
+        o += "null"sv;
+        return;
+    }
+    char buffer[32];
+    char *end = std::to_chars(buffer, buffer + sizeof(buffer) - 2, d).ptr;
+    if(std::find_if(buffer, end, [](char c) { return c == '.' || c == 'e'; }) == end) {
+        *end++ = '.';
+        *end++ = '0';
+    }
+    o += std::string_view(buffer, static_cast<size_t>(end - buffer));
 }
 
 template<typename O>
@@ -127,7 +758,7 @@ inline void dump_array(O &o, const sajson::array &arr, int indent) {
 
     for(const auto [idx, elem]: arr)
     {
-        if(indent != 0)
+        if(indent != -1)
             o += '\n';
         if(indent > 0)
             ind(o, indent);
@@ -159,17 +790,15 @@ inline void dump_object(O &o, const sajson::object &obj, int indent) {
     size_t idx = 0;
     for(const auto [key, value]: obj)
     {
-        if(indent != 0)
+        if(indent != -1)
             o += '\n';
         if(indent > 0)
             ind(o, indent);
 
         // output the key
-        o += '"';
-        o += key;
-        o += '"';
+        dump_string(o, key);
         o += ':';
-        if(indent != 0)
+        if(indent != -1)
             o += ' ';
 
         // output the value
@@ -190,6 +819,25 @@ inline void dump_object(O &o, const sajson::object &obj, int indent) {
     o += '}';
 }
 
+/**
+ * Output into a buffer known to be large enough, so nothing is checked.
+ */
+struct buffer_out
+{
+    inline buffer_out &operator += (std::string_view s) {
+        std::memcpy(p, s.data(), s.size());
+        p += s.size();
+        return *this;
+    }
+
+    inline buffer_out &operator += (char c) {
+        *p++ = c;
+        return *this;
+    }
+
+    char *p;
+};
+
 } // NS: internal
 
 /**
@@ -203,10 +851,10 @@ inline void dump(O &o, const sajson::value &value, int indent) {
     switch(value.get_type())
     {
     case TYPE_INTEGER:
-        o += std::to_string(value.get_integer_value());
+        internal::dump_integer(o, value.get_integer_value());
         break;
     case TYPE_DOUBLE:
-        o += std::to_string(value.get_double_value());
+        internal::dump_double(o, value.get_double_value());
         break;
     case TYPE_NULL:
         o += "null";
@@ -215,7 +863,7 @@ inline void dump(O &o, const sajson::value &value, int indent) {
         o += "false";
         break;
     case TYPE_TRUE:
-        o += "false";
+        o += "true";
         break;
     case TYPE_STRING:
         internal::dump_string(o, value.as_string());
@@ -229,6 +877,75 @@ inline void dump(O &o, const sajson::value &value, int indent) {
     }
 }
 
+/**
+ * Dump a sajson::value to the specified output, 'o', with one member or
+ * element per line, indented as 'format' says.  Empty arrays and objects
+ * are written as [] and {}.
+ */
+template<typename O>
+inline void dump_pretty(O &o, const sajson::value &value, const pretty_format &format = pretty_format()) {
+    internal::line_breaker br(format);
+
+    internal::dump_pretty(o, value, br, format.space_after_colon? ": "sv: ":"sv, 0);
+}
+
+/**
+ * Dump a sajson::value in the canonical form of RFC 8785 (JSON
+ * Canonicalization Scheme), for hashing and signing: no whitespace, object
+ * keys sorted by UTF-16 code units, numbers formatted as in ECMAScript,
+ * and only the escapes JSON requires.  Infinities and NaN, which the
+ * scheme does not allow, are written as null.
+ */
+template<typename O>
+inline void dump_canonical(O &o, const sajson::value &value) {
+    std::vector<size_t> order;
+
+    internal::dump_canonical(o, value, order);
+}
+
+/**
+ * Dump a sajson::value from a document parsed with
+ * parse_with_source_ranges() or parse_read_only_with_source_ranges().
+ * Arrays and objects whose input bytes were not changed by the parse are
+ * copied from the input, keeping their original whitespace and number
+ * spelling, instead of being reformatted.  Those containing strings that
+ * were unescaped in place are written compactly, as dump() does, with
+ * their unchanged children copied again.  The document must outlive the
+ * output, as for dump().
+ */
+template<typename O>
+inline void dump_passthrough(O &o, const sajson::document &document, const sajson::value &value) {
+    internal::dump_passthrough(o, document, value);
+}
+
+/**
+ * Returns the exact number of bytes serialize() writes for a sajson::value.
+ * This costs about as much as serializing it, so measure once and reuse
+ * the result, e.g. to write a frame header before the document.
+ */
+inline size_t serialized_size(const value &value, bool indent=false) {
+    internal::size_out so;
+
+    dump(so, value, indent? 0: -1);
+
+    return so.size;
+}
+
+/**
+ * Serialize a sajson::value into 'buffer', which must hold at least
+ * serialized_size(value, indent) bytes.  The size is not checked while
+ * writing.  Returns the end of the output.  No NUL is appended.
+ * If 'indent' is true, LF and indentation will be used.
+ * Otherwise, everything will be written on a single line, with no spaces.
+ */
+inline char *serialize(char *buffer, const value &value, bool indent=false) {
+    internal::buffer_out bo { buffer };
+
+    dump(bo, value, indent? 0: -1);
+
+    return bo.p;
+}
+
 /**
  * Serialize a sajson::value to a string.
  * If 'indent' is true, LF and indentation will be used.
@@ -245,6 +962,32 @@ inline std::string to_string(const value &value, bool indent=false) {
     return so;
 }
 
+/**
+ * Serialize a sajson::value to a string, laid out as 'format' says.
+ */
+inline std::string to_pretty_string(const value &value, const pretty_format &format = pretty_format()) {
+
+    std::string so;
+    so.reserve(65536);
+
+    dump_pretty(so, value, format);
+
+    return so;
+}
+
+/**
+ * Serialize a sajson::value to a string in the canonical form of RFC 8785.
+ */
+inline std::string to_canonical_string(const value &value) {
+
+    std::string so;
+    so.reserve(65536);
+
+    dump_canonical(so, value);
+
+    return so;
+}
+
 /**
  * Serialize a sajson::value to the given file pointer.
  * If 'indent' is true, LF and indentation will be used.
@@ -255,6 +998,7 @@ inline size_t write(std::FILE *f, const value &value, bool indent=false) {
     FileOut fo(f);
 
     dump(fo, value, indent? 0: -1);
+    fo.flush();
 
     return fo.size();
 }
@@ -278,4 +1022,22 @@ inline size_t write(const std::string &filepath, const value &value, bool indent
     return written;
 }
 
+#if SAJSON_HAVE_WRITEV
+/**
+ * Serialize a sajson::value to the given file descriptor with writev(),
+ * without copying string contents.
+ * If 'indent' is true, LF and indentation will be used.
+ * Otherwise, everything will be written on a single line, with no spaces.
+ * Indentation size can currently not be controlled.
+ */
+inline size_t write(int fd, const value &value, bool indent=false) {
+    FdOut fo(fd);
+
+    dump(fo, value, indent? 0: -1);
+    fo.flush();
+
+    return fo.size();
+}
+#endif
+
 }
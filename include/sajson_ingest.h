@@ -0,0 +1,628 @@
+/*
+ * Copyright (c) 2012-2017 Chad Austin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "sajson.h"
+
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define SAJSON_HAVE_IO_URING 1
+#else
+#define SAJSON_HAVE_IO_URING 0
+#endif
+
+namespace sajson {
+
+/// Tuning for \ref ingest_files.
+struct ingest_options {
+    ingest_options()
+        : queue_depth(32)
+        , worker_count(std::max(1u, std::thread::hardware_concurrency()))
+        , use_io_uring(true) {}
+
+    /// The number of read buffers, and so the number of files being read
+    /// or parsed at once.
+    size_t queue_depth;
+    /// The number of threads that parse.
+    size_t worker_count;
+    /// Set to false to always use the pread thread pool.
+    bool use_io_uring;
+};
+
+namespace internal {
+
+/// A read buffer and the file being read into it.  Buffers grow to the
+/// largest file they have held and are reused for the next file.
+struct ingest_slot {
+    ingest_slot()
+        : buffer(0)
+        , capacity(0)
+        , length(0)
+        , bytes_read(0)
+        , fd(-1)
+        , file_index(0)
+        , status(ERROR_NO_ERROR) {}
+
+    ~ingest_slot() { delete[] buffer; }
+
+    ingest_slot(const ingest_slot&) = delete;
+    void operator=(const ingest_slot&) = delete;
+
+    // Opens the file and makes room for it.  On failure, status says why.
+    bool open_file(const char* path) {
+        bytes_read = 0;
+        length = 0;
+        status = ERROR_NO_ERROR;
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            return fail(ERROR_CANNOT_READ_FILE);
+        }
+        length = static_cast<size_t>(st.st_size);
+        if (length > capacity) {
+            delete[] buffer;
+            capacity = std::max(length, 2 * capacity);
+            buffer = new (std::nothrow) char[capacity];
+            if (!buffer) {
+                capacity = 0;
+                return fail(ERROR_OUT_OF_MEMORY);
+            }
+        }
+        return true;
+    }
+
+    bool fail(error code) {
+        status = code;
+        close_file();
+        return false;
+    }
+
+    void close_file() {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    // Reads the rest of the file with pread and closes it.
+    void read_rest() {
+        while (bytes_read < length) {
+            ssize_t n = pread(
+                fd,
+                buffer + bytes_read,
+                length - bytes_read,
+                static_cast<off_t>(bytes_read));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                fail(ERROR_CANNOT_READ_FILE);
+                break;
+            }
+            if (n == 0) {
+                break;
+            }
+            bytes_read += static_cast<size_t>(n);
+        }
+        close_file();
+    }
+
+    template <typename AllocationStrategy, typename Callback>
+    void parse_and_deliver(
+        const AllocationStrategy& strategy, Callback& on_document) {
+        if (status != ERROR_NO_ERROR) {
+            on_document(file_index, document::_internal_make_error(status));
+            return;
+        }
+        const document doc
+            = parse(strategy, mutable_string_view(bytes_read, buffer));
+        on_document(file_index, doc);
+    }
+
+    char* buffer;
+    size_t capacity;
+    size_t length; // of the file when opened
+    size_t bytes_read;
+    int fd;
+    size_t file_index;
+    error status;
+    iovec request;
+};
+
+/// Slots that finished reading wait here for a parse worker, and parsed
+/// slots wait here to be reused.
+class ingest_queue {
+public:
+    explicit ingest_queue(size_t slot_count)
+        : stopping(false) {
+        for (size_t i = 0; i < slot_count; ++i) {
+            free_slots.push_back(i);
+        }
+    }
+
+    void push_ready(size_t slot) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready_slots.push_back(slot);
+        ready.notify_one();
+    }
+
+    /// Returns false once stopped and drained.
+    bool pop_ready(size_t* slot) {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [&] { return !ready_slots.empty() || stopping; });
+        if (ready_slots.empty()) {
+            return false;
+        }
+        *slot = ready_slots.front();
+        ready_slots.pop_front();
+        return true;
+    }
+
+    void push_free(size_t slot) {
+        std::lock_guard<std::mutex> lock(mutex);
+        free_slots.push_back(slot);
+        freed.notify_one();
+    }
+
+    bool try_pop_free(size_t* slot) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return pop_free_locked(slot);
+    }
+
+    void pop_free(size_t* slot) {
+        std::unique_lock<std::mutex> lock(mutex);
+        freed.wait(lock, [&] { return !free_slots.empty(); });
+        pop_free_locked(slot);
+    }
+
+    void stop() {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        ready.notify_all();
+    }
+
+private:
+    bool pop_free_locked(size_t* slot) {
+        if (free_slots.empty()) {
+            return false;
+        }
+        *slot = free_slots.back();
+        free_slots.pop_back();
+        return true;
+    }
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable freed;
+    std::deque<size_t> ready_slots;
+    std::vector<size_t> free_slots;
+    bool stopping;
+};
+
+#if SAJSON_HAVE_IO_URING
+
+/// A minimal io_uring submission and completion ring, set up with raw
+/// system calls so that liburing is not required.  Only the submitting
+/// thread touches it.
+class io_uring_ring {
+public:
+    explicit io_uring_ring(unsigned entries)
+        : ring_fd(-1)
+        , sq_ring(MAP_FAILED)
+        , cq_ring(MAP_FAILED)
+        , sqe_array(MAP_FAILED)
+        , sq_ring_size(0)
+        , cq_ring_size(0)
+        , sqe_array_size(0)
+        , valid(false) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd = static_cast<int>(
+            syscall(__NR_io_uring_setup, entries, &params));
+        if (ring_fd < 0) {
+            return;
+        }
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size
+            = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+        sq_ring = map(sq_ring_size, IORING_OFF_SQ_RING);
+        cq_ring = single_mmap ? sq_ring : map(cq_ring_size, IORING_OFF_CQ_RING);
+        sqe_array_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqe_array = map(sqe_array_size, IORING_OFF_SQES);
+        if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED
+            || sqe_array == MAP_FAILED) {
+            return;
+        }
+
+        char* sq = static_cast<char*>(sq_ring);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_indices = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sqes = static_cast<io_uring_sqe*>(sqe_array);
+        char* cq = static_cast<char*>(cq_ring);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        valid = true;
+    }
+
+    ~io_uring_ring() {
+        if (sqe_array != MAP_FAILED) {
+            munmap(sqe_array, sqe_array_size);
+        }
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+            munmap(cq_ring, cq_ring_size);
+        }
+        if (sq_ring != MAP_FAILED) {
+            munmap(sq_ring, sq_ring_size);
+        }
+        if (ring_fd >= 0) {
+            close(ring_fd);
+        }
+    }
+
+    /// False if any part of the setup failed, in which case nothing else
+    /// may be called.
+    bool is_valid() const { return valid; }
+
+    /// Queues a readv; it is submitted by the next enter().
+    void prepare_readv(int fd, const iovec* request, size_t offset, size_t tag) {
+        const unsigned tail = *sq_tail;
+        const unsigned index = tail & sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uintptr_t>(request);
+        sqe->len = 1;
+        sqe->off = offset;
+        sqe->user_data = tag;
+        sq_indices[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    /// Submits the prepared requests the kernel has not taken yet and waits
+    /// for at least one completion.  Returns false if the ring has failed;
+    /// requests the kernel already took may still be running.
+    bool enter() {
+        for (unsigned busy = 0;;) {
+            long rv = syscall(
+                __NR_io_uring_enter,
+                ring_fd,
+                get_unsubmitted(),
+                1,
+                IORING_ENTER_GETEVENTS,
+                0,
+                0);
+            if (rv >= 0) {
+                return true;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno != EAGAIN && errno != EBUSY) || ++busy == 1000) {
+                return false;
+            }
+            // Out of kernel resources for now, or the completion queue
+            // is full: let the caller reap, or give the kernel a moment.
+            if (has_completions()) {
+                return true;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    /// Waits until the requests the kernel has taken, of the 'outstanding'
+    /// prepared since the ring was created or last drained, have completed,
+    /// discarding their results.  Used after enter() fails, so that no
+    /// read is still writing into a buffer that is about to be reused.
+    void drain(size_t outstanding) {
+        size_t pending = outstanding - get_unsubmitted();
+        while (pending) {
+            reap([&](size_t, int) { --pending; });
+            if (!pending) {
+                break;
+            }
+            // Completions are posted whether or not io_uring_enter works.
+            if (syscall(
+                    __NR_io_uring_enter,
+                    ring_fd,
+                    0,
+                    1,
+                    IORING_ENTER_GETEVENTS,
+                    0,
+                    0)
+                < 0) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    /// Calls f(tag, result) for each completion.
+    template <typename F>
+    void reap(F f) {
+        unsigned head = *cq_head;
+        const unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            const io_uring_cqe& cqe = cqes[head & cq_mask];
+            f(static_cast<size_t>(cqe.user_data), cqe.res);
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+
+private:
+    io_uring_ring(const io_uring_ring&) = delete;
+    void operator=(const io_uring_ring&) = delete;
+
+    unsigned get_unsubmitted() const {
+        return *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    }
+
+    bool has_completions() const {
+        return *cq_head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    void* map(size_t size, off_t offset) {
+        return mmap(
+            0,
+            size,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE,
+            ring_fd,
+            offset);
+    }
+
+    int ring_fd;
+    void* sq_ring;
+    void* cq_ring;
+    void* sqe_array;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqe_array_size;
+    bool valid;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned* sq_indices;
+    io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+};
+
+// Linux reads at most this much per request.
+inline constexpr size_t MAX_READ_SIZE = size_t(1) << 30;
+
+template <typename AllocationStrategy, typename Callback>
+bool ingest_with_io_uring(
+    const AllocationStrategy& strategy,
+    const char* const* paths,
+    size_t count,
+    Callback& on_document,
+    const ingest_options& options) {
+    const size_t slot_count = std::max<size_t>(options.queue_depth, 1);
+    io_uring_ring ring(static_cast<unsigned>(slot_count));
+    if (!ring.is_valid()) {
+        return false;
+    }
+
+    std::vector<ingest_slot> slots(slot_count);
+    ingest_queue queue(slot_count);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < std::max<size_t>(options.worker_count, 1); ++i) {
+        workers.emplace_back([&] {
+            size_t slot;
+            while (queue.pop_ready(&slot)) {
+                slots[slot].parse_and_deliver(strategy, on_document);
+                queue.push_free(slot);
+            }
+        });
+    }
+
+    size_t next_file = 0;
+    size_t in_flight = 0;
+    // Set if io_uring_enter fails.  Requests left in the ring must never
+    // be submitted after their buffers are reused, so the ring is then
+    // abandoned and the remaining files are read with pread.
+    bool ring_failed = false;
+    auto read_more = [&](size_t index) {
+        ingest_slot& slot = slots[index];
+        const size_t remaining = slot.length - slot.bytes_read;
+        slot.request.iov_base = slot.buffer + slot.bytes_read;
+        slot.request.iov_len = std::min(remaining, MAX_READ_SIZE);
+        ring.prepare_readv(slot.fd, &slot.request, slot.bytes_read, index);
+    };
+    auto dispatch = [&](size_t index) {
+        slots[index].close_file();
+        queue.push_ready(index);
+    };
+
+    while (next_file < count || in_flight) {
+        // Start reads into every free buffer.  With nothing in flight there
+        // is nothing to wait for but a worker returning a buffer.
+        while (next_file < count) {
+            size_t index;
+            if (in_flight) {
+                if (!queue.try_pop_free(&index)) {
+                    break;
+                }
+            } else {
+                queue.pop_free(&index);
+            }
+            ingest_slot& slot = slots[index];
+            slot.file_index = next_file;
+            if (!slot.open_file(paths[next_file++]) || slot.length == 0) {
+                dispatch(index);
+                continue;
+            }
+            if (ring_failed) {
+                slot.read_rest();
+                dispatch(index);
+                continue;
+            }
+            read_more(index);
+            ++in_flight;
+        }
+        if (!in_flight) {
+            continue;
+        }
+
+        if (!ring.enter()) {
+            // Wait out the reads the kernel already took, so none is still
+            // writing into its buffer, then finish those files with pread.
+            ring.drain(in_flight);
+            ring_failed = true;
+            for (size_t i = 0; i < slot_count; ++i) {
+                if (slots[i].fd >= 0) {
+                    slots[i].read_rest();
+                    queue.push_ready(i);
+                }
+            }
+            in_flight = 0;
+            continue;
+        }
+        ring.reap([&](size_t i, int result) {
+            ingest_slot& slot = slots[i];
+            if (result < 0) {
+                slot.fail(ERROR_CANNOT_READ_FILE);
+            } else if (result > 0) {
+                slot.bytes_read += static_cast<size_t>(result);
+                if (slot.bytes_read < slot.length) {
+                    read_more(i);
+                    return;
+                }
+            }
+            // Done, or the file shrank since it was opened.
+            --in_flight;
+            dispatch(i);
+        });
+    }
+
+    queue.stop();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return true;
+}
+
+#endif
+
+template <typename AllocationStrategy, typename Callback>
+void ingest_with_pread(
+    const AllocationStrategy& strategy,
+    const char* const* paths,
+    size_t count,
+    Callback& on_document,
+    const ingest_options& options) {
+    std::atomic<size_t> next_file(0);
+    auto work = [&] {
+        ingest_slot slot;
+        for (;;) {
+            const size_t i = next_file.fetch_add(1);
+            if (i >= count) {
+                return;
+            }
+            slot.file_index = i;
+            if (slot.open_file(paths[i])) {
+                slot.read_rest();
+            }
+            slot.parse_and_deliver(strategy, on_document);
+        }
+    };
+
+    // Each thread blocks in pread with its own buffer, so use enough
+    // threads to keep the requested number of reads outstanding.
+    const size_t thread_count = std::max<size_t>(
+        std::max(options.worker_count, options.queue_depth), 1);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; ++i) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+} // namespace internal
+
+/**
+ * Reads and parses many JSON files with disk I/O overlapping parsing.
+ * Calls on_document(index, doc) once per path, where index is the path's
+ * position, concurrently from parse worker threads and in no particular
+ * order.  A file that cannot be read yields a document with
+ * ERROR_CANNOT_READ_FILE.
+ *
+ * On Linux, a queue of reads is kept in flight through io_uring and each
+ * completed buffer is handed to a worker; buffers come from a fixed pool
+ * of options.queue_depth buffers and are reused once their document has
+ * been delivered.  Where io_uring is unavailable, a pool of threads
+ * reading with pread() and parsing takes its place.
+ *
+ * The document is parsed in place in a pooled buffer, so it is only valid
+ * during the call to on_document.  Returns whether io_uring was used.
+ */
+template <typename AllocationStrategy, typename Callback>
+bool ingest_files(
+    const AllocationStrategy& strategy,
+    const char* const* paths,
+    size_t count,
+    Callback on_document,
+    const ingest_options& options = ingest_options()) {
+#if SAJSON_HAVE_IO_URING
+    if (options.use_io_uring
+        && internal::ingest_with_io_uring(
+            strategy, paths, count, on_document, options)) {
+        return true;
+    }
+#endif
+    internal::ingest_with_pread(strategy, paths, count, on_document, options);
+    return false;
+}
+
+} // namespace sajson
@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2012-2017 Chad Austin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "sajson.h"
+
+#include <cstring>
+#include <string>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace sajson {
+
+/// The result of \ref minify.
+struct minify_result {
+    /// The length of the minified text, which starts where the input did.
+    size_t length;
+    /// False if validation was requested and the input is not a
+    /// well-formed document.  Always true otherwise.
+    bool valid;
+};
+
+namespace internal {
+
+/// Moves n bytes from p down to out, unless nothing has been removed yet
+/// and they are already there.
+inline char* minify_move(char* out, const char* p, size_t n) {
+    if (out != p) {
+        memmove(out, p, n);
+    }
+    return out + n;
+}
+
+/// True for the characters literals and numbers are spelled with.
+/// Whitespace between two of them separates tokens and must be kept.
+inline bool is_token_character(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z')
+        || (c >= 'A' && c <= 'Z') || c == '-' || c == '+' || c == '.';
+}
+
+/// Copies everything but whitespace from p to out, stopping at a quote
+/// or the end of the input.  Whitespace between two token characters, as
+/// in "[1 2]", is replaced by one space rather than dropped, so that the
+/// tokens on either side are not merged into one.
+inline void minify_structure(char*& out, const char*& p, const char* end) {
+    // The last byte kept, and whether whitespace was dropped since.  A
+    // string or the start of the input comes before, neither of which
+    // can merge with a token.
+    char last = 0;
+    bool gap = false;
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i carriage_return = _mm_set1_epi8('\r');
+    const __m128i quote = _mm_set1_epi8('"');
+    while (end - p >= 16) {
+        const __m128i chunk
+            = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        const __m128i whitespace = _mm_or_si128(
+            _mm_or_si128(
+                _mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)),
+            _mm_or_si128(
+                _mm_cmpeq_epi8(chunk, newline),
+                _mm_cmpeq_epi8(chunk, carriage_return)));
+        const unsigned quotes = static_cast<unsigned>(
+            _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, quote)));
+        unsigned keep = ~static_cast<unsigned>(_mm_movemask_epi8(whitespace))
+            & 0xffffu;
+
+        if (!quotes && keep == 0xffffu) {
+            // Nothing to drop.  The whole chunk has been read, so storing
+            // it lower down cannot clobber input still to be read.  If
+            // whitespace was dropped, out is below p and there is room
+            // for a separating space.
+            if (gap && is_token_character(last) && is_token_character(*p)) {
+                *out++ = ' ';
+            }
+            last = p[15];
+            gap = false;
+            if (out != p) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out), chunk);
+            }
+            out += 16;
+            p += 16;
+            continue;
+        }
+
+        // Only the bytes before the first quote are outside a string.
+        const unsigned consumed
+            = quotes ? static_cast<unsigned>(__builtin_ctz(quotes)) : 16;
+        keep &= (1u << consumed) - 1;
+        char bytes[16];
+        memcpy(bytes, p, 16);
+        unsigned next = 0;
+        while (keep) {
+            const unsigned i = static_cast<unsigned>(__builtin_ctz(keep));
+            keep &= keep - 1;
+            if ((gap || i != next) && is_token_character(last)
+                && is_token_character(bytes[i])) {
+                *out++ = ' ';
+            }
+            last = bytes[i];
+            *out++ = last;
+            gap = false;
+            next = i + 1;
+        }
+        gap = gap || next != consumed;
+        p += consumed;
+        if (quotes) {
+            return;
+        }
+    }
+#endif
+    while (p != end && *p != '"') {
+        const char c = *p++;
+        if (is_whitespace(c)) {
+            gap = true;
+            continue;
+        }
+        if (gap && is_token_character(last) && is_token_character(c)) {
+            *out++ = ' ';
+        }
+        last = c;
+        *out++ = c;
+        gap = false;
+    }
+}
+
+/// Returns the first quote, backslash, or control character in [p, end),
+/// or end.
+inline const char* find_string_special(const char* p, const char* end) {
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i last_control = _mm_set1_epi8(0x1f);
+    while (end - p >= 16) {
+        const __m128i chunk
+            = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        // Unsigned chunk <= 0x1f, so that bytes >= 0x80 do not match.
+        const __m128i control
+            = _mm_cmpeq_epi8(_mm_min_epu8(chunk, last_control), chunk);
+        const __m128i special = _mm_or_si128(
+            _mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash));
+        const int mask = _mm_movemask_epi8(_mm_or_si128(control, special));
+        if (mask) {
+            return p + __builtin_ctz(static_cast<unsigned>(mask));
+        }
+        p += 16;
+    }
+#endif
+    while (p != end && *p != '"' && *p != '\\'
+           && static_cast<unsigned char>(*p) >= 0x20) {
+        ++p;
+    }
+    return p;
+}
+
+inline bool is_hex_digit(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')
+        || (c >= 'A' && c <= 'F');
+}
+
+/// Copies a string's contents and closing quote from p to out unchanged.
+/// Escapes are skipped over so that \" does not end the string.  Returns
+/// false if the string is not closed or, when validating, contains a
+/// control character or an invalid escape.
+inline bool
+minify_string(char*& out, const char*& p, const char* end, bool validate) {
+    for (;;) {
+        const char* special = find_string_special(p, end);
+        out = minify_move(out, p, static_cast<size_t>(special - p));
+        p = special;
+        if (p == end) {
+            return false;
+        }
+        if (*p == '"') {
+            *out++ = *p++;
+            return true;
+        }
+        if (*p != '\\') {
+            if (validate) {
+                return false;
+            }
+            *out++ = *p++;
+            continue;
+        }
+
+        if (end - p < 2) {
+            out = minify_move(out, p, static_cast<size_t>(end - p));
+            p = end;
+            return false;
+        }
+        size_t escape_length = 2;
+        if (validate) {
+            switch (p[1]) {
+            case '"':
+            case '\\':
+            case '/':
+            case 'b':
+            case 'f':
+            case 'n':
+            case 'r':
+            case 't':
+                break;
+            case 'u':
+                if (end - p < 6 || !is_hex_digit(p[2]) || !is_hex_digit(p[3])
+                    || !is_hex_digit(p[4]) || !is_hex_digit(p[5])) {
+                    return false;
+                }
+                escape_length = 6;
+                break;
+            default:
+                return false;
+            }
+        }
+        out = minify_move(out, p, escape_length);
+        p += escape_length;
+    }
+}
+
+} // namespace internal
+
+/**
+ * Removes the whitespace between tokens of the JSON text in
+ * [data, data + length), in place, without parsing it into an AST.  The
+ * minified text starts at data; nothing past the returned length is
+ * meaningful.  Strings are copied unchanged, escapes included, so the
+ * output parses to the same document as the input.  With SSE2, the
+ * input is scanned 16 bytes at a time, and nothing is moved until the
+ * first whitespace is dropped.
+ *
+ * Without validation, any input is accepted and only whitespace outside
+ * strings is removed.  Whitespace between two tokens that would otherwise
+ * run together, as in "[1 2]" or "[tr ue]", is kept as one space, so such
+ * input stays as malformed as it was.  With validation, the result is
+ * marked invalid if a string is unterminated or holds a control
+ * character or a malformed escape, or if the minified text fails
+ * \ref measure.  Like measure, this checks the document's shape rather
+ * than everything the parser does, such as UTF-8.  Minifying stops at
+ * the first invalid string, leaving the rest of the input after it as it
+ * was.
+ */
+inline minify_result minify(char* data, size_t length, bool validate = false) {
+    char* out = data;
+    const char* p = data;
+    const char* const end = data + length;
+    bool valid = true;
+    for (;;) {
+        internal::minify_structure(out, p, end);
+        if (p == end) {
+            break;
+        }
+        *out++ = *p++;
+        if (!internal::minify_string(out, p, end, validate)) {
+            valid = !validate;
+            // Keep the rest of the input, such as it is, unchanged.
+            out = internal::minify_move(out, p, static_cast<size_t>(end - p));
+            break;
+        }
+    }
+
+    const size_t minified_length = static_cast<size_t>(out - data);
+    if (validate && valid) {
+        valid = measure(std::string_view(data, minified_length)).valid;
+    }
+    return minify_result{ minified_length, valid };
+}
+
+/// Minifies a string in place with \ref minify and shrinks it to the
+/// result.
+inline minify_result minify(std::string& text, bool validate = false) {
+    const minify_result result = minify(&text[0], text.size(), validate);
+    text.resize(result.length);
+    return result;
+}
+
+} // namespace sajson
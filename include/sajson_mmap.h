@@ -0,0 +1,424 @@
+/*
+ * Copyright (c) 2012-2017 Chad Austin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "sajson.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+
+namespace sajson {
+
+namespace internal {
+
+inline size_t get_page_size() {
+    static const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return page_size;
+}
+
+inline size_t round_up_to_page(size_t bytes, size_t page_size = get_page_size()) {
+    return (bytes + page_size - 1) & ~(page_size - 1);
+}
+
+/// Transparent huge pages on x86-64 and most arm64 kernels are 2 MiB.
+inline constexpr size_t HUGE_PAGE_SIZE = size_t(2) << 20;
+
+inline void unmap_words(size_t* p, size_t size_in_words, void* /*context*/) {
+    munmap(p, size_in_words * sizeof(size_t));
+}
+
+inline void unmap_text(char* data, size_t length) { munmap(data, length); }
+
+/// Maps the file at path privately with the given protection.  An empty
+/// file yields a null mapping of length zero, since mmap refuses empty
+/// ranges.  Returns false with errno set if the file cannot be mapped,
+/// including if it is not a regular file or claims to be empty but is
+/// not, as procfs files do.
+inline bool map_file(const char* path, int prot, char** data, size_t* length) {
+    // Nonblocking so that opening a FIFO does not wait for a writer.
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        close(fd);
+        errno = EINVAL;
+        return false;
+    }
+    *length = static_cast<size_t>(st.st_size);
+    *data = 0;
+    if (*length == 0) {
+        char byte;
+        const ssize_t n = read(fd, &byte, 1);
+        close(fd);
+        if (n != 0) {
+            if (n > 0) {
+                errno = EINVAL;
+            }
+            return false;
+        }
+        return true;
+    }
+
+    // Populating a read-only mapping maps the file's cached pages in one
+    // pass instead of taking a fault per page.  A writable private
+    // mapping is not populated, since that would copy every page up
+    // front; the kernel is only asked to start reading ahead.
+    const int populate = (prot & PROT_WRITE) ? 0 : MAP_POPULATE;
+    void* p = mmap(0, *length, prot, MAP_PRIVATE | populate, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+#ifdef MADV_WILLNEED
+    if (prot & PROT_WRITE) {
+        madvise(p, *length, MADV_WILLNEED);
+    }
+#endif
+#ifdef MADV_SEQUENTIAL
+    madvise(p, *length, MADV_SEQUENTIAL);
+#endif
+    *data = static_cast<char*>(p);
+    return true;
+}
+
+inline std::string_view get_iovec_segment(const void* segments, size_t i) {
+    const iovec& segment = static_cast<const iovec*>(segments)[i];
+    return std::string_view(
+        static_cast<const char*>(segment.iov_base), segment.iov_len);
+}
+
+} // namespace internal
+
+/// Allocation policy that reserves the same worst-case AST buffer as
+/// \ref single_allocation -- one word per input byte -- but as anonymous
+/// virtual memory.  The kernel only commits the pages the parse stack and
+/// the AST actually touch, so the parse runs without any capacity checks
+/// while resident memory stays close to \ref dynamic_allocation's.  Since
+/// the reservation already covers the worst case, the buffers never grow
+/// and nothing is ever copied.
+///
+/// Once the parse succeeds, the pages below the AST (where the parse stack
+/// lived) are unmapped and the \ref document keeps only the AST's pages.
+///
+/// POSIX only.  On Linux the reservation is made with MAP_NORESERVE so
+/// that large documents are not refused by overcommit accounting.
+///
+/// For very large documents, TLB misses while writing and later traversing
+/// the AST can dominate.  Given a huge page threshold, reservations of at
+/// least that many bytes are aligned to 2 MiB and marked MADV_HUGEPAGE so
+/// the kernel can back them with transparent huge pages.
+class mmap_allocation {
+public:
+    /// \cond INTERNAL
+
+    class stack_head {
+    public:
+        stack_head(stack_head&& other)
+            : stack_bottom(other.stack_bottom)
+            , stack_top(other.stack_top) {}
+
+        bool push(size_t element) {
+            *stack_top++ = element;
+            return true;
+        }
+
+        size_t* reserve(size_t amount, bool* success) {
+            size_t* rv = stack_top;
+            stack_top += amount;
+            *success = true;
+            return rv;
+        }
+
+        void reset(size_t new_top) { stack_top = stack_bottom + new_top; }
+
+        size_t get_size() { return static_cast<size_t>(stack_top - stack_bottom); }
+
+        size_t* get_top() { return stack_top; }
+
+        size_t* get_pointer_from_offset(size_t offset) {
+            return stack_bottom + offset;
+        }
+
+    private:
+        stack_head() = delete;
+        stack_head(const stack_head&) = delete;
+        void operator=(const stack_head&) = delete;
+
+        explicit stack_head(size_t* base)
+            : stack_bottom(base)
+            , stack_top(base) {}
+
+        size_t* const stack_bottom;
+        size_t* stack_top;
+
+        friend class mmap_allocation;
+    };
+
+    class allocator {
+    public:
+        allocator() = delete;
+        allocator(const allocator&) = delete;
+        void operator=(const allocator&) = delete;
+
+        explicit allocator(
+            size_t* mapping_,
+            size_t mapping_length_,
+            size_t page_size_,
+            size_t input_size)
+            : mapping(mapping_)
+            , mapping_length(mapping_length_)
+            , page_size(page_size_)
+            , structure_end(mapping_ + input_size)
+            , write_cursor(structure_end) {}
+
+        explicit allocator(std::nullptr_t)
+            : mapping(0)
+            , mapping_length(0)
+            , page_size(0)
+            , structure_end(0)
+            , write_cursor(0) {}
+
+        allocator(allocator&& other)
+            : mapping(other.mapping)
+            , mapping_length(other.mapping_length)
+            , page_size(other.page_size)
+            , structure_end(other.structure_end)
+            , write_cursor(other.write_cursor) {
+            other.mapping = 0;
+            other.mapping_length = 0;
+            other.structure_end = 0;
+            other.write_cursor = 0;
+        }
+
+        ~allocator() {
+            if (mapping) {
+                munmap(mapping, mapping_length);
+            }
+        }
+
+        stack_head get_stack_head(bool* success) {
+            *success = true;
+            return stack_head(mapping);
+        }
+
+        size_t get_write_offset() { return static_cast<size_t>(structure_end - write_cursor); }
+
+        size_t* get_write_pointer_of(size_t v) { return structure_end - v; }
+
+        size_t* reserve(size_t size, bool* success) {
+            *success = true;
+            write_cursor -= size;
+            return write_cursor;
+        }
+
+        size_t* get_ast_root() { return write_cursor; }
+
+        internal::ownership transfer_ownership() {
+            // Give the stack's pages back; keep the page holding the AST
+            // root and everything above it.  With huge pages, trim at
+            // huge page granularity so the kernel does not split them.
+            char* base = reinterpret_cast<char*>(mapping);
+            char* end = base + mapping_length;
+            const size_t ast_offset = static_cast<size_t>(
+                reinterpret_cast<char*>(write_cursor) - base);
+            char* keep = base + (ast_offset & ~(page_size - 1));
+            if (keep > base) {
+                munmap(base, static_cast<size_t>(keep - base));
+            }
+
+            mapping = 0;
+            mapping_length = 0;
+            structure_end = 0;
+            write_cursor = 0;
+            return internal::ownership(
+                reinterpret_cast<size_t*>(keep),
+                static_cast<size_t>(end - keep) / sizeof(size_t),
+                &internal::unmap_words,
+                0);
+        }
+
+    private:
+        size_t* mapping;
+        size_t mapping_length; // in bytes
+        size_t page_size;
+        size_t* structure_end;
+        size_t* write_cursor;
+    };
+
+    /// \endcond
+
+    /// Reserve address space with the system's normal page size.
+    mmap_allocation()
+        : huge_page_threshold(0) {}
+
+    /// Back reservations of at least \p huge_page_threshold_ bytes (eight
+    /// times the input size on 64-bit platforms) with transparent huge
+    /// pages where the kernel supports them.  Zero disables huge pages.
+    explicit mmap_allocation(size_t huge_page_threshold_)
+        : huge_page_threshold(huge_page_threshold_) {}
+
+    /// \cond INTERNAL
+
+    allocator
+    make_allocator(size_t input_document_size_in_bytes, bool* succeeded) const {
+        const size_t bytes = std::max<size_t>(input_document_size_in_bytes, 1)
+            * sizeof(size_t);
+        const bool huge = use_huge_pages(bytes);
+        const size_t page_size
+            = huge ? internal::HUGE_PAGE_SIZE : internal::get_page_size();
+        const size_t length = internal::round_up_to_page(bytes, page_size);
+        // Huge pages need an aligned range: over-reserve by one huge page
+        // and trim the misaligned head and tail.
+        const size_t reserved = huge ? length + page_size : length;
+        void* p = mmap(
+            0,
+            reserved,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+            -1,
+            0);
+        if (p == MAP_FAILED) {
+            *succeeded = false;
+            return allocator(nullptr);
+        }
+        char* base = static_cast<char*>(p);
+        if (huge) {
+            char* aligned = reinterpret_cast<char*>(internal::round_up_to_page(
+                reinterpret_cast<uintptr_t>(base), page_size));
+            if (aligned > base) {
+                munmap(base, static_cast<size_t>(aligned - base));
+            }
+            char* tail = aligned + length;
+            char* reserved_end = base + reserved;
+            if (reserved_end > tail) {
+                munmap(tail, static_cast<size_t>(reserved_end - tail));
+            }
+            base = aligned;
+#ifdef MADV_HUGEPAGE
+            // Advisory only: if THP is disabled the range simply keeps
+            // using normal pages.
+            madvise(base, length, MADV_HUGEPAGE);
+#endif
+        }
+        *succeeded = true;
+        return allocator(
+            reinterpret_cast<size_t*>(base),
+            length,
+            page_size,
+            input_document_size_in_bytes);
+    }
+
+    /// \endcond
+
+private:
+    bool use_huge_pages(size_t bytes) const {
+#ifdef MADV_HUGEPAGE
+        return huge_page_threshold && bytes >= huge_page_threshold;
+#else
+        (void)bytes;
+        return false;
+#endif
+    }
+
+    size_t huge_page_threshold;
+};
+
+/**
+ * Parses the JSON file at \p path without reading it into a separate buffer.
+ * The file is mapped copy-on-write (MAP_PRIVATE), so the file itself is
+ * never modified.  The in-situ parse writes a NUL over every string's
+ * closing quote, though, so nearly every page holding a string is copied
+ * when the parse reaches it; only pages without strings, such as long runs
+ * of numbers, stay shared with the page cache.  What is saved is the
+ * up-front read into a separate buffer: pages are copied as the parse
+ * reaches them.  On Linux the mapping is marked MADV_WILLNEED and
+ * MADV_SEQUENTIAL.
+ *
+ * The returned \ref document owns the mapping.  If the file cannot be
+ * opened or mapped, or is not a regular file, the document's error is
+ * ERROR_CANNOT_READ_FILE and errno describes the failure.  If the
+ * mapping's ownership cannot be allocated, it is ERROR_OUT_OF_MEMORY.
+ */
+template <typename AllocationStrategy>
+document parse_file(const AllocationStrategy& strategy, const char* path) {
+    char* data;
+    size_t length;
+    if (!internal::map_file(path, PROT_READ | PROT_WRITE, &data, &length)) {
+        return document::_internal_make_error(ERROR_CANNOT_READ_FILE);
+    }
+    if (length == 0) {
+        // An empty file simply has no root.
+        return parse(strategy, mutable_string_view());
+    }
+
+    mutable_string_view text(
+        length, data, &internal::unmap_text, std::nothrow);
+    if (!text.get_data()) {
+        return document::_internal_make_error(ERROR_OUT_OF_MEMORY);
+    }
+    return parse(strategy, text);
+}
+
+/**
+ * Parses one JSON text from the buffers of an iovec array, such as those a
+ * request body was read into with readv() or recvmsg().  See the
+ * std::string_view overload of parse_segments() for how the buffers are
+ * referenced; they are never written.
+ */
+template <typename AllocationStrategy>
+document parse_segments(
+    const AllocationStrategy& strategy, const iovec* segments, size_t count) {
+    size_t total_length = 0;
+    for (size_t i = 0; i < count; ++i) {
+        total_length += segments[i].iov_len;
+    }
+    internal::segment_list list
+        = { segments, count, &internal::get_iovec_segment, total_length };
+    return internal::parse_segment_list(strategy, list);
+}
+
+} // namespace sajson
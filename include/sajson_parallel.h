@@ -0,0 +1,475 @@
+/*
+ * Copyright (c) 2012-2017 Chad Austin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "sajson_dump.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace sajson {
+
+/// Tuning for \ref dump_parallel.
+struct parallel_dump_options {
+    parallel_dump_options()
+        : thread_count(std::max(1u, std::thread::hardware_concurrency()))
+        , chunk_words(16384) {}
+
+    /// The number of threads that serialize, including the caller.
+    size_t thread_count;
+    /// About how much of the document, measured in AST words, one task
+    /// serializes.  Arrays and objects smaller than this are never split.
+    size_t chunk_words;
+};
+
+/// Tuning for \ref dump_ndjson.
+struct ndjson_options {
+    ndjson_options()
+        : thread_count(std::max(1u, std::thread::hardware_concurrency()))
+        , values_per_chunk(256)
+        , memory_budget(64 << 20)
+        , ordered(true) {}
+
+    /// The number of threads that serialize.  The calling thread only
+    /// writes.
+    size_t thread_count;
+    /// How many consecutive values each thread serializes into one buffer.
+    size_t values_per_chunk;
+    /// Once this many serialized bytes are waiting to be written, threads
+    /// stop starting new chunks until the output catches up.
+    size_t memory_budget;
+    /// If false, chunks are written as they finish rather than in input
+    /// order.  Lines within a chunk stay in order.
+    bool ordered;
+};
+
+namespace internal {
+
+/// One piece of the output.  Elements [begin, end) of container are
+/// serialized into output by a worker; when begin == end, output holds
+/// brackets and keys written while planning.
+struct dump_task {
+    dump_task()
+        : begin(0)
+        , end(0) {}
+
+    dump_task(const value& container_, size_t begin_, size_t end_)
+        : container(container_)
+        , begin(begin_)
+        , end(end_) {}
+
+    value container;
+    size_t begin;
+    size_t end;
+    std::string output;
+};
+
+/// Returns one past the last AST word of a value and its descendants.
+/// Values are written to the AST downward in document order, so that is
+/// where the value's leftmost descendant ends.
+inline const size_t* ast_top(const value& v) {
+    switch (v.get_type()) {
+    case TYPE_ARRAY:
+        return v.get_length() ? ast_top(v.get_array_element(0))
+                              : v._internal_get_payload() + 1;
+    case TYPE_OBJECT:
+        return v.get_length() ? ast_top(v.get_object_value(0))
+                              : v._internal_get_payload() + 1;
+    case TYPE_INTEGER:
+        return v._internal_get_payload() + 1;
+    case TYPE_DOUBLE:
+        return v._internal_get_payload() + 8 / sizeof(size_t);
+    case TYPE_STRING:
+        return v._internal_get_payload() + 2;
+    default:
+        return v._internal_get_payload();
+    }
+}
+
+inline size_t ast_words(const size_t* top, const size_t* bottom) {
+    return top > bottom ? static_cast<size_t>(top - bottom) : 0;
+}
+
+inline std::string& literal_task(std::vector<dump_task>& tasks) {
+    if (tasks.empty() || tasks.back().begin != tasks.back().end) {
+        tasks.emplace_back();
+    }
+    return tasks.back().output;
+}
+
+inline void add_range_task(
+    std::vector<dump_task>& tasks,
+    const value& container,
+    size_t begin,
+    size_t end) {
+    if (begin == end) {
+        return;
+    }
+    tasks.emplace_back(container, begin, end);
+}
+
+/// Splits a container into runs of elements of about chunk_words each,
+/// recursing into elements that are larger than that on their own.
+/// The AST is small next to the output, so this costs little compared to
+/// serializing.
+inline void plan_dump(
+    std::vector<dump_task>& tasks,
+    const value& container,
+    size_t chunk_words) {
+    const bool is_object = container.get_type() == TYPE_OBJECT;
+    const size_t length = container.get_length();
+
+    literal_task(tasks) += is_object ? '{' : '[';
+    size_t range_begin = 0;
+    size_t range_words = 0;
+    const size_t* previous = ast_top(container);
+    for (size_t i = 0; i < length; ++i) {
+        const value element = is_object ? container.get_object_value(i)
+                                        : container.get_array_element(i);
+        const size_t* bottom = element._internal_get_payload();
+        const size_t words = ast_words(previous, bottom);
+        previous = bottom;
+
+        const type t = element.get_type();
+        if (words > chunk_words && (t == TYPE_ARRAY || t == TYPE_OBJECT)
+            && element.get_length() > 0) {
+            add_range_task(tasks, container, range_begin, i);
+            std::string& literal = literal_task(tasks);
+            if (i > 0) {
+                literal += ',';
+            }
+            if (is_object) {
+                dump_string(literal, container.get_object_key(i));
+                literal += ':';
+            }
+            plan_dump(tasks, element, chunk_words);
+            range_begin = i + 1;
+            range_words = 0;
+            continue;
+        }
+
+        // Count every element, so runs of null and true still get split.
+        range_words += words + 1;
+        if (range_words >= chunk_words) {
+            add_range_task(tasks, container, range_begin, i + 1);
+            range_begin = i + 1;
+            range_words = 0;
+        }
+    }
+    add_range_task(tasks, container, range_begin, length);
+    literal_task(tasks) += is_object ? '}' : ']';
+}
+
+inline void run_dump_task(dump_task& task) {
+    const bool is_object = task.container.get_type() == TYPE_OBJECT;
+    std::string& o = task.output;
+    for (size_t i = task.begin; i < task.end; ++i) {
+        if (i > 0) {
+            o += ',';
+        }
+        if (is_object) {
+            dump_string(o, task.container.get_object_key(i));
+            o += ':';
+            dump(o, task.container.get_object_value(i), -1);
+        } else {
+            dump(o, task.container.get_array_element(i), -1);
+        }
+    }
+}
+
+/// Fills tasks with the compact serialization of v, in order.  Returns
+/// false, leaving tasks empty, if v is too small to be worth splitting or
+/// only one thread was asked for.
+inline bool dump_tasks(
+    std::vector<dump_task>& tasks,
+    const value& v,
+    const parallel_dump_options& options) {
+    const type t = v.get_type();
+    if (options.thread_count <= 1 || (t != TYPE_ARRAY && t != TYPE_OBJECT)
+        || ast_words(ast_top(v), v._internal_get_payload())
+            <= options.chunk_words) {
+        return false;
+    }
+
+    plan_dump(tasks, v, std::max<size_t>(options.chunk_words, 1));
+
+    std::atomic<size_t> next(0);
+    const auto work = [&] {
+        for (;;) {
+            const size_t i = next.fetch_add(1, std::memory_order_relaxed);
+            if (i >= tasks.size()) {
+                return;
+            }
+            run_dump_task(tasks[i]);
+        }
+    };
+
+    const size_t thread_count = std::min(options.thread_count, tasks.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; ++i) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return true;
+}
+
+/// Chunks of NDJSON shared between the serializing threads and the
+/// thread writing them out.
+class ndjson_queue {
+public:
+    ndjson_queue(size_t chunk_count, const ndjson_options& options_)
+        : options(options_)
+        , chunks(chunk_count)
+        , ready(chunk_count)
+        , next_chunk(0)
+        , buffered(0) {}
+
+    ndjson_queue(const ndjson_queue&) = delete;
+    void operator=(const ndjson_queue&) = delete;
+
+    /// Claims the next chunk to serialize, waiting while the memory budget
+    /// is used up, and hands out a buffer to serialize it into.  Returns
+    /// false when every chunk has been claimed.
+    bool claim(size_t* index, std::string* buffer) {
+        std::unique_lock<std::mutex> lock(mutex);
+        space.wait(lock, [&] {
+            return next_chunk == chunks.size() || buffered == 0
+                || buffered < options.memory_budget;
+        });
+        if (next_chunk == chunks.size()) {
+            return false;
+        }
+        *index = next_chunk++;
+        if (!spare.empty()) {
+            buffer->swap(spare.back());
+            spare.pop_back();
+        }
+        buffer->clear();
+        return true;
+    }
+
+    void finish(size_t index, std::string* buffer) {
+        std::lock_guard<std::mutex> lock(mutex);
+        buffered += buffer->size();
+        chunks[index].swap(*buffer);
+        if (options.ordered) {
+            ready[index] = true;
+        } else {
+            finished.push_back(index);
+        }
+        available.notify_one();
+    }
+
+    /// Waits for the next chunk to write: the one after the previous in
+    /// ordered mode, otherwise whichever finished first.
+    void take(size_t written, std::string* buffer) {
+        std::unique_lock<std::mutex> lock(mutex);
+        size_t index = written;
+        if (options.ordered) {
+            available.wait(lock, [&] { return ready[index]; });
+        } else {
+            available.wait(lock, [&] { return !finished.empty(); });
+            index = finished.front();
+            finished.pop_front();
+        }
+        buffer->swap(chunks[index]);
+    }
+
+    /// Returns a written chunk's buffer for reuse and frees its share of
+    /// the budget.
+    void release(std::string* buffer) {
+        std::lock_guard<std::mutex> lock(mutex);
+        buffered -= buffer->size();
+        spare.emplace_back();
+        spare.back().swap(*buffer);
+        space.notify_all();
+    }
+
+private:
+    const ndjson_options& options;
+    std::mutex mutex;
+    std::condition_variable space;
+    std::condition_variable available;
+    std::vector<std::string> chunks;
+    std::vector<bool> ready;
+    std::deque<size_t> finished;
+    std::vector<std::string> spare;
+    size_t next_chunk;
+    size_t buffered;
+};
+
+} // namespace internal
+
+/**
+ * Writes values[0, count) to 'o' as newline-delimited JSON: each value
+ * compactly, as dump(o, value) does, followed by '\n'.
+ *
+ * options.thread_count threads each serialize options.values_per_chunk
+ * values at a time into a buffer of their own, while the calling thread
+ * appends finished buffers to 'o', in input order unless
+ * options.ordered is false.  When 'o' falls behind, threads wait instead
+ * of starting new chunks once options.memory_budget bytes are queued, so
+ * at most that much plus one chunk per thread is held in memory.
+ * Buffers are reused from chunk to chunk.
+ */
+template <typename O>
+void dump_ndjson(
+    O& o,
+    const value* values,
+    size_t count,
+    const ndjson_options& options = ndjson_options()) {
+    const size_t per_chunk = std::max<size_t>(options.values_per_chunk, 1);
+    const size_t chunk_count = (count + per_chunk - 1) / per_chunk;
+    internal::ndjson_queue queue(chunk_count, options);
+
+    const auto work = [&] {
+        size_t index;
+        std::string buffer;
+        while (queue.claim(&index, &buffer)) {
+            const size_t end = std::min(count, (index + 1) * per_chunk);
+            for (size_t i = index * per_chunk; i < end; ++i) {
+                dump(buffer, values[i], -1);
+                buffer += '\n';
+            }
+            queue.finish(index, &buffer);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    const size_t thread_count
+        = std::min(std::max<size_t>(options.thread_count, 1), chunk_count);
+    for (size_t i = 0; i < thread_count; ++i) {
+        threads.emplace_back(work);
+    }
+    std::string buffer;
+    for (size_t written = 0; written < chunk_count; ++written) {
+        queue.take(written, &buffer);
+        o += std::string_view(buffer);
+        queue.release(&buffer);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+template <typename O>
+void dump_ndjson(
+    O& o,
+    const std::vector<value>& values,
+    const ndjson_options& options = ndjson_options()) {
+    dump_ndjson(o, values.data(), values.size(), options);
+}
+
+/**
+ * Dumps a sajson::value compactly, as dump(o, value) does, with the work
+ * spread over options.thread_count threads.  The output is identical.
+ *
+ * Arrays and objects larger than options.chunk_words AST words are split
+ * into runs of elements, each serialized into its own buffer by a pool of
+ * threads, and the buffers are appended to 'o' in order once all are
+ * done.  The whole output is therefore held in memory once more.  Small
+ * values are dumped on the calling thread.
+ */
+template <typename O>
+void dump_parallel(
+    O& o,
+    const value& v,
+    const parallel_dump_options& options = parallel_dump_options()) {
+    std::vector<internal::dump_task> tasks;
+    if (!internal::dump_tasks(tasks, v, options)) {
+        dump(o, v, -1);
+        return;
+    }
+    for (const auto& task : tasks) {
+        o += std::string_view(task.output);
+    }
+}
+
+/// Serializes a sajson::value to a string like to_string(), using
+/// dump_parallel().
+inline std::string to_string_parallel(
+    const value& v,
+    const parallel_dump_options& options = parallel_dump_options()) {
+    std::vector<internal::dump_task> tasks;
+    if (!internal::dump_tasks(tasks, v, options)) {
+        return to_string(v);
+    }
+    size_t length = 0;
+    for (const auto& task : tasks) {
+        length += task.output.size();
+    }
+    std::string result;
+    result.reserve(length);
+    for (const auto& task : tasks) {
+        result += task.output;
+    }
+    return result;
+}
+
+#if SAJSON_HAVE_WRITEV
+/// Serializes a sajson::value to a file descriptor like write(fd, value),
+/// using dump_parallel().  The threads' buffers are handed to writev()
+/// as they are instead of being joined first.  Returns the number of
+/// bytes written.
+inline size_t write_parallel(
+    int fd,
+    const value& v,
+    const parallel_dump_options& options = parallel_dump_options()) {
+    std::vector<internal::dump_task> tasks;
+    if (!internal::dump_tasks(tasks, v, options)) {
+        return write(fd, v);
+    }
+    FdOut fo(fd);
+    for (const auto& task : tasks) {
+        internal::dump_reference(fo, task.output);
+    }
+    fo.flush();
+    return fo.size();
+}
+
+/// Writes values as newline-delimited JSON to a file descriptor with
+/// dump_ndjson().  A slow descriptor holds the serializing threads back
+/// rather than letting buffers pile up.  Returns the number of bytes
+/// written.
+inline size_t write_ndjson(
+    int fd,
+    const std::vector<value>& values,
+    const ndjson_options& options = ndjson_options()) {
+    FdOut fo(fd);
+    dump_ndjson(fo, values, options);
+    fo.flush();
+    return fo.size();
+}
+#endif
+
+} // namespace sajson
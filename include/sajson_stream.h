@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2012-2017 Chad Austin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "sajson.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+namespace sajson {
+
+/**
+ * Iterates over the elements of a top-level JSON array read from a file
+ * descriptor, for files too large to hold as one \ref document.  The input
+ * is read in chunks, and each element is parsed on its own into an AST
+ * buffer that is reused for the next element, so peak memory is bounded by
+ * the largest element rather than by the file.
+ *
+ *     sajson::element_reader reader(fd);
+ *     while (reader.next()) {
+ *         process(reader.get_value());
+ *     }
+ *     if (!reader.is_valid()) {
+ *         report(reader.get_error_message_as_cstring());
+ *     }
+ *
+ * The reader does not own the file descriptor.
+ */
+class element_reader {
+public:
+    static constexpr size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+    explicit element_reader(int fd_, size_t chunk_size_ = DEFAULT_CHUNK_SIZE)
+        : fd(fd_)
+        , chunk_size(chunk_size_ ? chunk_size_ : 1)
+        , buffer(0)
+        , capacity(0)
+        , end(0)
+        , cursor(0)
+        , mark(0)
+        , separator_index(0)
+        , separator(0)
+        , words(0)
+        , word_capacity(0)
+        , state(before_array)
+        , at_eof(false)
+        , error_code(ERROR_NO_ERROR)
+        , error_arg(0) {}
+
+    ~element_reader() {
+        // Drop the element's AST before the buffers it points into.
+        current = document();
+        delete[] words;
+        delete[] buffer;
+    }
+
+    /// Parses the next element.  Returns false at the end of the array or
+    /// if reading or parsing failed, in which case is_valid() is false.
+    /// Values from the previous element must not be used afterwards.
+    bool next() {
+        if (state != in_array) {
+            if (state != before_array) {
+                return false;
+            }
+            if (!skip_whitespace()) {
+                return fail(at_eof ? ERROR_MISSING_ROOT_ELEMENT : error_code);
+            }
+            if (buffer[cursor] != '[') {
+                return fail(ERROR_BAD_ROOT);
+            }
+            ++cursor;
+            if (!skip_whitespace()) {
+                return fail(at_eof ? ERROR_UNEXPECTED_END : error_code);
+            }
+            state = in_array;
+            if (buffer[cursor] == ']') {
+                return finish();
+            }
+        } else {
+            // The previous element's closing bracket replaced its
+            // separator.
+            buffer[separator_index] = separator;
+            if (!skip_whitespace()) {
+                return fail(at_eof ? ERROR_UNEXPECTED_END : error_code);
+            }
+            if (buffer[cursor] == ']') {
+                return finish();
+            }
+            if (buffer[cursor] != ',') {
+                return fail(ERROR_EXPECTED_COMMA);
+            }
+            ++cursor;
+            if (!skip_whitespace()) {
+                return fail(at_eof ? ERROR_UNEXPECTED_END : error_code);
+            }
+        }
+        if (buffer[cursor] == ']' || buffer[cursor] == ',') {
+            return fail(ERROR_EXPECTED_VALUE);
+        }
+
+        // Keep the byte before the element: it becomes the '[' that wraps
+        // the element into an array the parser accepts as a root.
+        mark = cursor - 1;
+        const size_t element_end = find_element_end();
+        if (!element_end) {
+            return fail(at_eof ? ERROR_UNEXPECTED_END : error_code);
+        }
+        const size_t length = element_end - mark + 1;
+
+        // A single_allocation never needs more words than input bytes.
+        current = document();
+        if (word_capacity < length) {
+            delete[] words;
+            word_capacity = std::max(length, 2 * word_capacity);
+            words = new (std::nothrow) size_t[word_capacity];
+            if (!words) {
+                word_capacity = 0;
+                return fail(ERROR_OUT_OF_MEMORY);
+            }
+        }
+
+        separator_index = element_end;
+        separator = buffer[element_end];
+        buffer[mark] = '[';
+        buffer[element_end] = ']';
+        current = parse(
+            single_allocation(words, word_capacity),
+            mutable_string_view(length, buffer + mark));
+        cursor = element_end;
+        mark = cursor;
+        if (!current.is_valid()) {
+            error_arg = current._internal_get_error_argument();
+            return fail(current._internal_get_error_code());
+        }
+        return true;
+    }
+
+    /// The element most recently returned by next().
+    value get_value() const { return current.get_root().get_array_element(0); }
+
+    /// Returns false if reading or parsing failed.
+    bool is_valid() const { return error_code == ERROR_NO_ERROR; }
+
+    /// If not is_valid(), returns a null-terminated C string indicating why
+    /// reading failed.  If it was ERROR_CANNOT_READ_FILE, errno describes the
+    /// failure.
+    const char* get_error_message_as_cstring() const {
+        if (error_code == ERROR_NO_ERROR) {
+            return "";
+        }
+        return internal::get_error_message(error_code, error_arg);
+    }
+
+    /// \cond INTERNAL
+
+    // WARNING: Internal function which is subject to change
+    error _internal_get_error_code() const { return error_code; }
+
+    /// \endcond
+
+private:
+    element_reader(const element_reader&) = delete;
+    void operator=(const element_reader&) = delete;
+
+    enum reader_state { before_array, in_array, finished };
+
+    bool fail(error code) {
+        state = finished;
+        error_code = code;
+        return false;
+    }
+
+    // After the closing bracket only whitespace may follow.
+    bool finish() {
+        ++cursor;
+        mark = cursor;
+        state = finished;
+        if (skip_whitespace()) {
+            return fail(ERROR_EXPECTED_END_OF_INPUT);
+        }
+        return false;
+    }
+
+    // Advances the cursor to the next non-whitespace byte, reading more
+    // input as needed.  Returns false at the end of the input or if
+    // reading failed.
+    bool skip_whitespace() {
+        for (;;) {
+            while (cursor != end) {
+                if (!internal::is_whitespace(buffer[cursor])) {
+                    return true;
+                }
+                ++cursor;
+            }
+            // The byte before the cursor may still be needed to wrap
+            // the next element.
+            mark = cursor ? cursor - 1 : 0;
+            if (!fill()) {
+                return false;
+            }
+        }
+    }
+
+    // Returns the index one past the element starting at the cursor, or 0
+    // if the input ended first.  Only strings and nesting are tracked here;
+    // the parser validates the element afterwards.
+    size_t find_element_end() {
+        size_t p = cursor;
+        size_t depth = 0;
+        bool in_string = false;
+        bool escaped = false;
+        for (;; ++p) {
+            if (p == end) {
+                const size_t base = mark;
+                if (!fill()) {
+                    return 0;
+                }
+                // fill() may have moved the unconsumed bytes down.
+                p -= base - mark;
+            }
+            const char c = buffer[p];
+            if (in_string) {
+                if (escaped) {
+                    escaped = false;
+                } else if (c == '\\') {
+                    escaped = true;
+                } else if (c == '"') {
+                    in_string = false;
+                    if (depth == 0) {
+                        return p + 1;
+                    }
+                }
+            } else if (c == '"') {
+                in_string = true;
+            } else if (c == '[' || c == '{') {
+                ++depth;
+            } else if (c == ']' || c == '}') {
+                if (depth == 0) {
+                    return p;
+                }
+                if (--depth == 0) {
+                    return p + 1;
+                }
+            } else if (depth == 0 && (c == ',' || internal::is_whitespace(c))) {
+                return p;
+            }
+        }
+    }
+
+    // Reads another chunk after end.  Bytes before mark are no longer
+    // needed and are discarded to make room; the cursor moves with the
+    // remaining bytes.  One byte past the data is always kept free for the
+    // bracket that closes a wrapped element.
+    bool fill() {
+        if (at_eof) {
+            return false;
+        }
+        if (capacity - end < chunk_size + 1) {
+            if (mark) {
+                memmove(buffer, buffer + mark, end - mark);
+                end -= mark;
+                cursor -= mark;
+                mark = 0;
+            }
+            if (capacity - end < chunk_size + 1) {
+                const size_t new_capacity
+                    = std::max(end + chunk_size + 1, 2 * capacity);
+                char* new_buffer = new (std::nothrow) char[new_capacity];
+                if (!new_buffer) {
+                    error_code = ERROR_OUT_OF_MEMORY;
+                    return false;
+                }
+                if (buffer) {
+                    memcpy(new_buffer, buffer, end);
+                    delete[] buffer;
+                }
+                buffer = new_buffer;
+                capacity = new_capacity;
+            }
+        }
+
+        ssize_t n;
+        do {
+            n = read(fd, buffer + end, capacity - end - 1);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            error_code = ERROR_CANNOT_READ_FILE;
+            return false;
+        }
+        if (n == 0) {
+            at_eof = true;
+            return false;
+        }
+        end += static_cast<size_t>(n);
+        return true;
+    }
+
+    const int fd;
+    const size_t chunk_size;
+
+    char* buffer;
+    size_t capacity;
+    size_t end; // of the bytes read so far
+    size_t cursor;
+    size_t mark; // bytes before this may be discarded
+    size_t separator_index;
+    char separator;
+
+    size_t* words; // the current element's AST
+    size_t word_capacity;
+    document current;
+
+    reader_state state;
+    bool at_eof;
+    error error_code;
+    int error_arg;
+};
+
+} // namespace sajson
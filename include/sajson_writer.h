@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2012-2017 Chad Austin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "sajson_dump.h"
+
+#include <cstddef>
+#include <type_traits>
+#ifndef NDEBUG
+#include <vector>
+#endif
+
+namespace sajson {
+
+/**
+ * Emits JSON token by token to an output with the same `operator+=`
+ * interface as \ref dump, such as `std::string`, `FileOut` or `FdOut`.
+ *
+ *     std::string out;
+ *     sajson::writer<std::string> w(out);
+ *     w.begin_object();
+ *     w.key("id");
+ *     w.value(42);
+ *     w.key("tags");
+ *     w.begin_array();
+ *     w.value("a");
+ *     w.end_array();
+ *     w.end_object();
+ *
+ * Output is compact.  Commas are inserted automatically, strings are
+ * escaped, and numbers are formatted as in \ref dump.  Strings are always
+ * copied into the output, so they may be temporaries.
+ *
+ * Nesting (a key where a value belongs, mismatched ends, a second root) is
+ * only checked with assert() in debug builds.  Release builds keep no
+ * state beyond one flag and never allocate.
+ */
+template <typename O>
+class writer {
+public:
+    explicit writer(O& out_)
+        : out(out_)
+        , need_comma(false) {}
+
+    writer(const writer&) = delete;
+    void operator=(const writer&) = delete;
+
+    void begin_object() {
+        begin_value();
+        out += '{';
+        need_comma = false;
+        push(object_key);
+    }
+
+    void end_object() {
+        pop(object_key);
+        out += '}';
+        end_value();
+    }
+
+    void begin_array() {
+        begin_value();
+        out += '[';
+        need_comma = false;
+        push(array_element);
+    }
+
+    void end_array() {
+        pop(array_element);
+        out += ']';
+        end_value();
+    }
+
+    /// Writes an object key.  The next call must write its value.
+    void key(std::string_view k) {
+#ifndef NDEBUG
+        assert(!states.empty() && states.back() == object_key);
+        states.back() = object_value;
+#endif
+        if (need_comma) {
+            out += ',';
+        }
+        internal::dump_string(out, k, false);
+        out += ':';
+        need_comma = false;
+    }
+
+    void value(std::string_view s) {
+        begin_value();
+        internal::dump_string(out, s, false);
+        end_value();
+    }
+
+    void value(const char* s) { value(std::string_view(s)); }
+
+    template <typename T>
+    std::enable_if_t<std::is_integral_v<T>> value(T i) {
+        begin_value();
+        internal::dump_integer(out, i);
+        end_value();
+    }
+
+    void value(double d) {
+        begin_value();
+        internal::dump_double(out, d);
+        end_value();
+    }
+
+    void value(bool b) {
+        begin_value();
+        out += b ? "true"sv : "false"sv;
+        end_value();
+    }
+
+    void value(std::nullptr_t) {
+        begin_value();
+        out += "null"sv;
+        end_value();
+    }
+
+    /// Writes a parsed value.  Its document must outlive the output, since
+    /// outputs like `FdOut` refer to its strings instead of copying them.
+    void value(const sajson::value& v) {
+        begin_value();
+        dump(out, v);
+        end_value();
+    }
+
+private:
+    enum state : char { array_element, object_key, object_value, root_done };
+
+    void begin_value() {
+#ifndef NDEBUG
+        assert(
+            states.empty() || states.back() == array_element
+            || states.back() == object_value);
+#endif
+        if (need_comma) {
+            out += ',';
+        }
+    }
+
+    void end_value() {
+#ifndef NDEBUG
+        if (states.empty()) {
+            states.push_back(root_done);
+        } else if (states.back() == object_value) {
+            states.back() = object_key;
+        }
+#endif
+        need_comma = true;
+    }
+
+    void push([[maybe_unused]] state s) {
+#ifndef NDEBUG
+        states.push_back(s);
+#endif
+    }
+
+    void pop([[maybe_unused]] state s) {
+#ifndef NDEBUG
+        assert(!states.empty() && states.back() == s);
+        states.pop_back();
+#endif
+    }
+
+    O& out;
+    bool need_comma;
+#ifndef NDEBUG
+    std::vector<state> states;
+#endif
+};
+
+} // namespace sajson
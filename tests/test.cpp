@@ -1,12 +1,67 @@
 // included first to verify sajson includes.
 #include <sajson.h>
+#include <sajson_binary.h>
+#include <sajson_compressed.h>
+#include <sajson_dump.h>
+#include <sajson_ingest.h>
+#include <sajson_minify.h>
+#include <sajson_mmap.h>
 #include <sajson_ostream.h>
+#include <sajson_parallel.h>
+#include <sajson_stream.h>
+#include <sajson_writer.h>
 
 using namespace std::literals;
 
 #include <UnitTest++.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <random>
+#include <thread>
+
+#include <malloc.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Every heap allocation is counted, whatever makes it, so that tests can
+// check how much memory a parse holds at its peak.
+static std::atomic<size_t> heap_in_use;
+static std::atomic<size_t> heap_peak;
+
+static void* count_allocation(void* p) {
+    if (p) {
+        const size_t in_use = heap_in_use += malloc_usable_size(p);
+        size_t peak = heap_peak.load();
+        while (in_use > peak && !heap_peak.compare_exchange_weak(peak, in_use)) {
+        }
+    }
+    return p;
+}
+
+void* operator new(size_t size) {
+    void* p = count_allocation(malloc(size ? size : 1));
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return count_allocation(malloc(size ? size : 1));
+}
+
+void operator delete(void* p) noexcept {
+    if (p) {
+        heap_in_use -= malloc_usable_size(p);
+        free(p);
+    }
+}
+
+void operator delete(void* p, size_t) noexcept {
+    operator delete(p);
+}
 
 using sajson::document;
 using sajson::TYPE_ARRAY;
@@ -36,6 +91,8 @@ inline bool success(const document& doc) {
 
 const size_t ast_buffer_size = 8096;
 size_t ast_buffer[ast_buffer_size];
+// Small enough that most tests spill the hybrid allocator to the heap.
+size_t hybrid_buffer[8];
 
 /**
  * Modern clang complains about obvious self-assignment, but we want
@@ -64,6 +121,21 @@ const T& self_ref(const T& v) {
             return sajson::parse(sajson::bounded_allocation(ast_buffer, ast_buffer_size), literal); \
         });                                                              \
     }                                                                    \
+    TEST(hybrid_allocation_##name) {                                     \
+        name##internal([](std::string_view literal) {                    \
+            return sajson::parse(sajson::hybrid_allocation(hybrid_buffer), literal); \
+        });                                                              \
+    }                                                                    \
+    TEST(pmr_allocation_##name) {                                        \
+        name##internal([](std::string_view literal) {                    \
+            return sajson::parse(sajson::pmr_allocation(), literal);     \
+        });                                                              \
+    }                                                                    \
+    TEST(mmap_allocation_##name) {                                       \
+        name##internal([](std::string_view literal) {                    \
+            return sajson::parse(sajson::mmap_allocation(), literal);    \
+        });                                                              \
+    }                                                                    \
     static void name##internal([[maybe_unused]] sajson::document (*parse)(std::string_view))
 
 ABSTRACT_TEST(empty_array) {
@@ -1081,6 +1153,912 @@ SUITE(allocator_tests) {
         CHECK(!document.is_valid());
         CHECK_EQUAL(sajson::ERROR_OUT_OF_MEMORY, document._internal_get_error_code());
     }
+
+    TEST(hybrid_allocation_fits_in_buffer) {
+        size_t buffer[5];
+        buffer[4] = 0xdeadbeef;
+        const auto& document = sajson::parse(sajson::hybrid_allocation(buffer), "[[]]");
+        assert(success(document));
+        const auto& root = document.get_root();
+        CHECK_EQUAL(TYPE_ARRAY, root.get_type());
+        CHECK_EQUAL(1u, root.get_length());
+        // The AST was built in place, ending at the top of the buffer.
+        CHECK(buffer[4] != 0xdeadbeef);
+    }
+
+    TEST(hybrid_allocation_spills_to_heap) {
+        size_t buffer[4];
+        const auto& document = sajson::parse(
+            sajson::hybrid_allocation(buffer), "[[1,2,3],{\"a\":[4,5,6]},\"x\"]");
+        assert(success(document));
+        const auto& root = document.get_root();
+        CHECK_EQUAL(TYPE_ARRAY, root.get_type());
+        CHECK_EQUAL(3u, root.get_length());
+        CHECK_EQUAL(3, root.get_array_element(0).get_array_element(2).get_integer_value());
+        const auto& inner = root.get_array_element(1).get_value_of_key("a");
+        CHECK_EQUAL(6, inner.get_array_element(2).get_integer_value());
+        CHECK_EQUAL("x", root.get_array_element(2).as_string());
+    }
+
+    TEST(hybrid_allocation_deep_nesting_spills_stack) {
+        std::string input(1000, '[');
+        input.append(1000, ']');
+        size_t buffer[16];
+        const auto& document = sajson::parse(sajson::hybrid_allocation(buffer), input);
+        assert(success(document));
+        CHECK_EQUAL(1u, document.get_root().get_length());
+    }
+
+    TEST(measure_small_document) {
+        const auto m = sajson::measure(" [[]] ");
+        CHECK(m.valid);
+        CHECK_EQUAL(3u, m.ast_words);
+        CHECK_EQUAL(2u, m.max_stack_words);
+        CHECK_EQUAL(5u, m.bounded_words);
+    }
+
+    TEST(measure_invalid_document) {
+        CHECK(!sajson::measure("").valid);
+        CHECK(!sajson::measure("42").valid);
+        CHECK(!sajson::measure("[1,2").valid);
+        CHECK(!sajson::measure("{\"a\" 1}").valid);
+        CHECK(!sajson::measure("[] x").valid);
+    }
+
+    static const char measured_document[]
+        = "{\"a\\n\":[1,-2147483648,2147483648,1.5,1e3,\"s\\\"t\"],"
+          "\"b\":{\"c\":[[],{}],\"d\":null,\"e\":true,\"f\":false},"
+          "\"g\":[[[\"deep\"]]]}";
+
+    TEST(measure_is_exact_for_bounded_allocation) {
+        const auto m = sajson::measure(measured_document);
+        CHECK(m.valid);
+        std::vector<size_t> buffer(m.bounded_words);
+        {
+            const auto& document = sajson::parse(
+                sajson::bounded_allocation(buffer.data(), buffer.size()),
+                std::string_view(measured_document));
+            CHECK(document.is_valid());
+            CHECK_EQUAL(
+                m.ast_words,
+                size_t(buffer.data() + buffer.size()
+                       - document._internal_get_root()));
+        }
+        {
+            const auto& document = sajson::parse(
+                sajson::bounded_allocation(buffer.data(), buffer.size() - 1),
+                std::string_view(measured_document));
+            CHECK_EQUAL(
+                sajson::ERROR_OUT_OF_MEMORY,
+                document._internal_get_error_code());
+        }
+    }
+
+    TEST(bounded_allocation_reports_required_size) {
+        // Run out of memory at every possible point of the parse.
+        const auto m = sajson::measure(measured_document);
+        std::vector<size_t> buffer(m.bounded_words);
+        for (size_t size = 0; size < m.bounded_words; ++size) {
+            const auto& document = sajson::parse(
+                sajson::bounded_allocation(buffer.data(), size),
+                std::string_view(measured_document));
+            CHECK_EQUAL(
+                sajson::ERROR_OUT_OF_MEMORY,
+                document._internal_get_error_code());
+            CHECK_EQUAL(m.bounded_words, document.get_required_size_in_words());
+        }
+    }
+
+    TEST(compact_moves_ast_into_exact_allocation) {
+        auto document = sajson::parse(
+            sajson::single_allocation(),
+            std::string_view("[1, 2.5, \"three\", {\"four\": [null, true]}]"));
+        assert(success(document));
+        CHECK(document.compact());
+        const auto& root = document.get_root();
+        CHECK_EQUAL(4u, root.get_length());
+        CHECK_EQUAL(1, root.get_array_element(0).get_integer_value());
+        CHECK_EQUAL(2.5, root.get_array_element(1).get_double_value());
+        CHECK_EQUAL("three", root.get_array_element(2).as_string());
+        const auto& four = root.get_array_element(3).get_value_of_key("four");
+        CHECK_EQUAL(TYPE_TRUE, four.get_array_element(1).get_type());
+    }
+
+    TEST(compact_drops_unreferenced_input) {
+        auto document = sajson::parse(
+            sajson::bounded_allocation(ast_buffer, ast_buffer_size),
+            std::string_view("{ \"a\" : [ 12345678, \"x\\ny\" ],\n  \"bc\" : {} }"));
+        assert(success(document));
+        CHECK(document.compact(true));
+        // "a", "x\ny", and "bc", each NUL-terminated
+        CHECK_EQUAL(9u, document._internal_get_input().length());
+        const auto& root = document.get_root();
+        CHECK_EQUAL("a", root.get_object_key(0));
+        CHECK_EQUAL("bc", root.get_object_key(1));
+        const auto& a = root.get_value_of_key("a");
+        CHECK_EQUAL(12345678, a.get_array_element(0).get_integer_value());
+        CHECK_EQUAL("x\ny", a.get_array_element(1).as_string());
+        CHECK_EQUAL(
+            std::string("x\ny"),
+            std::string(a.get_array_element(1).as_cstring()));
+    }
+
+    TEST(compact_keeps_sorted_object_keys_searchable) {
+        std::string input = "{";
+        for (int i = 0; i < 200; ++i) {
+            input += (i ? ",\"k" : "\"k") + std::to_string(i) + "\":" + std::to_string(i);
+        }
+        input += "}";
+        auto document = sajson::parse(sajson::single_allocation(), input);
+        assert(success(document));
+        CHECK(document.compact(true));
+        const auto& root = document.get_root();
+        CHECK_EQUAL(200u, root.get_length());
+        CHECK_EQUAL(123, root.get_value_of_key("k123").get_integer_value());
+        CHECK_EQUAL(7, root.get_value_of_key("k7").get_integer_value());
+    }
+
+    TEST(compact_invalid_document) {
+        auto document = sajson::parse(sajson::dynamic_allocation(), std::string_view("[1,"));
+        CHECK(!document.compact());
+        CHECK(!document.is_valid());
+    }
+
+    TEST(parse_read_only_leaves_input_untouched) {
+        const std::string original
+            = "{\"plain\": \"abc\", \"esc\\tkey\": [\"a\\nb\", \"\xc3\xa9t\xc3\xa9\", "
+              "\"\\u00e9\", \"\"], \"n\": 1.5}";
+        const std::string input = original;
+        const auto& document = sajson::parse_read_only(sajson::dynamic_allocation(), input);
+        assert(success(document));
+        CHECK_EQUAL(original, input);
+        // No copy of the input was made.
+        CHECK(document._internal_get_input().get_data() == input.data());
+
+        const auto& root = document.get_root();
+        CHECK_EQUAL("abc"sv, root.get_value_of_key("plain").as_string());
+        CHECK_EQUAL("esc\tkey"sv, root.get_object_key(1));
+        const auto& array = root.get_value_of_key("esc\tkey");
+        CHECK_EQUAL("a\nb"sv, array.get_array_element(0).as_string());
+        CHECK_EQUAL("\xc3\xa9t\xc3\xa9"sv, array.get_array_element(1).as_string());
+        CHECK_EQUAL("\xc3\xa9"sv, array.get_array_element(2).as_string());
+        CHECK_EQUAL(0u, array.get_array_element(3).get_string_length());
+        CHECK_EQUAL(1.5, root.get_value_of_key("n").get_double_value());
+    }
+
+    TEST(parse_read_only_sorted_escaped_keys) {
+        std::string input = "{";
+        for (int i = 0; i < 150; ++i) {
+            input += (i ? ",\"k\\u0041" : "\"k\\u0041") + std::to_string(i) + "\":" + std::to_string(i);
+        }
+        input += "}";
+        auto document = sajson::parse_read_only(sajson::single_allocation(), input);
+        assert(success(document));
+        CHECK_EQUAL(42, document.get_root().get_value_of_key("kA42").get_integer_value());
+        // Compaction gathers input and side buffer strings into one text.
+        CHECK(document.compact(true));
+        CHECK_EQUAL(149, document.get_root().get_value_of_key("kA149").get_integer_value());
+    }
+
+    TEST(parse_read_only_flags_side_buffer_strings) {
+        // Interleave keys referenced in the input with keys decoded into
+        // the side buffer, so that sorting compares the two kinds.
+        std::string input = "{";
+        for (int i = 0; i < 100; ++i) {
+            input += (i ? "," : "") + std::string(i % 2 ? "\"k\\u0041" : "\"k") + std::to_string(i)
+                + "\":" + std::to_string(i);
+        }
+        input += "}";
+        const auto& document = sajson::parse_read_only(sajson::single_allocation(), input);
+        assert(success(document));
+
+        const auto& root = document.get_root();
+        const size_t* records = document._internal_get_root() + 1;
+        for (size_t i = 0; i < root.get_length(); ++i) {
+            const std::string_view key = root.get_object_key(i);
+            const bool decoded = key.find('A') != std::string_view::npos;
+            CHECK_EQUAL(decoded, (records[3 * i] & sajson::internal::SIDE_TEXT_OFFSET) != 0);
+            CHECK_EQUAL(decoded, (records[3 * i + 1] & sajson::internal::SIDE_TEXT_OFFSET) != 0);
+            CHECK_EQUAL(!decoded, key.data() > input.data() && key.data() < input.data() + input.size());
+        }
+        for (int i = 0; i < 100; ++i) {
+            const std::string key = (i % 2 ? "kA" : "k") + std::to_string(i);
+            CHECK_EQUAL(i, root.get_value_of_key(key).get_integer_value());
+        }
+    }
+
+    TEST(parse_read_only_from_protected_memory) {
+        const char text[] = "[\"x\\\"y\", {\"z\": null}]";
+        const size_t length = sizeof(text) - 1;
+        void* page = mmap(0, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(page != MAP_FAILED);
+        memcpy(page, text, length);
+        mprotect(page, 4096, PROT_READ);
+        {
+            const auto& document = sajson::parse_read_only(
+                sajson::dynamic_allocation(), std::string_view(static_cast<char*>(page), length));
+            assert(success(document));
+            CHECK_EQUAL("x\"y"sv, document.get_root().get_array_element(0).as_string());
+            CHECK_EQUAL(TYPE_NULL, document.get_root().get_array_element(1).get_value_of_key("z").get_type());
+        }
+        munmap(page, 4096);
+    }
+
+    TEST(parse_read_only_reports_errors) {
+        const std::string input = "[\"a\\qb\"]";
+        const auto& document = sajson::parse_read_only(sajson::single_allocation(), input);
+        CHECK(!document.is_valid());
+        CHECK_EQUAL(sajson::ERROR_UNKNOWN_ESCAPE, document._internal_get_error_code());
+        CHECK_EQUAL(1u, document.get_error_line());
+        CHECK_EQUAL(5u, document.get_error_column());
+        CHECK_EQUAL("[\"a\\qb\"]"s, input);
+    }
+
+    static void check_segmented_document(const sajson::document& document) {
+        assert(success(document));
+        const auto& root = document.get_root();
+        const auto& array = root.get_value_of_key("a");
+        CHECK_EQUAL(TYPE_TRUE, array.get_array_element(0).get_type());
+        CHECK_EQUAL(TYPE_FALSE, array.get_array_element(1).get_type());
+        CHECK_EQUAL(TYPE_NULL, array.get_array_element(2).get_type());
+        CHECK_EQUAL(-12.5e3, array.get_array_element(3).get_double_value());
+        CHECK_EQUAL(123456, array.get_array_element(4).get_integer_value());
+        CHECK_EQUAL("x\ty\"z"sv, root.get_value_of_key("k\xc3\xa9y").as_string());
+        CHECK_EQUAL("\xf0\x9f\x98\x80 plain text"sv, root.get_value_of_key("s").as_string());
+    }
+
+    TEST(parse_segments_splits_tokens_anywhere) {
+        const std::string input
+            = "{\"a\": [true, false,null, -12.5e3, 123456], \"k\\u00e9y\":\"x\\ty\\\"z\", "
+              "\"s\": \"\\ud83d\\ude00 plain text\"}";
+        const std::string_view text = input;
+        for (size_t split = 0; split <= text.length(); ++split) {
+            const std::string_view segments[] = { text.substr(0, split), text.substr(split) };
+            check_segmented_document(sajson::parse_segments(sajson::single_allocation(), segments, 2));
+        }
+
+        std::vector<std::string_view> bytes;
+        for (size_t i = 0; i < text.length(); ++i) {
+            bytes.push_back(text.substr(i, 1));
+        }
+        check_segmented_document(
+            sajson::parse_segments(sajson::dynamic_allocation(), bytes.data(), bytes.size()));
+    }
+
+    TEST(parse_segments_references_unsplit_strings) {
+        const std::string first = "[\"one\", \"tw";
+        const std::string second = "o\", \"three\"]";
+        const std::string_view segments[] = { first, second };
+        const auto& document = sajson::parse_segments(sajson::dynamic_allocation(), segments, 2);
+        assert(success(document));
+        const auto& root = document.get_root();
+        CHECK(root.get_array_element(0).as_string().data() == first.data() + 2);
+        CHECK_EQUAL("two"sv, root.get_array_element(1).as_string());
+        CHECK(root.get_array_element(2).as_string().data() == second.data() + 5);
+        // compact(true) gathers every string so the segments can be freed.
+        auto owned = sajson::parse_segments(sajson::dynamic_allocation(), segments, 2);
+        CHECK(owned.compact(true));
+        CHECK_EQUAL("two"sv, owned.get_root().get_array_element(1).as_string());
+    }
+
+    TEST(parse_segments_reports_errors_across_segments) {
+        const std::string_view segments[] = { "[1,\n 2", "", "x]" };
+        const auto& document = sajson::parse_segments(sajson::single_allocation(), segments, 3);
+        CHECK(!document.is_valid());
+        CHECK_EQUAL(sajson::ERROR_EXPECTED_COMMA, document._internal_get_error_code());
+        CHECK_EQUAL(2u, document.get_error_line());
+        CHECK_EQUAL(3u, document.get_error_column());
+
+        const std::string_view truncated[] = { "{\"a\": \"b", "c" };
+        const auto& unterminated = sajson::parse_segments(sajson::single_allocation(), truncated, 2);
+        CHECK_EQUAL(sajson::ERROR_UNEXPECTED_END, unterminated._internal_get_error_code());
+        CHECK_EQUAL(10u, unterminated.get_error_column());
+
+        const auto& empty = sajson::parse_segments(sajson::single_allocation(), segments, 0);
+        CHECK_EQUAL(sajson::ERROR_MISSING_ROOT_ELEMENT, empty._internal_get_error_code());
+    }
+
+    // Returns the most heap memory f held at once.
+    template <typename F>
+    static size_t measure_peak_heap(F f) {
+        const size_t baseline = heap_in_use;
+        heap_peak = baseline;
+        f();
+        return heap_peak - baseline;
+    }
+
+    TEST(side_buffer_grows_with_what_it_holds) {
+        // An escape and a few straddling tokens in a megabyte of sparse
+        // input should cost memory for them, not for the input.
+        std::string input = "[\"a\\/b\"";
+        while (input.size() < (1 << 20)) {
+            input += ", \"abcdefgh\", 12345" + std::string(2000, ' ');
+        }
+        input += "]";
+        const std::string_view text = input;
+        const size_t first = text.find("abcdefgh", 300000) + 4;
+        const size_t second = text.find("12345", 700000) + 2;
+        const std::string_view segments[]
+            = { text.substr(0, first), text.substr(first, second - first), text.substr(second) };
+        // Small initial buffers, so that the AST only takes what it needs.
+        const sajson::dynamic_allocation allocation(64, 64);
+
+        const size_t segmented = measure_peak_heap([&] {
+            const auto& document = sajson::parse_segments(allocation, segments, 3);
+            assert(success(document));
+            CHECK_EQUAL("a/b"sv, document.get_root().get_array_element(0).as_string());
+        });
+        CHECK(segmented < input.size() / 8);
+
+        const size_t read_only = measure_peak_heap([&] {
+            const auto& document = sajson::parse_read_only(allocation, text);
+            assert(success(document));
+            CHECK_EQUAL("a/b"sv, document.get_root().get_array_element(0).as_string());
+        });
+        CHECK(read_only < input.size() / 8);
+    }
+
+    TEST(parse_segments_from_iovecs) {
+        char first[] = "{\"key\": 12";
+        char second[] = "34}";
+        const iovec segments[] = { { first, sizeof(first) - 1 }, { second, sizeof(second) - 1 } };
+        const auto& document = sajson::parse_segments(sajson::dynamic_allocation(), segments, 2);
+        assert(success(document));
+        CHECK_EQUAL(1234, document.get_root().get_value_of_key("key").get_integer_value());
+        CHECK_EQUAL("{\"key\": 12"s, first);
+    }
+
+    static std::string write_temporary_file(const char* contents) {
+        char path[] = "/tmp/sajson-test-XXXXXX";
+        int fd = mkstemp(path);
+        assert(fd >= 0);
+        size_t length = strlen(contents);
+        ssize_t written = write(fd, contents, length);
+        assert(written == static_cast<ssize_t>(length));
+        (void)written;
+        close(fd);
+        return path;
+    }
+
+    TEST(parse_file_maps_file) {
+        const char* contents = "{\"a\": [1, \"two\\n\"]}";
+        const auto path = write_temporary_file(contents);
+        {
+            const auto& document = sajson::parse_file(sajson::dynamic_allocation(), path.c_str());
+            assert(success(document));
+            const auto& a = document.get_root().get_value_of_key("a");
+            CHECK_EQUAL(1, a.get_array_element(0).get_integer_value());
+            CHECK_EQUAL("two\n", a.get_array_element(1).as_string());
+        }
+        // The mapping is private: the in-situ parse leaves the file alone.
+        std::FILE* file = std::fopen(path.c_str(), "rb");
+        char buffer[64] = {};
+        size_t length = std::fread(buffer, 1, sizeof(buffer) - 1, file);
+        std::fclose(file);
+        CHECK_EQUAL(strlen(contents), length);
+        CHECK_EQUAL(contents, buffer);
+        unlink(path.c_str());
+    }
+
+    TEST(parse_file_empty_file) {
+        const auto path = write_temporary_file("");
+        const auto& document = sajson::parse_file(sajson::single_allocation(), path.c_str());
+        CHECK_EQUAL(sajson::ERROR_MISSING_ROOT_ELEMENT, document._internal_get_error_code());
+        unlink(path.c_str());
+    }
+
+    TEST(parse_file_missing_file) {
+        const auto& document = sajson::parse_file(
+            sajson::single_allocation(), "/nonexistent/sajson.json");
+        CHECK(!document.is_valid());
+        CHECK_EQUAL(sajson::ERROR_CANNOT_READ_FILE, document._internal_get_error_code());
+        CHECK_EQUAL("cannot read file", document.get_error_message_as_string());
+    }
+
+    TEST(parse_file_rejects_files_it_cannot_map) {
+        // procfs reports a size of zero for files that are not empty.
+        const auto& proc = sajson::parse_file(sajson::single_allocation(), "/proc/self/status");
+        CHECK_EQUAL(sajson::ERROR_CANNOT_READ_FILE, proc._internal_get_error_code());
+
+        // Opening a FIFO must not wait for a writer.
+        char path[] = "/tmp/sajson-test-XXXXXX";
+        int fd = mkstemp(path);
+        assert(fd >= 0);
+        close(fd);
+        unlink(path);
+        const int made = mkfifo(path, 0600);
+        assert(made == 0);
+        (void)made;
+        const auto& fifo = sajson::parse_file(sajson::single_allocation(), path);
+        CHECK_EQUAL(sajson::ERROR_CANNOT_READ_FILE, fifo._internal_get_error_code());
+        unlink(path);
+    }
+
+    // Returns a descriptor from which contents can be read.
+    static int open_pipe_with(const std::string& contents) {
+        int fds[2];
+        int rv = pipe(fds);
+        assert(rv == 0);
+        ssize_t written = write(fds[1], contents.data(), contents.size());
+        assert(written == static_cast<ssize_t>(contents.size()));
+        (void)rv;
+        (void)written;
+        close(fds[1]);
+        return fds[0];
+    }
+
+    TEST(element_reader_yields_each_element) {
+        const std::string input
+            = " [ 1, -2.5e1 ,\"s\\\"]\" ,[[]], {\"k\": [true, \"}\"]},null,false, \"\\u00e9\"]\n";
+        for (size_t chunk_size : { 1, 3, 7, 64 * 1024 }) {
+            int fd = open_pipe_with(input);
+            sajson::element_reader reader(fd, chunk_size);
+            CHECK(reader.next());
+            CHECK_EQUAL(1, reader.get_value().get_integer_value());
+            CHECK(reader.next());
+            CHECK_EQUAL(-25.0, reader.get_value().get_double_value());
+            CHECK(reader.next());
+            CHECK_EQUAL("s\"]"sv, reader.get_value().as_string());
+            CHECK(reader.next());
+            CHECK_EQUAL(0u, reader.get_value().get_array_element(0).get_length());
+            CHECK(reader.next());
+            CHECK_EQUAL("}"sv, reader.get_value().get_value_of_key("k").get_array_element(1).as_string());
+            CHECK(reader.next());
+            CHECK_EQUAL(TYPE_NULL, reader.get_value().get_type());
+            CHECK(reader.next());
+            CHECK_EQUAL(TYPE_FALSE, reader.get_value().get_type());
+            CHECK(reader.next());
+            CHECK_EQUAL("\xc3\xa9"sv, reader.get_value().as_string());
+            CHECK(!reader.next());
+            CHECK(reader.is_valid());
+            close(fd);
+        }
+    }
+
+    TEST(element_reader_streams_many_elements) {
+        std::string input = "[";
+        for (int i = 0; i < 20000; ++i) {
+            input += (i ? ",{\"id\":" : "{\"id\":") + std::to_string(i) + ",\"tag\":\"x\"}";
+        }
+        input += "]";
+        const auto path = write_temporary_file(input.c_str());
+        int fd = open(path.c_str(), O_RDONLY);
+        sajson::element_reader reader(fd, 100);
+        int count = 0;
+        while (reader.next()) {
+            CHECK_EQUAL(count, reader.get_value().get_value_of_key("id").get_integer_value());
+            ++count;
+        }
+        CHECK(reader.is_valid());
+        CHECK_EQUAL(20000, count);
+        close(fd);
+        unlink(path.c_str());
+    }
+
+    TEST(element_reader_reports_errors) {
+        const struct {
+            const char* input;
+            sajson::error error;
+        } cases[] = {
+            { "", sajson::ERROR_MISSING_ROOT_ELEMENT },
+            { "{}", sajson::ERROR_BAD_ROOT },
+            { "[1 2]", sajson::ERROR_EXPECTED_COMMA },
+            { "[1,]", sajson::ERROR_EXPECTED_VALUE },
+            { "[1, [2", sajson::ERROR_UNEXPECTED_END },
+            { "[\"a\\qb\"]", sajson::ERROR_UNKNOWN_ESCAPE },
+            { "[] x", sajson::ERROR_EXPECTED_END_OF_INPUT },
+        };
+        for (const auto& c : cases) {
+            int fd = open_pipe_with(c.input);
+            sajson::element_reader reader(fd, 2);
+            while (reader.next()) {
+            }
+            CHECK(!reader.is_valid());
+            CHECK_EQUAL(c.error, reader._internal_get_error_code());
+            close(fd);
+        }
+
+        sajson::element_reader closed(-1);
+        CHECK(!closed.next());
+        CHECK_EQUAL(sajson::ERROR_CANNOT_READ_FILE, closed._internal_get_error_code());
+    }
+
+    static void check_ingest(const sajson::ingest_options& options) {
+        std::vector<std::string> files;
+        for (int i = 0; i < 40; ++i) {
+            files.push_back(write_temporary_file(("{\"file\": " + std::to_string(i) + ", \"pad\": \"" + std::string(i * 500, 'x') + "\"}").c_str()));
+        }
+        files.push_back(write_temporary_file(""));
+        files.push_back(write_temporary_file("[1,"));
+        files.push_back("/nonexistent/sajson.json");
+        std::vector<const char*> paths;
+        for (const auto& file : files) {
+            paths.push_back(file.c_str());
+        }
+
+        std::mutex mutex;
+        std::vector<int> results(paths.size(), -1);
+        std::vector<sajson::error> errors(paths.size(), sajson::ERROR_NO_ERROR);
+        sajson::ingest_files(sajson::dynamic_allocation(), paths.data(), paths.size(),
+            [&](size_t index, const sajson::document& document) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (document.is_valid()) {
+                    results[index] = document.get_root().get_value_of_key("file").get_integer_value();
+                } else {
+                    errors[index] = document._internal_get_error_code();
+                }
+            },
+            options);
+
+        for (int i = 0; i < 40; ++i) {
+            CHECK_EQUAL(i, results[i]);
+        }
+        CHECK_EQUAL(sajson::ERROR_MISSING_ROOT_ELEMENT, errors[40]);
+        CHECK_EQUAL(sajson::ERROR_UNEXPECTED_END, errors[41]);
+        CHECK_EQUAL(sajson::ERROR_CANNOT_READ_FILE, errors[42]);
+        for (size_t i = 0; i + 1 < files.size(); ++i) {
+            unlink(files[i].c_str());
+        }
+    }
+
+    TEST(ingest_files_recycles_buffers) {
+        sajson::ingest_options options;
+        options.queue_depth = 3;
+        options.worker_count = 2;
+        check_ingest(options);
+    }
+
+    TEST(ingest_files_with_pread_threads) {
+        sajson::ingest_options options;
+        options.queue_depth = 4;
+        options.use_io_uring = false;
+        check_ingest(options);
+    }
+
+#if SAJSON_HAVE_ZLIB && SAJSON_HAVE_LZMA
+    static std::string write_gzip_file(const std::string& contents, const char* mode = "wb", std::string path = "") {
+        if (path.empty()) {
+            path = write_temporary_file("");
+        }
+        gzFile file = gzopen(path.c_str(), mode);
+        assert(file);
+        gzwrite(file, contents.data(), static_cast<unsigned>(contents.size()));
+        gzclose(file);
+        return path;
+    }
+
+    // Large enough to span several pipeline blocks.
+    static std::string make_compressible_document() {
+        std::string input = "[";
+        for (int i = 0; i < 40000; ++i) {
+            input += (i ? ",{\"id\":" : "{\"id\":") + std::to_string(i) + ",\"name\":\"item\\t" + std::to_string(i) + "\"}";
+        }
+        return input + "]";
+    }
+
+    static void check_compressible_document(const sajson::document& document) {
+        assert(success(document));
+        const auto& root = document.get_root();
+        CHECK_EQUAL(40000u, root.get_length());
+        CHECK_EQUAL(39999, root.get_array_element(39999).get_value_of_key("id").get_integer_value());
+        CHECK_EQUAL("item\t23456"sv, root.get_array_element(23456).get_value_of_key("name").as_string());
+    }
+
+    TEST(parse_compressed_file_gzip_and_xz) {
+        const std::string input = make_compressible_document();
+        const auto gzip_path = write_gzip_file(input);
+        check_compressible_document(sajson::parse_compressed_file(sajson::dynamic_allocation(), gzip_path.c_str()));
+
+        std::vector<uint8_t> xz(input.size() + 1024);
+        size_t xz_length = 0;
+        lzma_ret rv = lzma_easy_buffer_encode(
+            6, LZMA_CHECK_CRC64, 0, reinterpret_cast<const uint8_t*>(input.data()), input.size(),
+            xz.data(), &xz_length, xz.size());
+        assert(rv == LZMA_OK);
+        (void)rv;
+        const auto xz_path = write_temporary_file("");
+        std::FILE* file = std::fopen(xz_path.c_str(), "wb");
+        std::fwrite(xz.data(), 1, xz_length, file);
+        std::fclose(file);
+        check_compressible_document(sajson::parse_compressed_file(sajson::single_allocation(), xz_path.c_str()));
+
+        sajson::mutable_string_view text;
+        CHECK_EQUAL(sajson::ERROR_NO_ERROR, sajson::read_compressed_file(xz_path.c_str(), &text));
+        CHECK(std::string_view(text.get_data(), text.length()) == input);
+
+        unlink(gzip_path.c_str());
+        unlink(xz_path.c_str());
+    }
+
+    // Forwards to the decompression pipeline, remembering which blocks the
+    // parser asked for and in what order.
+    struct recording_pipeline {
+        const sajson::internal::decompression_pipeline* pipeline;
+        mutable std::vector<size_t> requests;
+    };
+
+    static std::string_view get_recorded_block(const void* segments, size_t i) {
+        const auto* source = static_cast<const recording_pipeline*>(segments);
+        source->requests.push_back(i);
+        return source->pipeline->get_block(i);
+    }
+
+    static std::vector<Bytef> compress_with_zlib(const std::string& input) {
+        std::vector<Bytef> compressed(compressBound(static_cast<uLong>(input.size())));
+        uLongf compressed_length = static_cast<uLongf>(compressed.size());
+        int rv = compress2(compressed.data(), &compressed_length,
+            reinterpret_cast<const Bytef*>(input.data()), static_cast<uLong>(input.size()), 1);
+        assert(rv == Z_OK);
+        (void)rv;
+        compressed.resize(compressed_length);
+        return compressed;
+    }
+
+    // Parses as parse_compressed_file does, stopping decompression if the
+    // parse fails.
+    static std::vector<size_t> parse_through_pipeline(const std::string& input, bool* valid, size_t* block_count) {
+        const std::vector<Bytef> compressed = compress_with_zlib(input);
+        sajson::mutable_string_view text(input.size());
+        sajson::internal::decompression_pipeline pipeline(
+            sajson::internal::compression_gzip, reinterpret_cast<const char*>(compressed.data()),
+            compressed.size(), text.get_data(), input.size());
+        recording_pipeline source = { &pipeline, {} };
+        *block_count = pipeline.get_block_count();
+        const sajson::internal::segment_list list
+            = { &source, pipeline.get_block_count(), &get_recorded_block, input.size() };
+        const auto& document = sajson::internal::parse_segment_list(sajson::dynamic_allocation(), list, &text);
+        *valid = document.is_valid();
+        if (!*valid) {
+            pipeline.cancel();
+        }
+        CHECK(pipeline.finish()
+            == (*valid ? sajson::internal::decompression_pipeline::complete
+                       : sajson::internal::decompression_pipeline::cancelled));
+        return source.requests;
+    }
+
+    TEST(parse_compressed_file_overlaps_decompression) {
+        std::string input = "[";
+        for (int i = 0; i < 200000; ++i) {
+            input += (i ? ",{\"id\":" : "{\"id\":") + std::to_string(i) + ",\"name\":\"item\\t" + std::to_string(i) + "\"}";
+        }
+        input += "]";
+
+        // Each block is waited for only when the parser reaches it, rather
+        // than all of them before parsing starts.
+        bool valid = false;
+        size_t block_count = 0;
+        std::vector<size_t> requests = parse_through_pipeline(input, &valid, &block_count);
+        CHECK(valid);
+        CHECK(block_count > 4);
+        CHECK(std::is_sorted(requests.begin(), requests.end()));
+        CHECK_EQUAL(block_count - 1, requests.back());
+
+        // A syntax error in the first block is found without waiting for
+        // the rest of the text to be decompressed, which is then abandoned.
+        input.replace(1, 1, "x");
+        requests = parse_through_pipeline(input, &valid, &block_count);
+        CHECK(!valid);
+        CHECK(std::is_sorted(requests.begin(), requests.end()));
+        CHECK(*std::max_element(requests.begin(), requests.end()) < block_count - 1);
+    }
+
+    TEST(parse_compressed_file_unescapes_in_place) {
+        // Escaped strings straddle every block boundary at some alignment;
+        // all of them are decoded within the decompressed text itself.
+        for (size_t shift = 0; shift < 16; ++shift) {
+            std::string input = "[" + std::string(shift, ' ');
+            for (int i = 0; i < 120000; ++i) {
+                input += i ? ",\"x\\ty\\\"z\\u00e9\"" : "\"x\\ty\\\"z\\u00e9\"";
+            }
+            input += "]";
+
+            const std::vector<Bytef> compressed = compress_with_zlib(input);
+            sajson::mutable_string_view text(input.size());
+            sajson::internal::decompression_pipeline pipeline(
+                sajson::internal::compression_gzip, reinterpret_cast<const char*>(compressed.data()),
+                compressed.size(), text.get_data(), input.size());
+            const sajson::internal::segment_list list = { &pipeline, pipeline.get_block_count(),
+                                                          &sajson::internal::get_pipeline_block, input.size() };
+            const auto& document = sajson::internal::parse_segment_list(sajson::dynamic_allocation(), list, &text);
+            CHECK(pipeline.finish() == sajson::internal::decompression_pipeline::complete);
+            assert(success(document));
+            const auto& root = document.get_root();
+            CHECK_EQUAL(120000u, root.get_length());
+            for (size_t i = 0; i < root.get_length(); ++i) {
+                const std::string_view s = root.get_array_element(i).as_string();
+                CHECK_EQUAL("x\ty\"z\xc3\xa9"sv, s);
+                CHECK(s.data() > text.get_data() && s.data() < text.get_data() + text.length());
+                CHECK_EQUAL('\0', s.data()[s.size()]);
+            }
+        }
+    }
+
+    TEST(parse_compressed_file_concatenated_gzip_members) {
+        // The recorded length is only the last member's, so the pipeline
+        // falls back to decompressing everything first.
+        const auto path = write_gzip_file("[\"first\", ");
+        write_gzip_file("\"second\"]", "ab", path);
+        const auto& document = sajson::parse_compressed_file(sajson::dynamic_allocation(), path.c_str());
+        assert(success(document));
+        CHECK_EQUAL("second"sv, document.get_root().get_array_element(1).as_string());
+        unlink(path.c_str());
+    }
+
+    TEST(parse_compressed_file_distrusts_recorded_length) {
+        const std::string input = make_compressible_document();
+        const auto path = write_gzip_file(input);
+        const auto set_isize = [&](uint32_t isize) {
+            const unsigned char bytes[4] = {
+                static_cast<unsigned char>(isize), static_cast<unsigned char>(isize >> 8),
+                static_cast<unsigned char>(isize >> 16), static_cast<unsigned char>(isize >> 24) };
+            std::FILE* file = std::fopen(path.c_str(), "r+b");
+            std::fseek(file, -4, SEEK_END);
+            std::fwrite(bytes, 1, 4, file);
+            std::fclose(file);
+        };
+
+        std::vector<char> compressed;
+        const auto recorded_length = [&] {
+            std::FILE* file = std::fopen(path.c_str(), "rb");
+            compressed.resize(input.size());
+            compressed.resize(std::fread(compressed.data(), 1, compressed.size(), file));
+            std::fclose(file);
+            return sajson::internal::get_recorded_length(
+                sajson::internal::compression_gzip, compressed.data(), compressed.size());
+        };
+        CHECK_EQUAL(input.size(), recorded_length());
+
+        // Far more than the file could decompress to: ignored rather than
+        // allocated up front.
+        set_isize(0xffffffffu);
+        CHECK_EQUAL(0u, recorded_length());
+
+        // zlib checks ISIZE itself, so any wrong claim, plausible or not,
+        // ends up reported as corrupt data.
+        const uint32_t actual = static_cast<uint32_t>(input.size());
+        for (uint32_t claimed: { 0xffffffffu, actual + 100, actual - 100, actual / 2 }) {
+            set_isize(claimed);
+            const auto& document = sajson::parse_compressed_file(sajson::dynamic_allocation(), path.c_str());
+            CHECK_EQUAL(sajson::ERROR_INVALID_COMPRESSED_DATA, document._internal_get_error_code());
+            sajson::mutable_string_view text;
+            CHECK_EQUAL(sajson::ERROR_INVALID_COMPRESSED_DATA, sajson::read_compressed_file(path.c_str(), &text));
+        }
+        unlink(path.c_str());
+    }
+
+    TEST(parse_compressed_file_reports_corrupt_data) {
+        const std::string input = make_compressible_document();
+        const auto path = write_gzip_file(input);
+        // Flip bytes in the middle of the deflate stream.
+        std::FILE* file = std::fopen(path.c_str(), "r+b");
+        std::fseek(file, 1000, SEEK_SET);
+        std::fwrite("\xff\xff\xff\xff", 1, 4, file);
+        std::fclose(file);
+        const auto& document = sajson::parse_compressed_file(sajson::dynamic_allocation(), path.c_str());
+        CHECK(!document.is_valid());
+        CHECK_EQUAL(sajson::ERROR_INVALID_COMPRESSED_DATA, document._internal_get_error_code());
+        CHECK_EQUAL("invalid compressed data", document.get_error_message_as_string());
+        unlink(path.c_str());
+    }
+#endif
+
+    TEST(dynamic_allocation_statistics_count_reallocations) {
+        sajson::allocation_statistics statistics;
+        const auto& document = sajson::parse(
+            sajson::dynamic_allocation(1, 1, &statistics), "[[1,2,3],[4,5,6]]");
+        assert(success(document));
+        CHECK(statistics.get_reallocation_count() > 0);
+        CHECK_EQUAL(1u, statistics.get_parse_count());
+    }
+
+    TEST(dynamic_allocation_statistics_size_later_parses) {
+        std::string input = "[";
+        for (int i = 0; i < 1000; ++i) {
+            input += i ? ",[1,2]" : "[1,2]";
+        }
+        input += "]";
+
+        // Give the stack plenty of room so only AST growth is counted.
+        sajson::allocation_statistics statistics;
+        for (int i = 0; i < 4; ++i) {
+            const auto& document = sajson::parse(
+                sajson::dynamic_allocation(0, 4096, &statistics), std::string_view(input));
+            assert(success(document));
+        }
+        CHECK_EQUAL(4u, statistics.get_parse_count());
+        CHECK(statistics.get_ast_words_per_byte() > 0.0);
+        CHECK(statistics.get_ast_words_per_byte() <= 1.0);
+
+        const size_t learned = statistics.get_reallocation_count();
+        const auto& document = sajson::parse(
+            sajson::dynamic_allocation(0, 4096, &statistics), std::string_view(input));
+        assert(success(document));
+        // Once the ratio is learned, the AST buffer no longer grows.
+        CHECK_EQUAL(learned, statistics.get_reallocation_count());
+    }
+
+    TEST(mmap_allocation_spanning_many_pages) {
+        // The parse stack spans several pages and is unmapped afterwards;
+        // the AST must survive that.
+        std::string input = "[";
+        for (int i = 0; i < 20000; ++i) {
+            input += i ? ",\"s\"" : "\"s\"";
+        }
+        input += "]";
+        const auto& document = sajson::parse(sajson::mmap_allocation(), std::string_view(input));
+        assert(success(document));
+        const value& root = document.get_root();
+        CHECK_EQUAL(20000u, root.get_length());
+        CHECK_EQUAL("s"sv, root.get_array_element(0).as_string());
+        CHECK_EQUAL("s"sv, root.get_array_element(19999).as_string());
+    }
+
+    TEST(mmap_allocation_with_huge_pages) {
+        // A threshold of one byte puts every reservation on huge pages.
+        std::string input = "[";
+        for (int i = 0; i < 1000; ++i) {
+            input += i ? ",{\"k\":1.5}" : "{\"k\":1.5}";
+        }
+        input += "]";
+        const auto& document = sajson::parse(sajson::mmap_allocation(1), std::string_view(input));
+        assert(success(document));
+        const value& root = document.get_root();
+        CHECK_EQUAL(1000u, root.get_length());
+        CHECK_EQUAL(1.5, root.get_array_element(999).get_value_of_key("k").get_double_value());
+    }
+
+    struct counting_resource : std::pmr::memory_resource {
+        size_t outstanding = 0;
+        size_t allocations = 0;
+
+        void* do_allocate(size_t bytes, size_t alignment) override {
+            outstanding += bytes;
+            ++allocations;
+            return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+
+        void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+            outstanding -= bytes;
+            std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+    };
+
+    TEST(pmr_allocation_uses_resource_for_ast_stack_and_growth) {
+        counting_resource resource;
+        {
+            // Tiny initial capacities force both buffers to grow.
+            const auto& document = sajson::parse(
+                sajson::pmr_allocation(&resource, 1, 1), "[[1,2,3],{\"a\":[4,5]}]");
+            assert(success(document));
+            CHECK_EQUAL(2u, document.get_root().get_length());
+            CHECK(resource.allocations > 2);
+            // Only the AST remains alive with the document.
+            CHECK(resource.outstanding > 0);
+        }
+        CHECK_EQUAL(0u, resource.outstanding);
+    }
+
+    TEST(pmr_allocation_failing_resource_is_out_of_memory) {
+        const auto& document = sajson::parse(
+            sajson::pmr_allocation(std::pmr::null_memory_resource()), "[]");
+        CHECK(!document.is_valid());
+        CHECK_EQUAL(sajson::ERROR_OUT_OF_MEMORY, document._internal_get_error_code());
+    }
+
+    TEST(pmr_allocation_from_monotonic_buffer) {
+        size_t storage[64];
+        std::pmr::monotonic_buffer_resource resource(
+            storage, sizeof(storage), std::pmr::null_memory_resource());
+        const auto& document = sajson::parse(
+            sajson::pmr_allocation(&resource, 16, 16), "[true,\"x\"]");
+        assert(success(document));
+        CHECK_EQUAL("x"sv, document.get_root().get_array_element(1).as_string());
+    }
 }
 
 TEST(zero_initialized_document_is_invalid) {
@@ -1091,6 +2069,33 @@ TEST(zero_initialized_document_is_invalid) {
     CHECK_EQUAL("uninitialized document", d.get_error_message_as_string());
 }
 
+TEST(document_is_move_assignable) {
+    auto d = document{};
+    d = sajson::parse(sajson::dynamic_allocation(), "[1, 2]");
+    CHECK(d.is_valid());
+    CHECK_EQUAL(0u, d.get_error_line());
+    CHECK_EQUAL("", d.get_error_message_as_string());
+    CHECK_EQUAL(2, d.get_root().get_array_element(1).get_integer_value());
+
+    d = sajson::parse(sajson::dynamic_allocation(), "[1,\r\n 2,\n  x]");
+    CHECK(!d.is_valid());
+    CHECK_EQUAL(3u, d.get_error_line());
+    CHECK_EQUAL(3u, d.get_error_column());
+    CHECK_EQUAL("expected value", d.get_error_message_as_string());
+}
+
+TEST(document_has_no_inline_error_buffer) {
+    static_assert(
+        sizeof(document) <= 11 * sizeof(size_t) + sizeof(sajson::error),
+        "document should stay a small handle");
+}
+
+TEST(value_is_three_words) {
+    // Values are passed around by copy, so they keep one string base.
+    static_assert(
+        sizeof(value) == 3 * sizeof(size_t), "value should stay three words");
+}
+
 TEST(zero_initialized_value_is_null) {
     auto v = value{};
     CHECK_EQUAL(TYPE_NULL, v.get_type());
@@ -1189,4 +2194,675 @@ SUITE(defaulted_value) {
     }
 }
 
+SUITE(dump) {
+    TEST(dump_literals_and_integers) {
+        const auto& document = sajson::parse(
+            sajson::single_allocation(),
+            "[true, false, null, 0, -2147483648, 2147483647, {\"a\": []}]");
+        assert(success(document));
+        CHECK_EQUAL(
+            "[true,false,null,0,-2147483648,2147483647,{\"a\":[]}]",
+            sajson::to_string(document.get_root()));
+    }
+
+    TEST(dump_doubles_round_trip) {
+        const auto& document = sajson::parse(
+            sajson::single_allocation(),
+            "[0.1, 1e300, -2.5, 5e-310, 1.7976931348623157e308, 3.0, 1e22]");
+        assert(success(document));
+        const std::string output = sajson::to_string(document.get_root());
+        CHECK_EQUAL(
+            "[0.1,1e+300,-2.5,5e-310,1.7976931348623157e+308,3.0,1e+22]",
+            output);
+
+        const auto& reparsed = sajson::parse(sajson::single_allocation(), output);
+        assert(success(reparsed));
+        const value& before = document.get_root();
+        const value& after = reparsed.get_root();
+        for (size_t i = 0; i < before.get_length(); ++i) {
+            CHECK_EQUAL(TYPE_DOUBLE, after.get_array_element(i).get_type());
+            CHECK_EQUAL(
+                before.get_array_element(i).get_double_value(),
+                after.get_array_element(i).get_double_value());
+        }
+    }
+
+    TEST(dump_escapes_strings_and_keys) {
+        std::string input = "{\"key\\\"\\u0001\": \"";
+        for (int c = 1; c < 0x20; ++c) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            input += escape;
+        }
+        // Long enough runs that the vectorized scan finds escapes at
+        // different offsets within a block.
+        input += "0123456789abcdef\\\"0123456789abcdef\\\\\xc3\xa9\xe2\x82\xac\"}";
+        const auto& document = sajson::parse(sajson::single_allocation(), input);
+        assert(success(document));
+
+        const std::string output = sajson::to_string(document.get_root());
+        CHECK_EQUAL(
+            "{\"key\\\"\\u0001\":\"\\u0001\\u0002\\u0003\\u0004\\u0005\\u0006"
+            "\\u0007\\b\\t\\n\\u000b\\f\\r\\u000e\\u000f\\u0010\\u0011\\u0012"
+            "\\u0013\\u0014\\u0015\\u0016\\u0017\\u0018\\u0019\\u001a\\u001b"
+            "\\u001c\\u001d\\u001e\\u001f0123456789abcdef\\\"0123456789abcdef"
+            "\\\\\xc3\xa9\xe2\x82\xac\"}",
+            output);
+
+        const auto& reparsed = sajson::parse(sajson::single_allocation(), output);
+        assert(success(reparsed));
+        CHECK(document.get_root().get_object_key(0) == reparsed.get_root().get_object_key(0));
+        CHECK(document.get_root().get_object_value(0).as_string()
+              == reparsed.get_root().get_object_value(0).as_string());
+    }
+
+    TEST(serialize_writes_exactly_serialized_size) {
+        const auto& document = sajson::parse(
+            sajson::single_allocation(),
+            "{\"a\\n\": [1, -2.5, \"x\\u0000y\", true, null, {}], \"b\": {\"c\": []}}");
+        assert(success(document));
+        const value& root = document.get_root();
+
+        for (bool indent : { false, true }) {
+            std::string expected;
+            sajson::dump(expected, root, indent ? 0 : -1);
+
+            const size_t size = sajson::serialized_size(root, indent);
+            CHECK_EQUAL(expected.size(), size);
+            std::vector<char> buffer(size + 1, '#');
+            char* end = sajson::serialize(buffer.data(), root, indent);
+            CHECK_EQUAL(size, static_cast<size_t>(end - buffer.data()));
+            CHECK_EQUAL('#', buffer[size]);
+            CHECK(std::string_view(buffer.data(), size) == expected);
+            CHECK(sajson::to_string(root, indent) == expected);
+        }
+    }
+
+    TEST(source_ranges_locate_structures) {
+        const std::string input = " {\"a\": [1, {\"b\": \"x\\ty\"}], \"c\" : [ 2.50 ]} ";
+        const auto& document = sajson::parse_with_source_ranges(sajson::dynamic_allocation(), input);
+        assert(success(document));
+        const value& root = document.get_root();
+
+        sajson::source_range range;
+        CHECK(document.get_source_range(root, &range));
+        CHECK_EQUAL(1u, range.begin);
+        CHECK_EQUAL(input.size() - 1, range.end);
+        CHECK(range.modified);
+
+        // The escape modified "b"'s object and everything around it.
+        const value& a = root.get_value_of_key("a");
+        CHECK(document.get_source_range(a, &range));
+        CHECK_EQUAL("[1, {\"b\": \"x\\ty\"}]"sv, input.substr(range.begin, range.end - range.begin));
+        CHECK(range.modified);
+
+        const value& c = root.get_value_of_key("c");
+        CHECK(document.get_source_range(c, &range));
+        CHECK_EQUAL("[ 2.50 ]"sv, input.substr(range.begin, range.end - range.begin));
+        CHECK(!range.modified);
+        CHECK(!document.get_source_range(c.get_array_element(0), &range));
+
+        const auto& read_only = sajson::parse_read_only_with_source_ranges(sajson::single_allocation(), input);
+        assert(success(read_only));
+        CHECK(read_only.get_source_range(read_only.get_root().get_value_of_key("a"), &range));
+        CHECK(!range.modified);
+
+        const auto& plain = sajson::parse(sajson::single_allocation(), input);
+        assert(success(plain));
+        CHECK(!plain.get_source_range(plain.get_root(), &range));
+    }
+
+    TEST(source_ranges_survive_compact) {
+        auto document = sajson::parse_with_source_ranges(
+            sajson::single_allocation(), "[[1], {\"k\": [true]}, []]");
+        assert(success(document));
+        CHECK(document.compact());
+
+        sajson::source_range range;
+        const value& root = document.get_root();
+        CHECK(document.get_source_range(root.get_array_element(1).get_value_of_key("k"), &range));
+        CHECK_EQUAL(12u, range.begin);
+        CHECK_EQUAL(18u, range.end);
+        CHECK(document.get_source_range(root.get_array_element(2), &range));
+        CHECK_EQUAL(21u, range.begin);
+
+        CHECK(document.compact(true));
+        CHECK(!document.get_source_range(document.get_root(), &range));
+    }
+
+    TEST(dump_passthrough_copies_unmodified_structures) {
+        const std::string input
+            = "{ \"keep\" : [1.0e2, -0, \"q\"] ,\"escaped\": {\"s\": \"a\\nb\", \"n\": [ 7 ]}}";
+        const auto& document = sajson::parse_with_source_ranges(sajson::single_allocation(), input);
+        assert(success(document));
+
+        std::string out;
+        sajson::dump_passthrough(out, document, document.get_root());
+        CHECK_EQUAL(
+            "{\"keep\":[1.0e2, -0, \"q\"],\"escaped\":{\"s\":\"a\\nb\",\"n\":[ 7 ]}}",
+            out);
+
+        // Nothing in read-only input is modified, so all of it is copied.
+        const auto& read_only = sajson::parse_read_only_with_source_ranges(sajson::single_allocation(), input);
+        assert(success(read_only));
+        out.clear();
+        sajson::dump_passthrough(out, read_only, read_only.get_root());
+        CHECK_EQUAL(input, out);
+
+        // Without ranges it is the same as dump().
+        const auto& plain = sajson::parse(sajson::single_allocation(), input);
+        assert(success(plain));
+        out.clear();
+        sajson::dump_passthrough(out, plain, plain.get_root());
+        CHECK_EQUAL(sajson::to_string(plain.get_root()), out);
+    }
+
+    TEST(dump_pretty_default_format) {
+        const auto& document = sajson::parse(
+            sajson::single_allocation(), "{\"a\": [1, [], {}], \"b\": {\"c\": true}}");
+        assert(success(document));
+        CHECK_EQUAL(
+            "{\n"
+            "  \"a\": [\n"
+            "    1,\n"
+            "    [],\n"
+            "    {}\n"
+            "  ],\n"
+            "  \"b\": {\n"
+            "    \"c\": true\n"
+            "  }\n"
+            "}",
+            sajson::to_pretty_string(document.get_root()));
+    }
+
+    TEST(dump_pretty_custom_format_and_deep_nesting) {
+        const auto& document = sajson::parse(sajson::single_allocation(), "[{\"k\": [null]}]");
+        assert(success(document));
+        sajson::pretty_format format;
+        format.indent_width = 1;
+        format.indent_char = '\t';
+        format.newline = "\r\n";
+        format.space_after_colon = false;
+        CHECK_EQUAL(
+            "[\r\n\t{\r\n\t\t\"k\":[\r\n\t\t\tnull\r\n\t\t]\r\n\t}\r\n]",
+            sajson::to_pretty_string(document.get_root(), format));
+
+        // Deeper than the precomputed indentation.
+        std::string input;
+        for (int i = 0; i < 40; ++i) {
+            input += "[1,";
+        }
+        input += "2";
+        input += std::string(40, ']');
+        const auto& deep = sajson::parse(sajson::single_allocation(), input);
+        assert(success(deep));
+        format.indent_width = 3;
+        const std::string pretty = sajson::to_pretty_string(deep.get_root(), format);
+        CHECK(pretty.find("\r\n" + std::string(120, '\t') + "2\r\n") != std::string::npos);
+        const auto& reparsed = sajson::parse(sajson::single_allocation(), pretty);
+        assert(success(reparsed));
+        CHECK_EQUAL(input, sajson::to_string(reparsed.get_root()));
+        // The fixed two-space indentation of dump() is unchanged.
+        CHECK(sajson::to_string(deep.get_root(), true).find("\n" + std::string(78, ' ') + "1,") != std::string::npos);
+    }
+
+    TEST(dump_canonical_numbers) {
+        // Values from RFC 8785 and the ECMAScript number formatting rules.
+        const auto& document = sajson::parse(
+            sajson::single_allocation(),
+            "[1e30, 4.50, 0.002, 1e-27, 333333333.33333329, 1e21, 1e20, -0.0, 0.000001, 1e-7,"
+            " 1.0, -2147483648, 1.5e20, 1.7976931348623157e308, -1.5e-9]");
+        assert(success(document));
+        CHECK_EQUAL(
+            "[1e+30,4.5,0.002,1e-27,333333333.3333333,1e+21,100000000000000000000,0,0.000001,1e-7,"
+            "1,-2147483648,150000000000000000000,1.7976931348623157e+308,-1.5e-9]",
+            sajson::to_canonical_string(document.get_root()));
+    }
+
+    TEST(dump_canonical_sorts_keys_by_utf16) {
+        // The sorting example from RFC 8785 section 3.2.3, nested and with
+        // whitespace.
+        const auto& document = sajson::parse(
+            sajson::single_allocation(),
+            "{ \"x\": {\"\\u20ac\": 1, \"\\r\": 2, \"\\ufb33\": 3, \"1\": 4,"
+            " \"\\ud83d\\ude00\": 5, \"\\u0080\": 6, \"\\u00f6\": 7}, \"a\" : [ {\"b\": 1, \"a\": \"\\u001f\"} ] }");
+        assert(success(document));
+        CHECK_EQUAL(
+            "{\"a\":[{\"a\":\"\\u001f\",\"b\":1}],\"x\":{\"\\r\":2,\"1\":4,\"\xc2\x80\":6,\"\xc3\xb6\":7,"
+            "\"\xe2\x82\xac\":1,\"\xf0\x9f\x98\x80\":5,\"\xef\xac\xb3\":3}}",
+            sajson::to_canonical_string(document.get_root()));
+
+        // Objects large enough to be stored sorted by length for lookup
+        // still come out in code unit order.
+        std::string input = "{";
+        for (int i = 150; i > 0; --i) {
+            input += (i == 150 ? "\"k" : ",\"k") + std::to_string(i) + "\":" + std::to_string(i);
+        }
+        input += "}";
+        const auto& large = sajson::parse(sajson::single_allocation(), input);
+        assert(success(large));
+        const std::string canonical = sajson::to_canonical_string(large.get_root());
+        const std::string first = "{\"k1\":1,\"k10\":10,\"k100\":100,\"k101\":101,";
+        const std::string last = ",\"k98\":98,\"k99\":99}";
+        CHECK_EQUAL(first, canonical.substr(0, first.size()));
+        CHECK_EQUAL(last, canonical.substr(canonical.size() - last.size()));
+    }
+
+#if SAJSON_HAVE_WRITEV
+    static std::string write_to_temporary_file(const value& root, bool indent) {
+        char path[] = "/tmp/sajson-test-XXXXXX";
+        int fd = mkstemp(path);
+        assert(fd >= 0);
+        const size_t written = sajson::write(fd, root, indent);
+        std::string contents(written, '\0');
+        ssize_t n = pread(fd, &contents[0], written, 0);
+        assert(n == static_cast<ssize_t>(written));
+        (void)n;
+        close(fd);
+        unlink(path);
+        return contents;
+    }
+
+    TEST(write_fd_matches_to_string) {
+        // Enough long strings to overflow the iovecs, one string larger
+        // than the scratch buffer, and escapes throughout.
+        std::string input = "[\"" + std::string(100000, 'x') + "\\n\"";
+        for (int i = 0; i < 3000; ++i) {
+            input += ",{\"long key number " + std::to_string(i) + " with some padding\": \""
+                + std::string(static_cast<size_t>(i % 80), 'y') + "\\t\\u0001z\", \"n\": "
+                + std::to_string(i) + "}";
+        }
+        input += "]";
+        const auto& document = sajson::parse(sajson::single_allocation(), input);
+        assert(success(document));
+        const value& root = document.get_root();
+
+        CHECK(write_to_temporary_file(root, false) == sajson::to_string(root, false));
+        CHECK(write_to_temporary_file(root, true) == sajson::to_string(root, true));
+
+        std::FILE* file = std::tmpfile();
+        CHECK_EQUAL(sajson::to_string(root, false).size(), sajson::write(file, root));
+        std::fclose(file);
+    }
+#endif
+}
+
+SUITE(writer) {
+    TEST(writer_builds_nested_document) {
+        std::string out;
+        sajson::writer<std::string> w(out);
+        w.begin_object();
+        w.key("id");
+        w.value(42);
+        w.key("big");
+        w.value(-9007199254740993ll);
+        w.key("ratio");
+        w.value(0.1);
+        w.key("flags");
+        w.begin_array();
+        w.value(true);
+        w.value(false);
+        w.value(nullptr);
+        w.begin_array();
+        w.end_array();
+        w.begin_object();
+        w.end_object();
+        w.end_array();
+        w.key("name");
+        w.value(std::string("temporary"));
+        w.end_object();
+        CHECK_EQUAL(
+            "{\"id\":42,\"big\":-9007199254740993,\"ratio\":0.1,"
+            "\"flags\":[true,false,null,[],{}],\"name\":\"temporary\"}",
+            out);
+    }
+
+    TEST(writer_escapes_and_embeds_values) {
+        const auto& document = sajson::parse(sajson::single_allocation(), "{\"b\": [1, \"\\u0002\"]}");
+        assert(success(document));
+
+        std::string out;
+        sajson::writer<std::string> w(out);
+        w.begin_array();
+        w.value("quote\" backslash\\ tab\t end"sv);
+        w.begin_object();
+        w.key("line\nbreak");
+        w.value(document.get_root());
+        w.end_object();
+        w.end_array();
+        CHECK_EQUAL(
+            "[\"quote\\\" backslash\\\\ tab\\t end\",{\"line\\nbreak\":{\"b\":[1,\"\\u0002\"]}}]",
+            out);
+
+        const auto& reparsed = sajson::parse(sajson::single_allocation(), out);
+        assert(success(reparsed));
+        CHECK_EQUAL("quote\" backslash\\ tab\t end"sv, reparsed.get_root().get_array_element(0).as_string());
+    }
+}
+
+SUITE(parallel_dump) {
+    // Big enough to be split at a few levels: a large array of records,
+    // a large nested object, escapes, doubles, and empty structures.
+    static std::string make_parallel_input() {
+        std::string input = "{\"empty\": [], \"records\": [";
+        for (int i = 0; i < 400; ++i) {
+            input += i ? "," : "";
+            input += "{\"id\": " + std::to_string(i) + ", \"name\": \"item\\t" + std::to_string(i)
+                + "\", \"score\": " + std::to_string(i) + ".25, \"tags\": [null, true, false, {}]}";
+        }
+        input += "], \"nested\": {";
+        for (int i = 0; i < 300; ++i) {
+            input += i ? "," : "";
+            input += "\"k\\u00e9" + std::to_string(i) + "\": [[" + std::to_string(i) + "], \"\\\"\"]";
+        }
+        input += "}, \"last\": null}";
+        return input;
+    }
+
+    TEST(dump_parallel_matches_dump) {
+        std::string input = make_parallel_input();
+        const auto& document = sajson::parse(sajson::dynamic_allocation(), input);
+        assert(success(document));
+        const value& root = document.get_root();
+        const std::string expected = sajson::to_string(root);
+
+        for (size_t chunk_words: { 1, 2, 7, 64, 1000, 100000 }) {
+            sajson::parallel_dump_options options;
+            options.thread_count = 4;
+            options.chunk_words = chunk_words;
+
+            std::string out;
+            sajson::dump_parallel(out, root, options);
+            CHECK_EQUAL(expected, out);
+            CHECK_EQUAL(expected, sajson::to_string_parallel(root, options));
+            CHECK_EQUAL(
+                sajson::to_string(root.get_value_of_key("records"sv)),
+                sajson::to_string_parallel(root.get_value_of_key("records"sv), options));
+        }
+    }
+
+    TEST(dump_parallel_read_only_and_small_values) {
+        const std::string input = make_parallel_input();
+        const auto& document = sajson::parse_read_only(sajson::single_allocation(), input);
+        assert(success(document));
+        sajson::parallel_dump_options options;
+        options.thread_count = 3;
+        options.chunk_words = 5;
+        CHECK_EQUAL(sajson::to_string(document.get_root()), sajson::to_string_parallel(document.get_root(), options));
+
+        const auto& small = sajson::parse(sajson::single_allocation(), "[\"a\\nb\", []]");
+        assert(success(small));
+        CHECK_EQUAL("[\"a\\nb\",[]]", sajson::to_string_parallel(small.get_root(), options));
+        CHECK_EQUAL("\"a\\nb\"", sajson::to_string_parallel(small.get_root().get_array_element(0), options));
+    }
+
+    static std::vector<std::string> ndjson_lines(const std::string& text) {
+        std::vector<std::string> lines;
+        size_t begin = 0;
+        for (size_t end; (end = text.find('\n', begin)) != std::string::npos; begin = end + 1) {
+            lines.push_back(text.substr(begin, end - begin));
+        }
+        CHECK_EQUAL(text.size(), begin);
+        return lines;
+    }
+
+    TEST(dump_ndjson_ordered_and_unordered) {
+        std::string input = make_parallel_input();
+        const auto& document = sajson::parse(sajson::single_allocation(), input);
+        assert(success(document));
+        const value& records = document.get_root().get_value_of_key("records"sv);
+
+        std::vector<value> values;
+        std::string expected;
+        for (size_t i = 0; i < records.get_length(); ++i) {
+            values.push_back(records.get_array_element(i));
+            expected += sajson::to_string(values.back()) + "\n";
+        }
+
+        sajson::ndjson_options options;
+        options.thread_count = 4;
+        options.values_per_chunk = 7;
+        for (size_t budget: { 0, 1, 1000, 1 << 20 }) {
+            options.memory_budget = budget;
+            options.ordered = true;
+            std::string out;
+            sajson::dump_ndjson(out, values, options);
+            CHECK_EQUAL(expected, out);
+
+            options.ordered = false;
+            std::string unordered;
+            sajson::dump_ndjson(unordered, values, options);
+            std::vector<std::string> lines = ndjson_lines(unordered);
+            std::vector<std::string> expected_lines = ndjson_lines(expected);
+            std::sort(lines.begin(), lines.end());
+            std::sort(expected_lines.begin(), expected_lines.end());
+            CHECK(expected_lines == lines);
+        }
+
+        std::string empty;
+        sajson::dump_ndjson(empty, std::vector<value>(), options);
+        CHECK_EQUAL("", empty);
+    }
+
+#if SAJSON_HAVE_WRITEV
+    TEST(write_parallel_matches_to_string) {
+        std::string input = make_parallel_input();
+        const auto& document = sajson::parse(sajson::single_allocation(), input);
+        assert(success(document));
+        const value& root = document.get_root();
+        sajson::parallel_dump_options options;
+        options.thread_count = 4;
+        options.chunk_words = 16;
+
+        char path[] = "/tmp/sajson-test-XXXXXX";
+        int fd = mkstemp(path);
+        assert(fd >= 0);
+        const size_t written = sajson::write_parallel(fd, root, options);
+        std::string contents(written, '\0');
+        ssize_t n = pread(fd, &contents[0], written, 0);
+        CHECK_EQUAL(static_cast<ssize_t>(written), n);
+        close(fd);
+        unlink(path);
+        CHECK_EQUAL(sajson::to_string(root), contents);
+    }
+
+    TEST(write_ndjson_through_slow_pipe) {
+        std::string input = make_parallel_input();
+        const auto& document = sajson::parse(sajson::single_allocation(), input);
+        assert(success(document));
+        const value& nested = document.get_root().get_value_of_key("nested"sv);
+        std::vector<value> values;
+        std::string expected;
+        for (int round = 0; round < 20; ++round) {
+            for (size_t i = 0; i < nested.get_length(); ++i) {
+                values.push_back(nested.get_object_value(i));
+                expected += sajson::to_string(values.back()) + "\n";
+            }
+        }
+
+        // The pipe fills long before the reader gets going, so the
+        // writer blocks and the budget holds the threads back.
+        int fds[2];
+        int rv = pipe(fds);
+        assert(rv == 0);
+        (void)rv;
+        std::string received;
+        std::thread reader([&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            char chunk[4096];
+            ssize_t n;
+            while ((n = read(fds[0], chunk, sizeof(chunk))) > 0) {
+                received.append(chunk, static_cast<size_t>(n));
+            }
+        });
+        sajson::ndjson_options options;
+        options.thread_count = 3;
+        options.values_per_chunk = 10;
+        options.memory_budget = 4096;
+        CHECK_EQUAL(expected.size(), sajson::write_ndjson(fds[1], values, options));
+        close(fds[1]);
+        reader.join();
+        close(fds[0]);
+        CHECK_EQUAL(expected, received);
+    }
+#endif
+}
+
+SUITE(minify) {
+    // Drops whitespace outside strings one byte at a time.
+    static std::string reference_minify(const std::string& text) {
+        std::string out;
+        bool in_string = false;
+        for (size_t i = 0; i < text.size(); ++i) {
+            const char c = text[i];
+            if (in_string) {
+                out += c;
+                if (c == '\\' && i + 1 < text.size()) {
+                    out += text[++i];
+                } else if (c == '"') {
+                    in_string = false;
+                }
+            } else if (c == '"') {
+                out += c;
+                in_string = true;
+            } else if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+                out += c;
+            }
+        }
+        return out;
+    }
+
+    TEST(minify_keeps_strings_and_escaped_quotes) {
+        // Slide the tricky parts across the 16-byte blocks.
+        for (size_t padding = 0; padding < 40; ++padding) {
+            std::string text = "[" + std::string(padding, ' ') + "\"a \\\" [ b\", \t\r\n"
+                + std::string(padding % 7, '\n') + "\"\\\\\", \"  \\\\\\\"  \" ,\n { \"k\\u0041 y\" :"
+                + std::string(padding, '\t') + " [ 1 , 2.5e3 , true ] , \"\" : null } ]  ";
+            std::string expected = reference_minify(text);
+            const sajson::minify_result result = sajson::minify(text, true);
+            CHECK(result.valid);
+            CHECK_EQUAL(expected, text);
+            CHECK_EQUAL(expected.size(), result.length);
+        }
+    }
+
+    TEST(minify_pretty_document_matches_dump) {
+        std::string input = "{\"records\": [";
+        for (int i = 0; i < 200; ++i) {
+            input += i ? "," : "";
+            input += "{\"id\": " + std::to_string(i) + ", \"name\": \"item \\\"" + std::to_string(i)
+                + "\\\"\", \"values\": [" + std::to_string(i * 7) + ", [], {}, null, false]}";
+        }
+        input += "]}";
+        const auto& document = sajson::parse(sajson::single_allocation(), input);
+        assert(success(document));
+
+        std::string pretty = sajson::to_pretty_string(document.get_root());
+        const size_t pretty_length = pretty.size();
+        CHECK(sajson::minify(pretty).valid);
+        CHECK_EQUAL(sajson::to_string(document.get_root()), pretty);
+        CHECK(pretty.size() < pretty_length);
+
+        const auto& reparsed = sajson::parse(sajson::single_allocation(), pretty);
+        CHECK(success(reparsed));
+    }
+
+    TEST(minify_validation) {
+        const char* const invalid[] = {
+            "[\"unterminated   ]",
+            "[\"bad escape \\x\"]",
+            "[\"bad unicode \\u12g4\"]",
+            "[\"short unicode \\u12\"]",
+            "[\"control \x01 character\"]",
+            "[\"trailing backslash\\",
+            "[1, 2",
+            "{\"a\" 1}",
+            "   ",
+            "[1 2]",
+            "{\"a\": 1 2}",
+            "[- 1]",
+            "[1.5 e3]",
+            "[tr ue]",
+        };
+        for (const char* text: invalid) {
+            std::string unchecked = text;
+            CHECK(sajson::minify(unchecked).valid);
+            std::string checked = text;
+            CHECK(!sajson::minify(checked, true).valid);
+        }
+
+        // Whitespace between tokens is kept rather than merging them,
+        // wherever it falls in the 16-byte blocks.
+        for (size_t padding = 1; padding < 40; ++padding) {
+            std::string separated = std::string(padding % 17, ' ') + "[1"
+                + std::string(padding, ' ') + "2,\t" + std::string(padding, '\n')
+                + "-\r\n1, tr" + std::string(padding, '\t') + "ue]";
+            CHECK(!sajson::minify(separated, true).valid);
+            CHECK_EQUAL("[1 2,- 1,tr ue]", separated);
+        }
+
+        std::string unterminated = "[ \"a b   ";
+        sajson::minify(unterminated);
+        CHECK_EQUAL("[\"a b   ", unterminated);
+
+        std::string valid = " { \"a\\/\\b\\f\\n\\r\\t\\u00e9\" : [ ] } ";
+        CHECK(sajson::minify(valid, true).valid);
+        CHECK_EQUAL("{\"a\\/\\b\\f\\n\\r\\t\\u00e9\":[]}", valid);
+    }
+}
+
+SUITE(binary) {
+    static std::string hex(const std::string& bytes) {
+        static const char digits[] = "0123456789abcdef";
+        std::string out;
+        for (unsigned char c: bytes) {
+            out += digits[c >> 4];
+            out += digits[c & 15];
+        }
+        return out;
+    }
+
+    TEST(msgpack_compact_encodings) {
+        const auto& document = sajson::parse(
+            sajson::single_allocation(),
+            "[0, 127, 128, 255, 256, 65536, -1, -32, -33, -129, -32769,"
+            " 1.5, 0.1, null, false, true, \"ab\", {\"k\": []}]");
+        assert(success(document));
+        CHECK_EQUAL(
+            "dc0012"
+            "00" "7f" "cc80" "ccff" "cd0100" "ce00010000"
+            "ff" "e0" "d0df" "d1ff7f" "d2ffff7fff"
+            "ca3fc00000" "cb3fb999999999999a"
+            "c0" "c2" "c3" "a26162" "81a16b90",
+            hex(sajson::to_msgpack(document.get_root())));
+
+        const std::string long_string(300, 'x');
+        const auto& strings = sajson::parse(
+            sajson::single_allocation(),
+            "[\"" + std::string(31, 'x') + "\", \"" + std::string(32, 'x') + "\", \"" + long_string + "\"]");
+        assert(success(strings));
+        const std::string packed = sajson::to_msgpack(strings.get_root());
+        CHECK_EQUAL("93bf", hex(packed.substr(0, 2)));
+        CHECK_EQUAL("d920", hex(packed.substr(33, 2)));
+        CHECK_EQUAL("da012c", hex(packed.substr(67, 3)));
+        CHECK_EQUAL(70 + long_string.size(), packed.size());
+    }
+
+    TEST(cbor_preferred_serialization) {
+        const auto& document = sajson::parse(
+            sajson::single_allocation(),
+            "[0, 23, 24, 256, 65536, -1, -25, -2147483648,"
+            " 1.5, -0.0, 65504.0, 65520.0, 5.960464477539063e-8, 0.1, 1e39,"
+            " null, false, true, \"ab\", {\"k\": []}]");
+        assert(success(document));
+        CHECK_EQUAL(
+            "94"
+            "00" "17" "1818" "190100" "1a00010000" "20" "3818" "3a7fffffff"
+            "f93e00" "f98000" "f97bff" "fa477ff000" "f90001" "fb3fb999999999999a"
+            "fb48078287f49c4a1d"
+            "f6" "f4" "f5" "626162" "a1616b80",
+            hex(sajson::to_cbor(document.get_root())));
+    }
+}
+
 int main() { return UnitTest::RunAllTests(); }